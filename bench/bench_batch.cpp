@@ -0,0 +1,117 @@
+#include "codegen.h"
+#include "jit.h"
+#include "optimizer.h"
+#include "parser.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+/* Evaluates a three argument definition over many rows, once by calling
+ * the JIT compiled scalar function per row and once through its batch
+ * entry point, and checks that both give the same results.
+ *
+ *   guppy_bench_batch [thousand rows] [-O<n>]
+ */
+
+static const char MODEL_SOURCE[] =
+    "defn model(price, rate, years) {\n"
+    "  price * (1 + rate * years) - (years < 2) * price * 0.05 + rate * rate * 0.5\n"
+    "}\n";
+
+typedef double (*ScalarModel)(double, double, double);
+
+template <typename F>
+static double
+best_seconds(unsigned repetitions, F run)
+{
+    double best = 1e30;
+    for (unsigned r = 0; r < repetitions; r++) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        auto stop = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(stop - start).count());
+    }
+    return best;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t rows = 64000;
+    unsigned opt_level = 2;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] == 'O'
+                && argv[i][2] >= '0' && argv[i][2] <= '3' && argv[i][3] == '\0') {
+            opt_level = argv[i][2] - '0';
+            continue;
+        }
+
+        char *end;
+        rows = std::strtoul(argv[i], &end, 10) * 1000;
+        if (*end != '\0' || rows == 0) {
+            std::cerr << "usage: guppy_bench_batch [thousand rows] [-O<n>]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<double> price(rows), rate(rows), years(rows);
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> price_dist(1.0, 1000.0);
+    std::uniform_real_distribution<double> rate_dist(0.0, 0.1);
+    std::uniform_real_distribution<double> years_dist(0.0, 10.0);
+    for (size_t i = 0; i < rows; i++) {
+        price[i] = price_dist(rng);
+        rate[i] = rate_dist(rng);
+        years[i] = years_dist(rng);
+    }
+
+    try {
+        Parser parser;
+        AST ast = parser.parse_text(MODEL_SOURCE);
+
+        Optimizer optimizer(opt_level);
+        UnitGeneratorContext context;
+        context.set_optimizer(&optimizer);
+
+        GuppyJIT jit;
+        jit.execute(ast, context);
+
+        auto scalar = reinterpret_cast<ScalarModel>(jit.lookup("model"));
+        BatchFunction batch = jit.compile_batch(*static_cast<const DefnASTNode*>(ast[0]), context);
+
+        std::vector<double> scalar_out(rows), batch_out(rows);
+        const double *columns[] = { price.data(), rate.data(), years.data() };
+
+        double scalar_seconds = best_seconds(50, [&]() {
+            for (size_t i = 0; i < rows; i++)
+                scalar_out[i] = scalar(price[i], rate[i], years[i]);
+        });
+
+        double batch_seconds = best_seconds(50, [&]() {
+            batch(columns, batch_out.data(), rows);
+        });
+
+        if (std::memcmp(scalar_out.data(), batch_out.data(), rows * sizeof(double)) != 0) {
+            std::cerr << "guppy_bench_batch: batch results differ from scalar results" << std::endl;
+            return 1;
+        }
+
+        std::cout << "guppy_bench_batch: " << rows << " rows, -O" << opt_level << std::endl;
+        std::cout << "  scalar calls  " << scalar_seconds * 1000.0 << " ms, "
+            << rows / scalar_seconds / 1e6 << " Mrow/s" << std::endl;
+        std::cout << "  batch         " << batch_seconds * 1000.0 << " ms, "
+            << rows / batch_seconds / 1e6 << " Mrow/s" << std::endl;
+        std::cout << "  speedup       " << scalar_seconds / batch_seconds << "x" << std::endl;
+    } catch (const std::runtime_error &err) {
+        std::cerr << "guppy_bench_batch: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,203 @@
+#include "ast_optimizer.h"
+#include "codegen.h"
+#include "jit.h"
+#include "optimizer.h"
+#include "parser.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+/* Compiles reduction heavy kernels under each floating point mode and
+ * reports the throughput of per-row calls and of the batch entry point
+ * (see FunctionGen::generate_batch), relative to strict IEEE semantics,
+ * along with the largest relative difference from the strict results.
+ *
+ *   guppy_bench_fp [thousand rows] [-O<n>]
+ */
+
+static const size_t KERNEL_ARGS = 8;
+
+typedef double (*Kernel)(double, double, double, double, double, double, double, double);
+
+struct KernelSource {
+    const char *name;
+    std::string source;
+};
+
+static std::string
+argument_list(void)
+{
+    std::string args;
+    for (size_t i = 0; i < KERNEL_ARGS; i++)
+        args += (i ? ", x" : "x") + std::to_string(i);
+    return args;
+}
+
+/* the sum of the products of every pair of arguments: 28 multiplies
+ * feeding one long chain of additions */
+static KernelSource
+pairwise_kernel(void)
+{
+    std::string body;
+    for (size_t i = 0; i < KERNEL_ARGS; i++) {
+        for (size_t j = i + 1; j < KERNEL_ARGS; j++) {
+            if (!body.empty()) body += " + ";
+            body += "x" + std::to_string(i) + " * x" + std::to_string(j);
+        }
+    }
+    return { "pairwise", "defn kernel(" + argument_list() + ") { " + body + " }\n" };
+}
+
+/* a degree 16 polynomial in x0 with coefficients from the other
+ * arguments, in Horner form: a chain of multiply-adds */
+static KernelSource
+horner_kernel(void)
+{
+    std::string body = "x1";
+    for (size_t k = 0; k < 16; k++)
+        body = "(" + body + ") * x0 + x" + std::to_string(1 + (k + 1) % (KERNEL_ARGS - 1));
+    return { "horner", "defn kernel(" + argument_list() + ") { " + body + " }\n" };
+}
+
+/* the same kind of polynomial written as a sum of powers */
+static KernelSource
+power_sum_kernel(void)
+{
+    std::string body;
+    for (size_t k = 0; k <= 12; k++) {
+        if (!body.empty()) body += " + ";
+        body += "x" + std::to_string(1 + k % (KERNEL_ARGS - 1)) + " * x0 ^ " + std::to_string(k);
+    }
+    return { "power-sum", "defn kernel(" + argument_list() + ") { " + body + " }\n" };
+}
+
+template <typename F>
+static double
+best_seconds(unsigned repetitions, F run)
+{
+    double best = 1e30;
+    for (unsigned r = 0; r < repetitions; r++) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        auto stop = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(stop - start).count());
+    }
+    return best;
+}
+
+struct Measurement {
+    double scalar_seconds;
+    double batch_seconds;
+    std::vector<double> out;
+};
+
+static Measurement
+measure(const KernelSource &kernel, const char *mode, unsigned opt_level,
+        const std::vector<std::vector<double>> &columns)
+{
+    size_t rows = columns[0].size();
+
+    Parser parser;
+    AST ast = parser.parse_text(kernel.source);
+    if (opt_level >= 1) optimize_ast(ast);
+
+    Optimizer optimizer(opt_level);
+    UnitGeneratorContext context;
+    context.set_optimizer(&optimizer);
+    context.set_fp_flags(parse_fp_mode(mode));
+
+    GuppyJIT jit;
+    jit.execute(ast, context);
+    auto scalar = reinterpret_cast<Kernel>(jit.lookup("kernel"));
+    BatchFunction batch = jit.compile_batch(*static_cast<const DefnASTNode*>(ast[0]), context);
+
+    const double *column_data[KERNEL_ARGS];
+    for (size_t k = 0; k < KERNEL_ARGS; k++) column_data[k] = columns[k].data();
+
+    Measurement m;
+    m.out.resize(rows);
+    std::vector<double> scalar_out(rows);
+
+    m.scalar_seconds = best_seconds(20, [&]() {
+        for (size_t i = 0; i < rows; i++)
+            scalar_out[i] = scalar(column_data[0][i], column_data[1][i], column_data[2][i],
+                    column_data[3][i], column_data[4][i], column_data[5][i],
+                    column_data[6][i], column_data[7][i]);
+    });
+
+    m.batch_seconds = best_seconds(20, [&]() {
+        batch(column_data, m.out.data(), rows);
+    });
+
+    return m;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t rows = 64000;
+    unsigned opt_level = 3;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] == 'O'
+                && argv[i][2] >= '0' && argv[i][2] <= '3' && argv[i][3] == '\0') {
+            opt_level = argv[i][2] - '0';
+            continue;
+        }
+
+        char *end;
+        rows = std::strtoul(argv[i], &end, 10) * 1000;
+        if (*end != '\0' || rows == 0) {
+            std::cerr << "usage: guppy_bench_fp [thousand rows] [-O<n>]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<std::vector<double>> columns(KERNEL_ARGS, std::vector<double>(rows));
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    for (auto &column : columns) {
+        for (double &value : column) value = dist(rng);
+    }
+
+    static const char *const MODES[] = { "strict", "contract", "contract,reassoc", "fast" };
+
+    std::cout << "guppy_bench_fp: " << rows << " rows, -O" << opt_level << std::endl;
+
+    try {
+        for (const KernelSource &kernel : { pairwise_kernel(), horner_kernel(), power_sum_kernel() }) {
+            std::cout << kernel.name << ":" << std::endl;
+
+            Measurement strict = measure(kernel, MODES[0], opt_level, columns);
+            for (const char *mode : MODES) {
+                Measurement m = mode == MODES[0] ? strict : measure(kernel, mode, opt_level, columns);
+
+                double max_error = 0;
+                for (size_t i = 0; i < rows; i++) {
+                    double scale = std::max(std::fabs(strict.out[i]), 1.0);
+                    max_error = std::max(max_error, std::fabs(m.out[i] - strict.out[i]) / scale);
+                }
+
+                std::cout << "  " << std::left;
+                std::cout.width(18);
+                std::cout << mode << std::right
+                    << " calls " << rows / m.scalar_seconds / 1e6 << " Mrow/s ("
+                    << strict.scalar_seconds / m.scalar_seconds << "x), batch "
+                    << rows / m.batch_seconds / 1e6 << " Mrow/s ("
+                    << strict.batch_seconds / m.batch_seconds << "x), max rel. diff "
+                    << max_error << std::endl;
+            }
+        }
+    } catch (const std::runtime_error &err) {
+        std::cerr << "guppy_bench_fp: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include "lexer.h"
+#include "program_generator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+int
+main(int argc, char **argv)
+{
+    size_t megabytes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+    unsigned repetitions = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 5;
+
+    std::string source = generate_source(megabytes << 20);
+
+    /* the first run includes faulting in the token vector, later runs
+     * reuse its storage and measure the lexer itself */
+    std::vector<Token> tokens;
+    double first_seconds = 0.0;
+    double best_seconds = 1e30;
+
+    for (unsigned r = 0; r < repetitions; r++) {
+        tokens.clear();
+
+        auto start = std::chrono::steady_clock::now();
+        if (r == 0) {
+            tokens = tokenize(source);
+        } else {
+            tokenize(source, tokens, 1);
+        }
+        auto stop = std::chrono::steady_clock::now();
+
+        double seconds = std::chrono::duration<double>(stop - start).count();
+        if (r == 0) first_seconds = seconds;
+        best_seconds = std::min(best_seconds, seconds);
+    }
+
+    auto report = [&source, &tokens](const char *label, double seconds) {
+        std::cout << "  " << label << ": " << seconds * 1000.0 << " ms, "
+            << source.size() / seconds / (1 << 20) << " MiB/s, "
+            << tokens.size() / seconds / 1e6 << " Mtokens/s" << std::endl;
+    };
+
+    std::cout << "lexer: " << source.size() << " bytes, " << tokens.size() << " tokens" << std::endl;
+    report("first run", first_seconds);
+    report("best run", best_seconds);
+
+    return 0;
+}
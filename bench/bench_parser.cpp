@@ -0,0 +1,109 @@
+#include "parser.h"
+#include "program_generator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+/* every heap allocation in the process goes through these, so the
+ * allocations made while parsing can be counted */
+static size_t allocation_count = 0;
+static size_t allocation_bytes = 0;
+
+void*
+operator new(size_t size)
+{
+    allocation_count++;
+    allocation_bytes += size;
+    if (void *p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void
+operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void
+operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+void*
+operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void
+operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+void
+operator delete[](void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t megabytes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 16;
+    unsigned repetitions = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 5;
+
+    std::string source = generate_source(megabytes << 20);
+
+    /* the first run includes interning every name and growing the
+     * parser's token vector, later runs reuse both */
+    Parser parser;
+    double first_seconds = 0.0;
+    double best_seconds = 1e30;
+    size_t allocations = 0, bytes = 0;
+    size_t statements = 0;
+    ASTArena::Stats arena_stats = {};
+
+    for (unsigned r = 0; r < repetitions; r++) {
+        size_t count_before = allocation_count, bytes_before = allocation_bytes;
+
+        auto start = std::chrono::steady_clock::now();
+        AST ast = parser.parse_text(source);
+        auto stop = std::chrono::steady_clock::now();
+
+        allocations = allocation_count - count_before;
+        bytes = allocation_bytes - bytes_before;
+        statements = ast.size();
+        arena_stats = ast.get_arena().stats();
+
+        double seconds = std::chrono::duration<double>(stop - start).count();
+        if (r == 0) first_seconds = seconds;
+        best_seconds = std::min(best_seconds, seconds);
+    }
+
+    auto report = [&source, &arena_stats](const char *label, double seconds) {
+        std::cout << "  " << label << ": " << seconds * 1000.0 << " ms, "
+            << source.size() / seconds / (1 << 20) << " MiB/s, "
+            << arena_stats.objects / seconds / 1e6 << " Mnodes/s" << std::endl;
+    };
+
+    std::cout << "parser: " << source.size() << " bytes, " << statements << " statements, "
+        << arena_stats.objects << " nodes" << std::endl;
+    report("first run", first_seconds);
+    report("best run", best_seconds);
+
+    /* what is left over once the arena blocks are accounted for is the
+     * statement list of the AST and anything the parser itself allocated */
+    size_t other = allocations - std::min(allocations, arena_stats.blocks);
+    std::cout << "  allocations (last run): " << allocations << " (" << bytes << " bytes), "
+        << arena_stats.blocks << " arena blocks, " << other << " other, "
+        << (double) other / std::max<size_t>(arena_stats.objects, 1) << " per node" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,215 @@
+#include "ast_optimizer.h"
+#include "codegen.h"
+#include "jit.h"
+#include "lexer.h"
+#include "optimizer.h"
+#include "parallel_codegen.h"
+#include "parser.h"
+#include "program_generator.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+/* Times each phase of the compiler separately on synthetic programs of
+ * every shape: lexing, parsing, AST optimization (from -O1), IR generation, optimization (function
+ * pipelines over every function, then the module pipeline) and JIT
+ * compilation of the whole module to machine code. With -j<n>, n > 1,
+ * codegen and optimization are also run on n worker threads.
+ *
+ *   guppy_bench [megabytes] [-O<n>] [-j<n>] [shape ...]
+ */
+
+static double
+peak_rss_mib(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0; // kilobytes on linux
+}
+
+class PhaseTimer {
+    std::chrono::steady_clock::time_point start;
+
+public:
+    double seconds() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    PhaseTimer() : start(std::chrono::steady_clock::now()) {}
+};
+
+struct ProgramSize {
+    size_t bytes;
+    size_t tokens;
+    size_t nodes;
+};
+
+static void
+report(const char *phase, double seconds, const ProgramSize &size)
+{
+    std::cout << "  " << std::left << std::setw(10) << phase << std::right << std::fixed
+        << std::setprecision(1) << std::setw(10) << seconds * 1000.0 << " ms"
+        << std::setw(10) << size.bytes / seconds / (1 << 20) << " MiB/s"
+        << std::setprecision(2)
+        << std::setw(10) << size.tokens / seconds / 1e6 << " Mtok/s"
+        << std::setw(10) << size.nodes / seconds / 1e6 << " Mnode/s"
+        << std::setprecision(1)
+        << std::setw(10) << peak_rss_mib() << " MiB peak" << std::endl;
+
+    std::cout.unsetf(std::ios::floatfield);
+}
+
+static void
+run_shape(ProgramShape shape, size_t bytes, unsigned opt_level, unsigned jobs)
+{
+    std::string source = generate_program(shape, bytes);
+    ProgramSize size = { source.size(), 0, 0 };
+
+    PhaseTimer lex_timer;
+    std::vector<Token> tokens = tokenize(source);
+    double lex_seconds = lex_timer.seconds();
+    size.tokens = tokens.size();
+    tokens = std::vector<Token>();
+
+    Parser parser;
+    PhaseTimer parse_timer;
+    AST ast = parser.parse_text(source);
+    double parse_seconds = parse_timer.seconds();
+    size.nodes = ast.get_arena().stats().objects;
+
+    std::cout << shape_name(shape) << ": " << size.bytes << " bytes, " << size.tokens
+        << " tokens, " << size.nodes << " nodes, " << ast.size() << " statements" << std::endl;
+    report("lex", lex_seconds, size);
+    report("parse", parse_seconds, size);
+
+    if (opt_level >= 1) {
+        PhaseTimer ast_opt_timer;
+        ASTOptimizerStats ast_stats = optimize_ast(ast);
+        report("ast-opt", ast_opt_timer.seconds(), size);
+        std::cout << "    " << ast_stats.nodes_out << " of " << ast_stats.nodes_in
+            << " expression nodes left, " << ast_stats.folded << " folded, "
+            << ast_stats.simplified << " simplified, " << ast_stats.shared << " shared" << std::endl;
+    }
+
+    /* generate without an optimizer attached so that IR construction is
+     * timed on its own */
+    Optimizer optimizer(opt_level);
+    UnitGeneratorContext context;
+
+    PhaseTimer codegen_timer;
+    FunctionGen fgen(&context);
+    for (auto const &node : ast) {
+        fgen.visit(node);
+    }
+    double codegen_seconds = codegen_timer.seconds();
+    report("codegen", codegen_seconds, size);
+
+    context.set_optimizer(&optimizer);
+    PhaseTimer optimize_timer;
+    for (auto &function : *context.llvm_module) {
+        if (!function.isDeclaration())
+            optimizer.run_on_function(function);
+    }
+    optimizer.run_on_module(*context.llvm_module);
+    double optimize_seconds = optimize_timer.seconds();
+    report("optimize", optimize_seconds, size);
+
+    unsigned workers = codegen_worker_count(ast, jobs);
+    if (workers > 1) {
+        Optimizer parallel_optimizer(opt_level);
+        UnitGeneratorContext parallel_context;
+        parallel_context.set_optimizer(&parallel_optimizer);
+
+        PhaseTimer parallel_timer;
+        auto units = generate_in_parallel(ast, parallel_context, workers, true);
+        double parallel_seconds = parallel_timer.seconds();
+
+        report("parallel", parallel_seconds, size);
+        std::cout << "    codegen + optimize + object emission on " << workers << " threads"
+            << std::endl;
+    }
+
+    /* the module is only compiled once something in it is looked up,
+     * and LLJIT compiles the whole module at that point */
+    std::string first_defn;
+    for (auto &function : *context.llvm_module) {
+        if (!function.isDeclaration() && function.hasExternalLinkage()) {
+            first_defn = function.getName().str();
+            break;
+        }
+    }
+
+    context.set_optimizer(nullptr);
+    GuppyJIT jit;
+    PhaseTimer jit_timer;
+    jit.add_unit(context);
+    if (!first_defn.empty()) jit.lookup(first_defn);
+    report("jit", jit_timer.seconds(), size);
+
+    std::cout << std::endl;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t megabytes = 1;
+    unsigned opt_level = 2;
+    unsigned jobs = 1;
+    std::vector<ProgramShape> shapes;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] == 'O'
+                && argv[i][2] >= '0' && argv[i][2] <= '3' && argv[i][3] == '\0') {
+            opt_level = argv[i][2] - '0';
+            continue;
+        }
+
+        if (argv[i][0] == '-' && argv[i][1] == 'j' && argv[i][2] != '\0') {
+            jobs = std::strtoul(argv[i] + 2, nullptr, 10);
+            continue;
+        }
+
+        bool matched = false;
+        for (ProgramShape shape : ALL_PROGRAM_SHAPES) {
+            if (std::strcmp(argv[i], shape_name(shape)) == 0) {
+                shapes.push_back(shape);
+                matched = true;
+            }
+        }
+
+        if (!matched) {
+            char *end;
+            megabytes = std::strtoul(argv[i], &end, 10);
+            if (*end != '\0' || megabytes == 0) {
+                std::cerr << "usage: guppy_bench [megabytes] [-O<n>] [-j<n>] "
+                    "[wide|nested|call-chain|extern-heavy ...]" << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    if (shapes.empty())
+        shapes.assign(std::begin(ALL_PROGRAM_SHAPES), std::end(ALL_PROGRAM_SHAPES));
+
+    initialize_native_target();
+
+    std::cout << "guppy_bench: " << megabytes << " MiB per shape, -O" << opt_level << std::endl
+        << std::endl;
+
+    try {
+        for (ProgramShape shape : shapes)
+            run_shape(shape, megabytes << 20, opt_level, jobs);
+    } catch (const std::runtime_error &err) {
+        std::cerr << "guppy_bench: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,195 @@
+#include "ast_optimizer.h"
+#include "parser.h"
+#include "vm.h"
+
+#ifdef GUPPY_HAVE_LLVM
+#include "codegen.h"
+#include "jit.h"
+#include "optimizer.h"
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Compares the bytecode VM with the JIT on a small program: the latency
+ * from a fresh process to the program's first result, which is what a
+ * short lived process evaluating a few formulas pays, and the cost of
+ * each call once everything is compiled.
+ *
+ * Each startup sample forks a child that parses, compiles and runs the
+ * program, and sends its first result back through a pipe; the median
+ * over all samples is reported. Library loading and static initializers
+ * are not included, since the child inherits them.
+ *
+ *   guppy_bench_vm [samples] [-O<n>]
+ */
+
+static const char PROGRAM_SOURCE[] =
+    "extern sin(x)\n"
+    "defn sq(x) { x * x }\n"
+    "defn binary@ 45 (a, b) { sq(a) + sq(b) }\n"
+    "defn model(price, rate, years) {\n"
+    "  price * (1 + rate * years) - (years < 2) * price * 0.05 + rate @ sin(years)\n"
+    "}\n";
+
+static const char FIRST_RESULT_SOURCE[] = "model(100, 0.05, 3)\n";
+
+static const size_t STEADY_CALLS = 1000000;
+
+typedef double (*Model)(double, double, double);
+
+static AST
+parse(const std::string &source, unsigned opt_level)
+{
+    Parser parser;
+    AST ast = parser.parse_text(source);
+    if (opt_level >= 1) optimize_ast(ast);
+    return ast;
+}
+
+/* median time from fork() until the child has sent back first_result() */
+template <typename F>
+static double
+median_startup_seconds(unsigned samples, F first_result, double &value)
+{
+    std::vector<double> seconds;
+
+    for (unsigned s = 0; s < samples; s++) {
+        int fds[2];
+        if (pipe(fds) != 0) throw std::runtime_error("pipe failed");
+
+        auto start = std::chrono::steady_clock::now();
+        pid_t pid = fork();
+        if (pid < 0) throw std::runtime_error("fork failed");
+
+        if (pid == 0) {
+            close(fds[0]);
+            try {
+                double result = first_result();
+                if (write(fds[1], &result, sizeof(result)) != sizeof(result)) _exit(1);
+            } catch (const std::runtime_error &err) {
+                std::cerr << "guppy_bench_vm: " << err.what() << std::endl;
+                _exit(1);
+            }
+            _exit(0);
+        }
+
+        close(fds[1]);
+        ssize_t got = read(fds[0], &value, sizeof(value));
+        auto stop = std::chrono::steady_clock::now();
+        close(fds[0]);
+        waitpid(pid, nullptr, 0);
+
+        if (got != sizeof(value)) throw std::runtime_error("benchmark child failed");
+        seconds.push_back(std::chrono::duration<double>(stop - start).count());
+    }
+
+    std::sort(seconds.begin(), seconds.end());
+    return seconds[seconds.size() / 2];
+}
+
+/* seconds per call of model over STEADY_CALLS varying arguments */
+template <typename F>
+static double
+seconds_per_call(F model, double &checksum)
+{
+    auto start = std::chrono::steady_clock::now();
+    checksum = 0;
+    for (size_t i = 0; i < STEADY_CALLS; i++)
+        checksum += model(100.0 + i % 1000, 0.01 * (i % 7), 0.5 * (i % 13));
+    auto stop = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double>(stop - start).count() / STEADY_CALLS;
+}
+
+static void
+report(const char *tier, double startup, double per_call)
+{
+    std::cout << "  " << tier << "  first result " << startup * 1e3 << " ms, "
+        << per_call * 1e9 << " ns/call" << std::endl;
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned samples = 21;
+    unsigned opt_level = 2;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] == 'O'
+                && argv[i][2] >= '0' && argv[i][2] <= '3' && argv[i][3] == '\0') {
+            opt_level = argv[i][2] - '0';
+            continue;
+        }
+
+        char *end;
+        samples = std::strtoul(argv[i], &end, 10);
+        if (*end != '\0' || samples == 0) {
+            std::cerr << "usage: guppy_bench_vm [samples] [-O<n>]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::string first_program = std::string(PROGRAM_SOURCE) + FIRST_RESULT_SOURCE;
+    std::cout << "guppy_bench_vm: " << samples << " samples, -O" << opt_level << std::endl;
+
+    try {
+        double vm_value;
+        double vm_startup = median_startup_seconds(samples, [&]() {
+            VM vm;
+            return vm.execute(parse(first_program, opt_level)).front();
+        }, vm_value);
+
+        VM vm;
+        vm.execute(parse(PROGRAM_SOURCE, opt_level));
+        uint16_t model = vm.get_program().function_index.at(intern("model"));
+        double vm_checksum;
+        double vm_per_call = seconds_per_call([&](double price, double rate, double years) {
+            double args[] = { price, rate, years };
+            return vm.call(model, args);
+        }, vm_checksum);
+
+        report("vm ", vm_startup, vm_per_call);
+
+#ifdef GUPPY_HAVE_LLVM
+        double jit_value;
+        double jit_startup = median_startup_seconds(samples, [&]() {
+            Optimizer optimizer(opt_level);
+            UnitGeneratorContext context;
+            context.set_optimizer(&optimizer);
+            GuppyJIT jit;
+            return jit.execute(parse(first_program, opt_level), context).front();
+        }, jit_value);
+
+        Optimizer optimizer(opt_level);
+        UnitGeneratorContext context;
+        context.set_optimizer(&optimizer);
+        GuppyJIT jit;
+        jit.execute(parse(PROGRAM_SOURCE, opt_level), context);
+        auto compiled = reinterpret_cast<Model>(jit.lookup("model"));
+        double jit_checksum;
+        double jit_per_call = seconds_per_call(compiled, jit_checksum);
+
+        report("jit", jit_startup, jit_per_call);
+        std::cout << "  vm starts " << jit_startup / vm_startup << "x sooner, runs "
+            << vm_per_call / jit_per_call << "x slower per call" << std::endl;
+
+        if (vm_value != jit_value || vm_checksum != jit_checksum) {
+            std::cerr << "guppy_bench_vm: vm and jit results differ" << std::endl;
+            return 1;
+        }
+#endif
+    } catch (const std::runtime_error &err) {
+        std::cerr << "guppy_bench_vm: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include "program_generator.h"
+
+namespace {
+
+class Generator {
+    uint64_t state;
+    std::string src;
+    unsigned defn_count;
+
+    uint32_t next() {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        return static_cast<uint32_t>(state >> 33);
+    }
+
+    void literal() {
+        src += std::to_string(next() % 1000) + "." + std::to_string(next() % 100);
+    }
+
+    void leaf(const char* const *names, unsigned name_count) {
+        if (next() % 4 == 0) {
+            literal();
+        } else {
+            src += names[next() % name_count];
+        }
+    }
+
+    const char* op() {
+        static const char* const OPS[] = { "+", "-", "*", "<" };
+        return OPS[next() % 4];
+    }
+
+    /* definitions with long arithmetic bodies, indentation, comments
+     * and a spread of identifier lengths */
+    void wide_defn() {
+        src += "# definition number " + std::to_string(defn_count) + "\n";
+        src += "defn function" + std::to_string(defn_count++) + "(alpha, beta, x0)\n{\n";
+
+        unsigned terms = 8 + next() % 24;
+        for (unsigned i = 0; i < terms; i++) {
+            src += "    ";
+            switch (next() % 4) {
+                case 0: src += "alpha"; break;
+                case 1: src += "beta"; break;
+                case 2: src += "x0"; break;
+                default: literal(); break;
+            }
+            src += i + 1 < terms ? std::string(" ") + op() + "\n" : "\n";
+        }
+        src += "}\n\n";
+    }
+
+    /* a binary tree of the given depth that is deep on one side only,
+     * picked at random at every level */
+    void nested_expr(unsigned depth) {
+        static const char* const NAMES[] = { "a", "b", "c" };
+        if (depth == 0) {
+            leaf(NAMES, 3);
+            return;
+        }
+
+        src += "(";
+        if (next() % 2 == 0) {
+            nested_expr(depth - 1);
+            src += std::string(" ") + op() + " ";
+            leaf(NAMES, 3);
+        } else {
+            leaf(NAMES, 3);
+            src += std::string(" ") + op() + " ";
+            nested_expr(depth - 1);
+        }
+        src += ")";
+    }
+
+    void nested_defn() {
+        src += "defn nested" + std::to_string(defn_count++) + "(a, b, c) {\n    ";
+        nested_expr(32 + next() % 32);
+        src += "\n}\n\n";
+    }
+
+    /* chains of definitions in which each link calls the previous one */
+    void call_chain() {
+        unsigned chain = defn_count++;
+        unsigned length = 16 + next() % 48;
+        std::string prefix = "chain" + std::to_string(chain) + "n";
+
+        src += "defn " + prefix + "0(x, y) { x * y + 1 }\n";
+        for (unsigned i = 1; i < length; i++) {
+            src += "defn " + prefix + std::to_string(i) + "(x, y) { "
+                + prefix + std::to_string(i - 1) + "(x + ";
+            literal();
+            src += ", y * x) - y }\n";
+        }
+        src += "\n";
+    }
+
+    /* a block of forward declarations followed by definitions that call
+     * each other and the C math library */
+    void extern_block() {
+        static const char* const MATH[] = { "sin", "cos", "exp", "log", "sqrt", "tanh", "fabs" };
+        static const char* const NAMES[] = { "x", "y" };
+
+        unsigned block = defn_count++;
+        unsigned count = 8 + next() % 8;
+        std::string prefix = "ext" + std::to_string(block) + "n";
+
+        for (unsigned i = 0; i < count; i++)
+            src += "extern " + prefix + std::to_string(i) + "(x, y)\n";
+
+        for (unsigned i = 0; i < count; i++) {
+            src += "defn " + prefix + std::to_string(i) + "(x, y) {\n    ";
+            unsigned calls = 4 + next() % 8;
+            for (unsigned c = 0; c < calls; c++) {
+                src += MATH[next() % 7];
+                src += "(";
+                leaf(NAMES, 2);
+                src += std::string(") ") + op() + " ";
+            }
+
+            /* a call to a later definition in the same block, which only
+             * resolves through its extern declaration */
+            src += prefix + std::to_string((i + 1) % count) + "(y, ";
+            leaf(NAMES, 2);
+            src += ")\n}\n";
+        }
+        src += "\n";
+    }
+
+public:
+    std::string generate(ProgramShape shape, size_t target_bytes) {
+        src.reserve(target_bytes + 4096);
+
+        if (shape == ProgramShape::EXTERN_HEAVY) {
+            src += "extern sin(x)\nextern cos(x)\nextern exp(x)\nextern log(x)\n"
+                "extern sqrt(x)\nextern tanh(x)\nextern fabs(x)\n\n";
+        }
+
+        while (src.size() < target_bytes) {
+            switch (shape) {
+                case ProgramShape::WIDE: wide_defn(); break;
+                case ProgramShape::NESTED: nested_defn(); break;
+                case ProgramShape::CALL_CHAIN: call_chain(); break;
+                case ProgramShape::EXTERN_HEAVY: extern_block(); break;
+            }
+        }
+
+        return std::move(src);
+    }
+
+    explicit Generator(uint64_t seed) : state(seed), defn_count(0) {}
+};
+
+}
+
+const char*
+shape_name(ProgramShape shape)
+{
+    switch (shape) {
+        case ProgramShape::WIDE: return "wide";
+        case ProgramShape::NESTED: return "nested";
+        case ProgramShape::CALL_CHAIN: return "call-chain";
+        case ProgramShape::EXTERN_HEAVY: return "extern-heavy";
+    }
+    return "unknown";
+}
+
+std::string
+generate_program(ProgramShape shape, size_t target_bytes, uint64_t seed)
+{
+    return Generator(seed).generate(shape, target_bytes);
+}
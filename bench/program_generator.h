@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/* Deterministic synthetic guppy programs for the benchmarks. The same
+ * shape, size and seed always produce the same text, so that results
+ * from different builds can be compared directly. */
+enum class ProgramShape {
+    WIDE,           // many independent defns with long arithmetic bodies
+    NESTED,         // deeply parenthesized expression trees
+    CALL_CHAIN,     // each defn calls the one before it
+    EXTERN_HEAVY    // forward extern declarations and many libm calls
+};
+
+static const ProgramShape ALL_PROGRAM_SHAPES[] = {
+    ProgramShape::WIDE,
+    ProgramShape::NESTED,
+    ProgramShape::CALL_CHAIN,
+    ProgramShape::EXTERN_HEAVY
+};
+
+const char* shape_name(ProgramShape shape);
+
+/* generate at least target_bytes of source (a little more, since the
+ * last definition is always completed) */
+std::string generate_program(ProgramShape shape, size_t target_bytes,
+        uint64_t seed = 0x9E3779B97F4A7C15ull);
+
+/* the WIDE shape, which is representative of ordinary guppy code */
+inline std::string
+generate_source(size_t target_bytes)
+{
+    return generate_program(ProgramShape::WIDE, target_bytes);
+}
@@ -0,0 +1,63 @@
+#include "guppy.h"
+
+#include <cmath>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+/* Compiles formulas at run time and calls them from several threads,
+ * including one that calls back into a host function, and recompiles
+ * one of them.
+ *
+ *   guppy_embed_example
+ */
+
+static double
+clamp01(double x)
+{
+    return x < 0.0 ? 0.0 : x > 1.0 ? 1.0 : x;
+}
+
+int
+main(void)
+{
+    try {
+        guppy::register_extern("clamp01", clamp01);
+
+        auto area = guppy::compile<double(double, double)>("defn area(w, h) { w * h }");
+        auto score = guppy::compile<double(double, double, double)>(
+                "defn score(a, b, c) { clamp01(a * 0.5 + b * 0.3 + c * 0.2) }");
+
+        std::cout << "area(3, 4) = " << area(3, 4) << std::endl;
+
+        /* compile concurrently with calls on other threads */
+        std::vector<std::thread> threads;
+        std::vector<double> sums(4, 0.0);
+        for (size_t t = 0; t < sums.size(); t++) {
+            threads.emplace_back([t, score, &sums]() {
+                for (int i = 0; i < 100000; i++)
+                    sums[t] += score(i % 3, t, 0.5);
+            });
+        }
+
+        auto hyp = guppy::compile<double(double, double)>(
+                "extern sqrt(x)\n"
+                "defn hypotenuse(a, b) { sqrt(a * a + b * b) }");
+
+        for (auto &thread : threads) thread.join();
+
+        for (size_t t = 0; t < sums.size(); t++)
+            std::cout << "thread " << t << " score sum = " << sums[t] << std::endl;
+        std::cout << "hypotenuse(3, 4) = " << hyp(3, 4) << std::endl;
+
+        /* the new formula replaces the old one behind every pointer */
+        auto triangle = guppy::compile<double(double, double)>("defn area(w, h) { w * h * 0.5 }");
+        std::cout << "area(3, 4) = " << triangle(3, 4) << " after redefinition, through the old pointer "
+            << area(3, 4) << std::endl;
+    } catch (const guppy::Error &err) {
+        std::cerr << "guppy_embed_example: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "ast.h"
+
+#include <stdexcept>
+#include <string>
+
+#include "llvm/IR/Operator.h"
+
+class CompileStats;
+
+class AOTError : public std::runtime_error
+{
+public:
+    AOTError(std::string const &msg) : std::runtime_error(msg) {}
+};
+
+/* Ahead of time compilation. Every definition in the AST is generated
+ * into one module, optimized and compiled for the host. Definitions keep
+ * their names and take and return doubles, so from C or C++ they are
+ * declared as e.g.
+ *
+ *     extern "C" double norm(double x, double y);
+ *
+ * Top level expressions only make sense when the program is run, so they
+ * are left out of the output (count_top_level_expressions() tells the
+ * caller how many were dropped). Externs stay undefined symbols. */
+
+size_t count_top_level_expressions(const AST &ast);
+
+/* write a relocatable native object file, with fp_flags on every floating
+ * point operation (see UnitGeneratorContext::fp_flags), charging the
+ * compilation to stats if given */
+void compile_to_object(const AST &ast, unsigned opt_level, const std::string &output_path,
+        llvm::FastMathFlags fp_flags = llvm::FastMathFlags(), CompileStats *stats = nullptr);
+
+/* write a shared library, linked against the C math library, by handing
+ * the object file to the system compiler driver ($CC, or cc) */
+void compile_to_shared_library(const AST &ast, unsigned opt_level, const std::string &output_path,
+        llvm::FastMathFlags fp_flags = llvm::FastMathFlags(), CompileStats *stats = nullptr);
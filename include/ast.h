@@ -1,8 +1,13 @@
 #pragma once
 
+#include "symbol.h"
+
+#include <cstddef>
+#include <cstdint>
 #include <memory>
-#include <string>
+#include <new>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
 /*
@@ -10,125 +15,288 @@
 <NODE>   ::= <DECLARATION> | <DEFINITION>
 <DECLARATION> ::= EXTERN <PROTOTYPE>
 <PROTOTYPE>   ::= IDENTIFIER OPEN_PAREN (IDENTIFIER COMMA ?)* CLOSE_PAREN
-<DEFINITION>  ::= DEFN <PROTOTYPE> OPEN_CURL_BRACKET <E> CLOSE_CURL_BRACKET
+<OPERATOR_PROTOTYPE> ::= "binary" OPERATOR DOUBLE OPEN_PAREN IDENTIFIER COMMA IDENTIFIER CLOSE_PAREN
+<DEFINITION>  ::= DEFN (<PROTOTYPE> | <OPERATOR_PROTOTYPE>) OPEN_CURL_BRACKET <E> CLOSE_CURL_BRACKET
 
 <E> ::= <EXPR(0)>
 <EXPR(p)>  ::= <P> (<BINOP> <EXPR(q)>)*
 <P> ::= IDENTIFIER | DOUBLE | <CALL_EXPR> | <PAREN_EXPR>
 <CALL_EXPR>   ::= IDENTIFIER OPEN_PAREN (<EXPR> COMMA ?)* CLOSE_PAREN
 <PAREN_EXPR>  ::= OPEN_PAREN <EXPR> CLOSE_PAREN
-<BINOP> ::= "+" | "-" | "*" | "/" | "^" | "<"
+<BINOP> ::= "+" | "-" | "*" | "/" | "^" | "<" | <USER DEFINED OPERATOR>
 */
 
-class NodeTraverser;
-class ExprTraverser;
+/* Bump allocator that owns every node and child array of one
+ * AST. Nothing allocated here is ever destroyed individually: the blocks
+ * are released all at once along with the arena, so only trivially
+ * destructible types may be placed in it. */
+class ASTArena {
+    static const size_t BLOCK_SIZE = 64 * 1024;
 
-template< typename T >
-struct is_traverser {
-    static const bool value = false;
-};
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char *cursor;
+    char *block_end;
+
+    size_t bytes_reserved;
+    size_t bytes_used;
+    size_t object_count;
+
+    void* allocate_slow(size_t size, size_t align);
+
+public:
+    struct Stats {
+        size_t blocks;
+        size_t bytes_reserved;
+        size_t bytes_used;
+        size_t objects;
+    };
+
+    void* allocate(size_t size, size_t align) {
+        uintptr_t p = (reinterpret_cast<uintptr_t>(cursor) + align - 1) & ~(uintptr_t)(align - 1);
+        if (cursor == nullptr || p + size > reinterpret_cast<uintptr_t>(block_end))
+            return allocate_slow(size, align);
+
+        bytes_used += (p + size) - reinterpret_cast<uintptr_t>(cursor);
+        cursor = reinterpret_cast<char*>(p + size);
+        return reinterpret_cast<void*>(p);
+    }
 
-template<>
-struct is_traverser< NodeTraverser > {
-    static const bool value = true;
+    template <typename T, typename... Args>
+    T* create(Args&&... args) {
+        static_assert(std::is_trivially_destructible<T>::value,
+                "objects allocated in an ASTArena are never destroyed");
+        object_count++;
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template <typename T>
+    const T* copy_array(const T *data, size_t count) {
+        static_assert(std::is_trivially_copyable<T>::value,
+                "arrays copied into an ASTArena must be trivially copyable");
+        if (count == 0) return nullptr;
+        T *copy = static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+        std::uninitialized_copy(data, data + count, copy);
+        return copy;
+    }
+
+    Stats stats() const {
+        return Stats { blocks.size(), bytes_reserved, bytes_used, object_count };
+    }
+
+    ASTArena()
+        : cursor(nullptr), block_end(nullptr),
+        bytes_reserved(0), bytes_used(0), object_count(0) {}
+
+    ASTArena(ASTArena&&) = default;
+    ASTArena& operator=(ASTArena&&) = default;
 };
 
-template<>
-struct is_traverser< ExprTraverser > {
-    static const bool value = true;
+/* immutable view of a contiguous array living in an ASTArena */
+template <typename T>
+class ArenaArray {
+    const T *elements;
+    uint32_t count;
+
+public:
+    const T* begin() const { return elements; }
+    const T* end() const { return elements + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T& operator[](size_t i) const { return elements[i]; }
+
+    ArenaArray() : elements(nullptr), count(0) {}
+    ArenaArray(const T *elements, size_t count)
+        : elements(elements), count(static_cast<uint32_t>(count)) {}
 };
 
-template < typename T >
-struct ASTTraversable {
-    static_assert(is_traverser<T>::value,
-            "ASTTraversable type must be NodeTraverse or ExprTraverser");
+/* where a construct starts in the source: the line and column of the
+ * token that introduced it, zero for nodes made up by the compiler */
+struct SourceLocation {
+    uint32_t linum;
+    uint32_t colnum;
 
-    virtual void inject(T &traverser) const = 0;
-    virtual ~ASTTraversable() {}
+    SourceLocation() : linum(0), colnum(0) {}
+    SourceLocation(unsigned linum, unsigned colnum) : linum(linum), colnum(colnum) {}
 };
 
-struct ASTNode : public virtual ASTTraversable<NodeTraverser> {
-    virtual ~ASTNode() {}
+/* Nodes are plain tagged structs rather than a virtual class hierarchy:
+ * the kind tag selects the visitor overload in NodeVisitor/ExprVisitor,
+ * and children are pointers into the same arena. */
+struct ASTNode {
+    enum class Kind : uint8_t {
+        EXTERN,
+        DEFN
+    } const kind;
+
+protected:
+    ASTNode(Kind kind) : kind(kind) {}
 };
 
-struct ASTExpr : public virtual ASTTraversable<ExprTraverser> {
-    virtual ~ASTExpr() {}
+struct ASTExpr {
+    enum class Kind : uint8_t {
+        VARIABLE,
+        LITERAL_DOUBLE,
+        BINOP,
+        CALL
+    } const kind;
+
+protected:
+    ASTExpr(Kind kind) : kind(kind) {}
 };
 
+/* Prototype of a function or of a user defined binary operator. For
+ * operators the name is the operator itself (e.g. "@") and precedence is
+ * the binding strength it was declared with. The location is that of the
+ * name, or of the expression for a top level expression. */
 struct PrototypeAST {
-    const std::string name;
-    const std::vector<std::string> args;
+    enum class Kind : uint8_t {
+        FUNCTION,
+        BINARY_OPERATOR
+    } const kind;
+
+    const Symbol name;
+    const ArenaArray<Symbol> args;
+    const int precedence;
+    const SourceLocation location;
+
+    PrototypeAST(Symbol name, ArenaArray<Symbol> args, SourceLocation location = SourceLocation())
+        : kind(Kind::FUNCTION), name(name), args(args), precedence(0), location(location) {}
+
+    PrototypeAST(Symbol op, ArenaArray<Symbol> args, int precedence,
+            SourceLocation location = SourceLocation())
+        : kind(Kind::BINARY_OPERATOR), name(op), args(args), precedence(precedence),
+        location(location) {}
 
-    PrototypeAST(const std::string &name, const std::vector<std::string> &args)
-        : name(name), args(std::move(args)) {}
+    bool is_operator() const { return kind == Kind::BINARY_OPERATOR; }
 };
 
-struct ExternASTNode : public virtual ASTNode {
-    std::unique_ptr<PrototypeAST> prototype;
+struct ExternASTNode : public ASTNode {
+    const PrototypeAST *prototype;
 
-    void inject(NodeTraverser &traverser) const override;
-    ExternASTNode(std::unique_ptr<PrototypeAST> prototype)
-        : prototype(std::move(prototype)) {}
+    ExternASTNode(const PrototypeAST *prototype)
+        : ASTNode(Kind::EXTERN), prototype(prototype) {}
 };
 
-struct DefnASTNode : public virtual ASTNode {
-    std::unique_ptr<PrototypeAST> prototype;
-    std::unique_ptr<ASTExpr> body;
+struct DefnASTNode : public ASTNode {
+    const PrototypeAST *prototype;
+    const ASTExpr *body;
 
-    void inject(NodeTraverser &traverser) const override;
-    DefnASTNode(std::unique_ptr<PrototypeAST> prototype, std::unique_ptr<ASTExpr> body)
-        : prototype(std::move(prototype)), body(std::move(body)) {}
+    DefnASTNode(const PrototypeAST *prototype, const ASTExpr *body)
+        : ASTNode(Kind::DEFN), prototype(prototype), body(body) {}
 };
 
-struct VariableASTExpr : public virtual ASTExpr {
-    const std::string name;
+struct VariableASTExpr : public ASTExpr {
+    const Symbol name;
 
-    void inject(ExprTraverser &traverser) const override;
-    VariableASTExpr(const std::string &name) : name(name) {}
+    VariableASTExpr(Symbol name) : ASTExpr(Kind::VARIABLE), name(name) {}
 };
 
-struct LiteralDoubleASTExpr : public virtual ASTExpr {
+struct LiteralDoubleASTExpr : public ASTExpr {
     const double value;
 
-    void inject(ExprTraverser &traverser) const override;
-    LiteralDoubleASTExpr(double value) : value(value) {}
+    LiteralDoubleASTExpr(double value) : ASTExpr(Kind::LITERAL_DOUBLE), value(value) {}
 };
 
-struct BinOpASTExpr : public virtual ASTExpr {
-    const std::string binop;
-    std::unique_ptr<ASTExpr> LHS, RHS;
+/* operators and calls are what generate code, so they carry the location
+ * of the operator and of the callee's name for debug info */
+struct BinOpASTExpr : public ASTExpr {
+    const Symbol binop;
+    const ASTExpr *LHS, *RHS;
+    const SourceLocation location;
 
-    void inject(ExprTraverser &traverser) const override;
-    BinOpASTExpr(std::string binop, std::unique_ptr<ASTExpr> LHS,
-            std::unique_ptr<ASTExpr> RHS)
-        : binop(binop), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+    BinOpASTExpr(Symbol binop, const ASTExpr *LHS, const ASTExpr *RHS,
+            SourceLocation location = SourceLocation())
+        : ASTExpr(Kind::BINOP), binop(binop), LHS(LHS), RHS(RHS), location(location) {}
 };
 
-struct CallASTExpr : public virtual ASTExpr {
-    const std::string callee;
-    std::vector<std::unique_ptr<ASTExpr>> args;
+struct CallASTExpr : public ASTExpr {
+    const Symbol callee;
+    const ArenaArray<const ASTExpr*> args;
+    const SourceLocation location;
 
-    void inject(ExprTraverser &traverser) const override;
-    CallASTExpr(const std::string &callee, std::vector<std::unique_ptr<ASTExpr>> args)
-        : callee(callee), args(std::move(args)) {}
+    CallASTExpr(Symbol callee, ArenaArray<const ASTExpr*> args,
+            SourceLocation location = SourceLocation())
+        : ASTExpr(Kind::CALL), callee(callee), args(args), location(location) {}
 };
 
-class NodeTraverser {
+/* 'x ^ n' with a literal integer n, |n| <= MAX_EXPANDED_EXPONENT, is
+ * computed by codegen and the VM as a chain of multiplications (square and
+ * multiply from the lowest bit of |n|, then 1 / x^|n| for negative n)
+ * rather than a call to pow. The result may differ from pow in the last
+ * bit. expanded_exponent sets n when an exponent qualifies. */
+static const int MAX_EXPANDED_EXPONENT = 32;
+bool expanded_exponent(const ASTExpr *exponent, int &n);
+
+/* deep copies of a node or expression into another arena, for things
+ * that must outlive the AST they were parsed into. Subexpressions the AST
+ * optimizer shares are copied once and stay shared in the copy. */
+const PrototypeAST* copy_prototype(const PrototypeAST *proto, ASTArena &arena);
+const ASTExpr* copy_expr(const ASTExpr *expr, ASTArena &arena);
+const ASTNode* copy_node(const ASTNode *node, ASTArena &arena);
+
+/* Statically dispatched visitors (CRTP): Derived defines an apply_to
+ * overload for every node type of the family, each returning R, and
+ * visit() switches on the kind tag to call the right one directly. A walk
+ * therefore costs no virtual calls, and a visitor that recurses by calling
+ * visit() on children needs no allocation per node. */
+template <typename Derived, typename R = void>
+class NodeVisitor {
 public:
-    virtual void apply_to(const ExternASTNode &extern_node) = 0;
-    virtual void apply_to(const DefnASTNode &defn_node) = 0;
+    R visit(const ASTNode *node) {
+        Derived &self = static_cast<Derived&>(*this);
+        if (node->kind == ASTNode::Kind::EXTERN)
+            return self.apply_to(static_cast<const ExternASTNode&>(*node));
+        return self.apply_to(static_cast<const DefnASTNode&>(*node));
+    }
+};
 
-    virtual ~NodeTraverser() {}
+template <typename Derived, typename R = void>
+class ExprVisitor {
+public:
+    R visit(const ASTExpr *expr) {
+        Derived &self = static_cast<Derived&>(*this);
+        switch (expr->kind) {
+            case ASTExpr::Kind::VARIABLE:
+                return self.apply_to(static_cast<const VariableASTExpr&>(*expr));
+            case ASTExpr::Kind::LITERAL_DOUBLE:
+                return self.apply_to(static_cast<const LiteralDoubleASTExpr&>(*expr));
+            case ASTExpr::Kind::BINOP:
+                return self.apply_to(static_cast<const BinOpASTExpr&>(*expr));
+            case ASTExpr::Kind::CALL:
+                break;
+        }
+        return self.apply_to(static_cast<const CallASTExpr&>(*expr));
+    }
 };
 
-class ExprTraverser {
+/* top level nodes of a unit, together with the arena that owns them */
+class AST {
+    ASTArena arena;
+    std::vector<const ASTNode*> nodes;
+
 public:
-    virtual void apply_to(const VariableASTExpr &var_expr) = 0;
-    virtual void apply_to(const LiteralDoubleASTExpr &double_expr) = 0;
-    virtual void apply_to(const BinOpASTExpr &bin_op_expr) = 0;
-    virtual void apply_to(const CallASTExpr &call_expr) = 0;
+    typedef std::vector<const ASTNode*>::const_iterator const_iterator;
 
-    virtual ~ExprTraverser() {}
-};
+    ASTArena& get_arena() { return arena; }
+    const ASTArena& get_arena() const { return arena; }
+
+    void push_back(const ASTNode *node) { nodes.push_back(node); }
+
+    /* swap in a rewritten node, which must live in this AST's arena */
+    void replace(size_t index, const ASTNode *node) { nodes[index] = node; }
+    const ASTNode* operator[](size_t index) const { return nodes[index]; }
 
-typedef std::vector<std::unique_ptr<ASTNode>> AST;
+    const_iterator begin() const { return nodes.begin(); }
+    const_iterator end() const { return nodes.end(); }
+    size_t size() const { return nodes.size(); }
+    bool empty() const { return nodes.empty(); }
+
+    void clear() {
+        nodes.clear();
+        arena = ASTArena();
+    }
+
+    AST() {}
+    AST(AST&&) = default;
+    AST& operator=(AST&&) = default;
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "ast.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+struct ASTOptimizerStats {
+    size_t nodes_in;    // expression nodes in the trees as parsed
+    size_t nodes_out;   // distinct expression nodes left afterwards
+    size_t folded;      // operators evaluated at compile time
+    size_t simplified;  // operators removed by an identity
+    size_t shared;      // operator subtrees replaced by an identical one
+
+    ASTOptimizerStats() : nodes_in(0), nodes_out(0), folded(0), simplified(0), shared(0) {}
+};
+
+/* Rewrites the body of every definition in an AST before codegen:
+ *
+ *  - operators of the built-in set whose operands are both literals are
+ *    evaluated, with the same IEEE semantics as the generated code
+ *  - identities that hold for every double, including signed zeros,
+ *    infinities and NaNs, are applied: x*1, 1*x, x+(-0), (-0)+x and x-0
+ *    are x (x+0 is not, since -0+0 is +0)
+ *  - structurally identical subexpressions are merged (hash-consing), so
+ *    a definition's body becomes a DAG. Calls are never merged, since an
+ *    extern need not be pure, but their arguments are.
+ *
+ * New nodes are allocated in the AST's own arena, and changed
+ * definitions are replaced in the AST. ValueGen generates a subexpression
+ * shared within one definition only once. */
+class ASTOptimizer {
+    /* identity of a node for hash-consing: children are already
+     * canonical, so comparing their addresses compares their structure */
+    struct Key {
+        ASTExpr::Kind kind;
+        uint32_t symbol;
+        uint64_t bits;
+        const ASTExpr *LHS, *RHS;
+
+        bool operator==(const Key &other) const {
+            return kind == other.kind && symbol == other.symbol && bits == other.bits
+                && LHS == other.LHS && RHS == other.RHS;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key &k) const;
+    };
+
+    ASTArena &arena;
+    std::unordered_map<Key, const ASTExpr*, KeyHash> table;
+    ASTOptimizerStats stats;
+
+    /* rewritten call arguments, shared by nested calls like the parser's */
+    std::vector<const ASTExpr*> arg_stack;
+
+    const ASTExpr* rewrite(const ASTExpr *expr);
+    const ASTExpr* rewrite_binop(const BinOpASTExpr *binop);
+    const ASTExpr* rewrite_call(const CallASTExpr *call);
+
+    /* the canonical node equal to 'key', creating it from 'original' (or
+     * a new node at location when original is null) the first time */
+    const ASTExpr* canonical(const Key &key, const ASTExpr *original,
+            SourceLocation location = SourceLocation());
+
+public:
+    void run(AST &ast);
+
+    const ASTOptimizerStats& get_stats() const { return stats; }
+    void report(std::ostream &out) const;
+
+    explicit ASTOptimizer(ASTArena &arena) : arena(arena) {}
+};
+
+/* convenience wrapper running a fresh ASTOptimizer over the AST */
+ASTOptimizerStats optimize_ast(AST &ast);
@@ -7,23 +7,27 @@
 #include <sstream>
 
 class ASTPrinter :
-    public virtual NodeTraverser,
-    public virtual ExprTraverser
+    public NodeVisitor<ASTPrinter>,
+    public ExprVisitor<ASTPrinter>
 {
     unsigned int tab_level;
     std::ostringstream node_output;
-    void append_line_to_output(std::ostringstream &line);
+
+    /* start a line of the current node's output at the current depth */
+    std::ostream& line();
     void process_prototype(const PrototypeAST &proto);
     void print_node_output();
 
 public:
-    void apply_to(const ExternASTNode &extern_node) override;
-    void apply_to(const DefnASTNode &defn_node) override;
-    void apply_to(const VariableASTExpr &var_expr) override;
-    void apply_to(const LiteralDoubleASTExpr &double_expr) override;
-    void apply_to(const BinOpASTExpr &bin_op_expr) override;
-    void apply_to(const CallASTExpr &call_expr) override;
+    using NodeVisitor<ASTPrinter>::visit;
+    using ExprVisitor<ASTPrinter>::visit;
+
+    void apply_to(const ExternASTNode &extern_node);
+    void apply_to(const DefnASTNode &defn_node);
+    void apply_to(const VariableASTExpr &var_expr);
+    void apply_to(const LiteralDoubleASTExpr &double_expr);
+    void apply_to(const BinOpASTExpr &bin_op_expr);
+    void apply_to(const CallASTExpr &call_expr);
 
     ASTPrinter() : tab_level(0), node_output(std::ostringstream()) {}
 };
-
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "ast.h"
+#include "compile_stats.h"
+#include "symbol.h"
 #include "util.h"
 
 #include <iostream>
@@ -8,67 +10,223 @@
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
 
+class Optimizer;
+
+class CodegenError : public std::runtime_error
+{
+public:
+    CodegenError(std::string const &msg) : std::runtime_error(msg) {}
+};
+
 struct UnitGeneratorContext {
+    std::unique_ptr<llvm::LLVMContext> llvm_context;
     std::unique_ptr<llvm::Module> llvm_module;
-    llvm::IRBuilder<> builder;
-    std::map<std::string, llvm::Value*> named_values;
+    std::unique_ptr<llvm::IRBuilder<>> builder;
+    std::unordered_map<Symbol, llvm::Value*> named_values;
+
+    /* values of the operator nodes generated so far in the current
+     * function, so that subexpressions the AST optimizer merged are only
+     * generated once (bodies have no control flow, so every earlier
+     * value is available everywhere later in the function) */
+    std::unordered_map<const ASTExpr*, llvm::Value*> expr_values;
+
+    /* functions declared or defined in the current module, so that
+     * lookups by name never go through the module's string table */
+    std::unordered_map<Symbol, llvm::Function*> functions;
+
+    /* arity of every function declared or defined so far, kept across
+     * modules so that a fresh module can re-declare functions whose
+     * bodies already live in an earlier (possibly JIT'd) module */
+    std::unordered_map<Symbol, size_t> prototypes;
+
+    /* user defined binary operators, copied out of the AST that defined
+     * them. Operators are compiled as internal always-inline functions
+     * into every module that uses them, so after inlining they cost the
+     * same as a built-in operator. */
+    ASTArena operator_arena;
+    std::unordered_map<Symbol, const DefnASTNode*> operators;
+
+    /* externs declared with the name and arity of a libm function that
+     * LLVM has an intrinsic for (sqrt, sin, pow, fma, ...). Calls to them
+     * go through the intrinsic, so that LLVM can fold them on constants,
+     * vectorize them and turn some (sqrt, fabs, floor, ...) into single
+     * instructions. A definition of the same name takes precedence. */
+    std::unordered_map<Symbol, llvm::Intrinsic::ID> math_intrinsics;
+
+    /* functions declared by an extern and not defined since. LLVM may
+     * treat a call to one of them as a call to the C library function of
+     * that name; calls to definitions are marked nobuiltin, so that a
+     * definition named like a library function is never replaced by it. */
+    std::unordered_set<Symbol> externs;
+
+    /* definitions that call no externs, directly or through the functions
+     * and operators they use, see record_purity */
+    std::unordered_set<Symbol> pure_functions;
+
+    /* Wrap every pure function definition with arguments in a memo table
+     * of memo_table_size (a power of two) entries keyed on the bit
+     * patterns of its arguments. Tables are open addressing with a
+     * bounded number of probes, overwriting the home slot when all are
+     * taken, and are not synchronized: memoized code must not run
+     * on several threads at once. The table is the global '<name>.memo';
+     * hits and misses are counted in the global '<name>.memo_stats'
+     * ({ i64 hits, i64 misses }). */
+    bool memoize;
+    size_t memo_table_size;
+    static const size_t DEFAULT_MEMO_TABLE_SIZE = 4096;
+
+    /* only declare the memo table and counters of a memoized function,
+     * for a tiered recompile that keeps using the baseline body's */
+    bool share_memo_tables;
+
+    /* start every function definition by counting the call in the global
+     * '<name>.calls' (an i64, updated with relaxed atomic loads and
+     * stores, so concurrent calls may be lost but the count can be read
+     * from other threads), for tiered compilation */
+    bool count_calls;
+
+    /* record whether a definition is pure, and return it. Functions not
+     * yet known to be pure (e.g. defined later) count as impure. A
+     * redefinition is checked afresh; functions that called the old
+     * definition are not, see GuppyJIT::define_incrementally. */
+    bool record_purity(const DefnASTNode &defn);
+
+    /* whether generate_definition memoizes this definition */
+    bool is_memoized(const PrototypeAST &proto) const;
+
+    /* fast-math flags set on every floating point operation generated
+     * here, none (the default) being strict IEEE semantics. contract lets
+     * the backend fuse a multiply and an add into an FMA, reassoc lets the
+     * optimizer reorder sums and products (e.g. into trees), nnan/ninf
+     * assume no NaNs/infinities; see parse_fp_mode */
+    llvm::FastMathFlags fp_flags;
+
+    void set_fp_flags(llvm::FastMathFlags flags);
+
+    /* Emit DWARF line tables, so that profilers and debuggers can map the
+     * generated machine code back to the source: every module gets a
+     * compile unit for the file source_name, every function a subprogram
+     * at the line of its name, and the instructions of every operator and
+     * call the line and column of the operator or callee. */
+    bool debug_info;
+    std::string source_name;
+    std::unique_ptr<llvm::DIBuilder> di_builder;
+    llvm::DICompileUnit *di_unit;
+
+    void set_debug_info(const std::string &source_name);
+
+    /* give a function just created for proto its subprogram, and start
+     * its instructions at the prototype's line */
+    void begin_debug_info(llvm::Function *function, const PrototypeAST &proto);
+
+    /* the location of the instructions generated next in the current
+     * function; unknown locations keep the previous one */
+    void set_debug_location(SourceLocation location);
+
+    /* when set, code generation, verification and optimization are
+     * charged to their phases, and functions and instructions counted */
+    CompileStats* stats;
+
+    /* optional pass pipelines run over everything generated here; when
+     * set, new modules are also configured for the optimizer's target */
+    Optimizer* optimizer;
+
+    void set_optimizer(Optimizer* new_optimizer);
+
+    /* hand out a new context/module pair, leaving the old ones (if not
+     * already taken by the JIT) to be destroyed */
+    void reset_module();
+
+    /* look up a function in the current module, declaring it from the
+     * known prototypes if it was defined in an earlier module */
+    llvm::Function* get_function(Symbol name);
+
+    /* look up the function implementing a user defined operator in the
+     * current module, emitting its definition here if needed */
+    llvm::Function* get_operator(Symbol op);
 
     UnitGeneratorContext()
-        : llvm_module(std::make_unique<llvm::Module>("__UNIT__", llvm::getGlobalContext())),
-        builder(llvm::IRBuilder<>(llvm::getGlobalContext())) {}
+        : memoize(false), memo_table_size(DEFAULT_MEMO_TABLE_SIZE), share_memo_tables(false),
+          count_calls(false),
+          debug_info(false), di_unit(nullptr), stats(nullptr), optimizer(nullptr)
+    {
+        reset_module();
+    }
 };
 
-template < typename A, typename B >
-class Accumulator : public virtual B {
-    static_assert(is_traverser<B>::value,
-            "ASTTraversable type in Accumulator must be NodeTraverse or ExprTraverser");
-protected:
-    UnitGeneratorContext* const context;
-    A result;
+/* Floating point mode from its name: "strict", "fast" (every fast-math
+ * flag), or a comma separated list of contract, reassoc, nnan, ninf, nsz,
+ * arcp and afn. Throws CodegenError for anything else. */
+llvm::FastMathFlags parse_fp_mode(const std::string &mode);
 
-public:
-    virtual A extract() { return result; }
+/* the name parse_fp_mode accepts for a set of flags */
+std::string fp_mode_name(llvm::FastMathFlags flags);
 
-    Accumulator(UnitGeneratorContext* context, A def_val)
-        : context(context), result(def_val) {}
+/* whether an operator is generated inline rather than user defined */
+bool is_builtin_operator(Symbol op);
 
-    virtual ~Accumulator() {}
-};
+/* register the host target with LLVM, safe to call any number of times */
+void initialize_native_target(void);
+
+/* generates the function for a node: FunctionGen(context).visit(node) */
+struct FunctionGen : public NodeVisitor<FunctionGen, llvm::Function*> {
+    UnitGeneratorContext* const context;
 
-struct FunctionGen : public Accumulator<llvm::Function*, NodeTraverser> {
-    void apply_to(const ExternASTNode &extern_node) override;
-    void apply_to(const DefnASTNode &defn_node) override;
+    llvm::Function* apply_to(const ExternASTNode &extern_node);
+    llvm::Function* apply_to(const DefnASTNode &defn_node);
 
     llvm::Function* process_prototype(const PrototypeAST &proto);
+    llvm::Function* generate_definition(const DefnASTNode &defn_node);
 
-    llvm::Function* extract() override {
-        auto result_copy = result;
-        result = nullptr;
-        return result_copy;
-    }
+    /* Emit 'void <name>_batch(const double* const* columns, double* out,
+     * size_t rows)', which evaluates the definition for every row, with
+     * argument k of row i taken from columns[k][i]. out must not overlap
+     * the columns. The loop is only vectorized by the module pipeline
+     * from -O2, and only if the definition calls no other functions. */
+    llvm::Function* generate_batch(const DefnASTNode &defn_node);
+
+    /* fill in the body of an empty function with the definition's
+     * signature, erasing the function if that fails */
+    void generate_body(llvm::Function *function, const DefnASTNode &defn_node);
+
+    /* the same, looking the result up in (or adding it to) the function's
+     * memo table, see UnitGeneratorContext::memoize */
+    void generate_memoized_body(llvm::Function *function, const DefnASTNode &defn_node);
+
+    /* verify a function whose body is complete and run the function
+     * pipeline over it */
+    void finish_function(llvm::Function &function);
 
-    FunctionGen(UnitGeneratorContext* context) : Accumulator(context, nullptr) {}
+    FunctionGen(UnitGeneratorContext* context) : context(context) {}
 };
 
-struct ValueGen : public Accumulator<llvm::Value*, ExprTraverser> {
-    void apply_to(const VariableASTExpr &var_expr) override;
-    void apply_to(const LiteralDoubleASTExpr &double_expr) override;
-    void apply_to(const BinOpASTExpr &bin_op_expr) override;
-    void apply_to(const CallASTExpr &call_expr) override;
+/* generates the value of an expression at the builder's insertion point;
+ * one ValueGen walks a whole body */
+struct ValueGen : public ExprVisitor<ValueGen, llvm::Value*> {
+    UnitGeneratorContext* const context;
 
-    llvm::Value* extract() override {
-        auto result_copy = result;
-        result = nullptr;
-        return result_copy;
-    }
+    llvm::Value* apply_to(const VariableASTExpr &var_expr);
+    llvm::Value* apply_to(const LiteralDoubleASTExpr &double_expr);
+    llvm::Value* apply_to(const BinOpASTExpr &bin_op_expr);
+    llvm::Value* apply_to(const CallASTExpr &call_expr);
+
+    /* value of a subexpression, reusing the value of a shared one */
+    llvm::Value* value_of(const ASTExpr *expr);
+
+    /* base ^ n as multiplications, see expanded_exponent */
+    llvm::Value* expand_power(llvm::Value *base, int n);
 
-    ValueGen(UnitGeneratorContext* context) : Accumulator(context, nullptr) {}
+    ValueGen(UnitGeneratorContext* context) : context(context) {}
 };
 
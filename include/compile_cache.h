@@ -0,0 +1,72 @@
+#pragma once
+
+#include "ast.h"
+#include "codegen.h"
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+
+#include "llvm/Support/MemoryBuffer.h"
+
+struct CacheStats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stores;
+    unsigned long evictions;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+
+    CacheStats() : hits(0), misses(0), stores(0), evictions(0), bytes_read(0), bytes_written(0) {}
+};
+
+/* Content addressed on-disk cache of compiled function definitions, one
+ * native object file per definition, named by the hex digest of its
+ * cache key.
+ *
+ * The directory may be shared by any number of guppy processes: entries
+ * are written to a temporary file and renamed into place, so readers
+ * only ever see complete objects, an entry that disappears between
+ * being found and being read is just a miss, and eviction is serialized
+ * with an advisory lock. Entries are evicted least recently used first
+ * (a hit refreshes the entry's modification time) once the directory
+ * grows beyond its size limit. */
+class CompileCache {
+    std::string directory;
+    uint64_t max_bytes;
+    CacheStats stats;
+
+    std::string entry_path(const std::string &key) const;
+
+public:
+    static const uint64_t DEFAULT_MAX_BYTES = 256ull << 20;
+
+    /* $GUPPY_CACHE_DIR, else $XDG_CACHE_HOME/guppy, else ~/.cache/guppy */
+    static std::string default_directory();
+
+    /* the cached object for key, or null on a miss */
+    std::unique_ptr<llvm::MemoryBuffer> lookup(const std::string &key);
+
+    /* add an entry; failures to write are not errors, the entry is
+     * simply not cached */
+    void store(const std::string &key, const llvm::MemoryBuffer &object);
+
+    /* evict least recently used entries until the directory is within
+     * its size limit */
+    void trim();
+
+    const CacheStats& get_stats() const { return stats; }
+    void report(std::ostream &out) const;
+
+    /* creates the directory if needed, throws std::runtime_error if it
+     * cannot be created */
+    explicit CompileCache(const std::string &directory, uint64_t max_bytes = DEFAULT_MAX_BYTES);
+};
+
+/* Stable key of a definition compiled for the context's optimizer: the
+ * definition with its arguments replaced by their positions, the
+ * prototypes of everything it calls, the definitions of the user
+ * operators it uses (since those are inlined), the optimization level,
+ * and the target triple, CPU and features. Requires an optimizer. */
+std::string cache_key(const DefnASTNode &defn, const UnitGeneratorContext &context);
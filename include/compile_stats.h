@@ -0,0 +1,122 @@
+#pragma once
+
+#include "ast.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/* operator new calls so far in the process. The library never replaces
+ * operator new, a program that wants allocations counted in its
+ * CompileStats does so and counts them here (the guppy executable does) */
+extern std::atomic<uint64_t> heap_allocations;
+
+/* Where the compiler's time and memory go, phase by phase, for guppy
+ * --time-report and --stats. Phases nest: while one runs inside another
+ * (verification inside IR generation, say) its time is charged to the
+ * inner phase only, so the phases add up to the total. Only the thread
+ * driving compilation records phases. Work it waits for on other threads
+ * (codegen workers with -j) is charged to the waiting phase, and the CPU
+ * time of a phase is that of the whole process, so it can exceed the
+ * wall time. */
+class CompileStats {
+public:
+    enum class Phase : uint8_t {
+        READ,       // mapping the source file
+        LEX,        // tokenize()
+        PARSE,      // Parser::parse_text, less lexing
+        AST_OPT,    // ASTOptimizer
+        CODEGEN,    // FunctionGen/ValueGen, or bytecode for the VM
+        VERIFY,     // llvm::verifyFunction
+        OPTIMIZE,   // function and module pass pipelines
+        EMIT,       // machine code, in the JIT or to an object file
+        RUN         // top level expressions
+    };
+    static const size_t PHASES = 9;
+
+    struct PhaseStats {
+        unsigned long entries;
+        std::chrono::nanoseconds wall;
+        std::chrono::nanoseconds cpu;
+        uint64_t allocations;
+        long peak_rss_kib;  // of the process, when the phase last ended
+
+        PhaseStats() : entries(0), wall(0), cpu(0), allocations(0), peak_rss_kib(0) {}
+    };
+
+    struct NodeCounts {
+        size_t externs;
+        size_t definitions;     // functions, without operators
+        size_t operators;       // user operator definitions
+        size_t top_level;       // top level expressions
+        size_t variables;
+        size_t literals;
+        size_t binops;
+        size_t calls;
+
+        NodeCounts()
+            : externs(0), definitions(0), operators(0), top_level(0),
+            variables(0), literals(0), binops(0), calls(0) {}
+    };
+
+    /* charges the time and allocations from construction to destruction
+     * to a phase; a null CompileStats records nothing */
+    class Scope {
+        CompileStats *stats;
+        int outer;
+
+    public:
+        Scope(CompileStats *stats, Phase phase);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    std::string source_name;
+    size_t source_bytes;
+    size_t tokens;
+    NodeCounts nodes;           // as parsed, see count_nodes
+    size_t functions;           // function bodies generated
+    size_t instructions;        // LLVM instructions as generated
+    size_t optimized_instructions;  // LLVM instructions after optimization
+
+    /* count the nodes of every kind in a freshly parsed AST */
+    void count_nodes(const AST &ast);
+
+    /* add the functions and instructions counted by another CompileStats,
+     * e.g. that of a codegen worker thread */
+    void merge_counts(const CompileStats &other);
+
+    static const char* phase_name(Phase phase);
+    const PhaseStats& get_phase(Phase phase) const { return phases[static_cast<size_t>(phase)]; }
+
+    /* the table printed by --time-report */
+    void report(std::ostream &out) const;
+
+    /* the same as one JSON object, for --stats */
+    void write_json(std::ostream &out) const;
+
+    CompileStats();
+
+private:
+    PhaseStats phases[PHASES];
+
+    /* the phase being charged (-1 for none), and the clocks when it was
+     * last charged */
+    int current;
+    std::chrono::steady_clock::time_point wall_mark;
+    std::chrono::nanoseconds cpu_mark;
+    uint64_t allocations_mark;
+
+    std::chrono::steady_clock::time_point start;
+    std::chrono::nanoseconds cpu_start;
+    uint64_t allocations_start;
+
+    /* charge everything since the last mark to the current phase and
+     * make 'phase' current, returning the previous one */
+    int switch_to(int phase);
+};
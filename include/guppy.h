@@ -0,0 +1,111 @@
+#pragma once
+
+/* Embedding API: compile guppy source into native functions that a host
+ * program can call directly.
+ *
+ *   auto f = guppy::compile<double(double, double)>("defn f(x, y) { x * y + 1 }");
+ *   double z = f(2, 3);
+ *
+ * Every guppy function takes and returns doubles, so the signature must
+ * be double(double, ...) with one double per argument of the definition.
+ * Host C functions of the same shape can be made callable from guppy code
+ * with register_extern. All Engine members may be called from any number
+ * of threads; compilation is serialized, and the functions it returns may
+ * be called concurrently with each other and with further compilation. */
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+namespace guppy {
+
+/* parse, code generation or linking errors, with the compiler's message */
+class Error : public std::runtime_error
+{
+public:
+    Error(std::string const &msg) : std::runtime_error(msg) {}
+};
+
+namespace detail {
+    template <typename Signature>
+    struct FunctionTraits {
+        static_assert(sizeof(Signature) == 0, "guppy functions have signature double(double, ...)");
+    };
+
+    template <typename... Args>
+    struct FunctionTraits<double(Args...)> {
+        static_assert((std::is_same<Args, double>::value && ...),
+                "guppy functions only take double arguments");
+        static const size_t arity = sizeof...(Args);
+    };
+}
+
+/* An independent JIT session: definitions, operators and registered
+ * externs are visible to everything later compiled in the same engine.
+ * Functions stay valid for as long as the engine exists. Compiling a
+ * function under a name already defined replaces it, and every pointer
+ * to it returned so far calls the new definition from then on; the
+ * number of arguments cannot change while other functions call it. */
+class Engine {
+    struct State;
+    std::unique_ptr<State> state;
+
+    void* compile_function(const std::string &source, size_t arity);
+    void* lookup_function(const std::string &name, size_t arity);
+    void add_extern(const std::string &name, void *address, size_t arity);
+
+public:
+    /* compile the definitions, operators and externs in source; top
+     * level expressions are evaluated and their values discarded */
+    void define(const std::string &source);
+
+    /* compile source (as define does) and return its last function
+     * definition, which must take as many arguments as Signature */
+    template <typename Signature>
+    Signature* compile(const std::string &source) {
+        return reinterpret_cast<Signature*>(
+                compile_function(source, detail::FunctionTraits<Signature>::arity));
+    }
+
+    /* a function defined by earlier source */
+    template <typename Signature>
+    Signature* function(const std::string &name) {
+        return reinterpret_cast<Signature*>(
+                lookup_function(name, detail::FunctionTraits<Signature>::arity));
+    }
+
+    /* make a host function callable from guppy code under name, without
+     * an extern declaration. Must be registered before the source that
+     * calls it is compiled. */
+    template <typename... Args>
+    void register_extern(const std::string &name, double (*function)(Args...)) {
+        add_extern(name, reinterpret_cast<void*>(function),
+                detail::FunctionTraits<double(Args...)>::arity);
+    }
+
+    /* opt_level as for guppy -O<n> */
+    explicit Engine(unsigned opt_level = 2);
+    ~Engine();
+
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+};
+
+/* the process wide engine used by the free functions below; it is never
+ * destroyed, so its functions stay valid until the process exits */
+Engine& default_engine();
+
+template <typename Signature>
+Signature* compile(const std::string &source)
+{
+    return default_engine().compile<Signature>(source);
+}
+
+template <typename... Args>
+void register_extern(const std::string &name, double (*function)(Args...))
+{
+    default_engine().register_extern(name, function);
+}
+
+}
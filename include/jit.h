@@ -0,0 +1,247 @@
+#pragma once
+
+#include "ast.h"
+#include "codegen.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+
+class CompileCache;
+class Optimizer;
+class PerfMapListener;
+
+/* evaluates a definition of n arguments over a batch of rows: column k
+ * holds argument k of every row, see FunctionGen::generate_batch */
+typedef void (*BatchFunction)(const double* const* columns, double* out, size_t rows);
+
+class JITError : public std::runtime_error
+{
+public:
+    JITError(std::string const &msg) : std::runtime_error(msg) {}
+};
+
+/* thin wrapper around an ORC LLJIT instance. Functions generated into a
+ * UnitGeneratorContext are handed over module-at-a-time, and top level
+ * (__ANON__) expressions are compiled, run and thrown away. */
+class GuppyJIT {
+    /* profilers notified of every object loaded, see enable_profiling;
+     * declared first so that they outlive the JIT */
+    std::unique_ptr<PerfMapListener> perf_map_listener;
+    llvm::JITEventListener *jitdump_listener;
+
+    std::unique_ptr<llvm::orc::LLJIT> lljit;
+    llvm::orc::RTDyldObjectLinkingLayer *object_layer;
+
+    /* batch entry points compiled so far, until their definition (or an
+     * operator inlined into it) is redefined */
+    std::unordered_map<Symbol, BatchFunction> batch_functions;
+    size_t batch_dylibs;
+
+    /* incremental mode: every definition that is live, with a copy of
+     * its AST, and for functions the JITDylib holding the body */
+    struct Definition {
+        const DefnASTNode *defn;
+        size_t order;
+        llvm::orc::JITDylib *dylib;
+        std::vector<Symbol> uses;
+
+        /* tiered mode: bumped whenever the function is recompiled, the
+         * tier its current body was compiled at, and the call counter of
+         * a baseline body */
+        size_t version;
+        unsigned tier;
+        const uint64_t *calls;
+
+        /* a promoted memoized function: the baseline body's dylib, kept
+         * alive as it holds the memo table the promoted body shares */
+        llvm::orc::JITDylib *memo_dylib;
+
+        Definition()
+            : defn(nullptr), order(0), dylib(nullptr), version(0), tier(0), calls(nullptr),
+              memo_dylib(nullptr) {}
+    };
+    std::unordered_map<Symbol, Definition> definitions;
+    size_t next_definition_order;
+    ASTArena definitions_arena;
+
+    /* functions and operators compiled outside incremental mode, which
+     * cannot be redefined */
+    std::unordered_set<Symbol> fixed_definitions;
+
+    /* switch to incremental mode if a unit redefines one of its own
+     * functions or operators, throw if it redefines a fixed one */
+    void check_redefinitions(const AST &ast);
+
+    /* reverse dependency edges: function or operator -> definitions
+     * whose bodies call or apply it */
+    std::unordered_map<Symbol, std::unordered_set<Symbol>> users;
+
+    /* one stub per function, named after it in the main dylib */
+    std::unique_ptr<llvm::orc::IndirectStubsManager> stubs;
+
+    /* tiered mode: function -> optimized bodies that inlined a copy of it */
+    std::unordered_map<Symbol, std::unordered_set<Symbol>> inlined_into;
+
+    /* guards the definitions, the edges, and the context execute() is
+     * working on, between the caller's thread and the tier-up thread */
+    std::mutex session_mutex;
+    UnitGeneratorContext *session_context;
+
+    std::unique_ptr<Optimizer> baseline_optimizer;
+    std::thread tier_up_thread;
+    std::condition_variable tier_up_wakeup;
+    bool tier_up_stop;
+
+    /* bodies replaced by the tier-up thread, which code on the caller's
+     * thread may still be running; freed when no guppy code runs */
+    std::vector<llvm::orc::JITDylib*> retired;
+
+    struct TierStats {
+        unsigned long baseline;
+        unsigned long promoted;
+        unsigned long discarded;
+
+        TierStats() : baseline(0), promoted(0), discarded(0) {}
+    } tier_stats;
+
+    void tier_up_loop();
+    void tier_up(Symbol name, std::unique_lock<std::mutex> &lock);
+    void release_retired();
+
+    llvm::orc::ThreadSafeModule take_module(UnitGeneratorContext &context);
+    void optimize_module(UnitGeneratorContext &context);
+    void finish_module(llvm::Module &module);
+
+    /* a lookup that compiles what it finds, which is charged to the
+     * context's CompileStats as emission */
+    llvm::Expected<llvm::JITEvaluatedSymbol> lookup_emitting(llvm::orc::JITDylib &dylib,
+            const std::string &name, UnitGeneratorContext &context);
+
+    /* compile a definition on its own through the cache (or take it from
+     * the cache); false if the node is not one that is cached */
+    bool add_through_cache(const ASTNode &node, UnitGeneratorContext &context);
+    std::unique_ptr<llvm::MemoryBuffer> cached_object(const DefnASTNode &defn,
+            UnitGeneratorContext &context);
+
+    /* incremental mode: (re)define one function or operator, then
+     * recompile the definitions whose code depended on the old one */
+    void define_incrementally(const DefnASTNode &defn, UnitGeneratorContext &context);
+    void compile_incrementally(const DefnASTNode &defn, UnitGeneratorContext &context);
+    std::vector<Symbol> dependents(Symbol name, const UnitGeneratorContext &context);
+
+    /* compile, run and remove a single top level expression */
+    double run_top_level(const DefnASTNode &node, UnitGeneratorContext &context,
+            std::unique_lock<std::mutex> &lock);
+
+public:
+    /* print each module to stderr as it is handed to the JIT */
+    bool dump_ir;
+
+    /* upper bound on the threads execute() may use to generate code for
+     * the definitions of a large unit, see parallel_codegen.h */
+    unsigned codegen_threads;
+
+    /* when set (and the context has an optimizer), every function
+     * definition is compiled to an object file of its own which is
+     * stored in, or taken from, this cache. Definitions then cannot be
+     * inlined into each other, but are only ever compiled once. */
+    CompileCache* cache;
+
+    /* for long running sessions: every function definition is compiled
+     * into a JITDylib of its own and called through a stub, so that it
+     * can be redefined. A redefinition replaces the body behind the stub
+     * and frees the old one; callers stay resident, except those that
+     * inlined the definition (users of an operator), or whose
+     * memoization depends on it, which are recompiled. Definitions then
+     * cannot be inlined into each other. execute() switches to this mode
+     * by itself for a unit that redefines one of its own functions or
+     * operators, so that its callers see the new definition. */
+    bool incremental;
+
+    /* never free a replaced body, for hosts whose threads may be running
+     * compiled code at any time (rather than only within execute) */
+    bool keep_replaced_bodies;
+
+    /* compile and link every function in the context's current module,
+     * then give the context a fresh module to generate into */
+    void add_unit(UnitGeneratorContext &context);
+
+    /* hand over a module that has already been optimized, or one that
+     * has already been compiled to a native object file */
+    void add_module(llvm::orc::ThreadSafeModule module);
+    void add_object(std::unique_ptr<llvm::MemoryBuffer> object);
+
+    /* make a host function callable by name from generated code; it
+     * takes precedence over symbols of the host process */
+    void define_symbol(const std::string &name, void *address);
+
+    /* look up the native address of a previously added function */
+    void* lookup(const std::string &name);
+
+    /* generate code for every node in the AST, making all definitions
+     * callable and running each top level expression as soon as the
+     * definitions preceding it are available. Returns the values of the
+     * top level expressions in order, and passes each to on_result (if
+     * given) as soon as it is computed, so that the values of the
+     * expressions before one that fails are not lost. */
+    std::vector<double> execute(const AST &ast, UnitGeneratorContext &context,
+            const std::function<void(double)> &on_result = nullptr);
+
+    /* compile a batch entry point for a function definition, so that
+     * host code can evaluate it over many rows in one call instead of
+     * calling the scalar function once per row. Everything the context
+     * has generated so far is linked first. Compiled once per function
+     * and reused until the function is redefined; entry points returned
+     * earlier stay callable, and keep computing the old definition. */
+    BatchFunction compile_batch(const DefnASTNode &defn, UnitGeneratorContext &context);
+
+    /* tiered compilation, on top of incremental mode: every function is
+     * first compiled without optimization and with a call counter. A
+     * background thread recompiles the hottest function whose counter
+     * reached tier_up_threshold at tier_up_level, with private copies of
+     * (up to a budget of) the functions it calls so that they can be
+     * inlined, and swaps the result in behind the function's stub.
+     * tier_up_level can be changed between units while the thread runs. */
+    bool tiered;
+    uint64_t tier_up_threshold;
+    std::atomic<unsigned> tier_up_level;
+    static const uint64_t DEFAULT_TIER_UP_THRESHOLD = 1000;
+
+    /* functions compiled at the baseline tier and promoted so far */
+    void report_tiering(std::ostream &out);
+
+    /* hits and misses of every memoized function linked so far, wherever
+     * its current body lives */
+    void report_memo_stats(const UnitGeneratorContext &context, std::ostream &out);
+
+    /* Make the code compiled from now on visible to perf. PERF_MAP names
+     * every function in /tmp/perf-<pid>.map. JITDUMP has LLVM write a
+     * jitdump file (under $JITDUMPDIR, else ~/.debug/jit) with the code
+     * and, for modules generated with UnitGeneratorContext::debug_info,
+     * its line table, for 'perf inject --jit'. */
+    enum Profiling : unsigned { PERF_MAP = 1, JITDUMP = 2 };
+    void enable_profiling(unsigned profiling);
+
+    /* Profiling flags from "map", "jitdump" or "all", throws JITError for
+     * anything else */
+    static unsigned parse_profiling(const std::string &mode);
+
+    GuppyJIT();
+    ~GuppyJIT();
+};
@@ -1,14 +1,17 @@
 #pragma once
 
+#include "symbol.h"
 #include "util.h"
 
+#include <array>
+#include <cstdint>
 #include <iostream>
 #include <map>
 #include <memory>
-#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <vector>
 
@@ -23,14 +26,33 @@ struct Token {
         END_OF_FILE
     } type;
 
-    std::string contents;
+    /* view into the source text the token was lexed from (or into the
+     * symbol table), so the source must outlive its tokens */
+    std::string_view contents;
+
+    /* interned contents of every token except numeric literals, which
+     * are only ever converted to a double and so are not interned */
+    Symbol symbol;
     unsigned linum, colnum;
 
-    Token(Token::Type type, const std::string &contents, unsigned linum, unsigned colnum)
-        : type(type), contents(contents), linum(linum), colnum(colnum) {}
+    Token(Token::Type type, std::string_view contents, unsigned linum, unsigned colnum)
+        : type(type), contents(contents), symbol(intern_contents(type, contents)),
+        linum(linum), colnum(colnum) {}
+
+    Token(Token::Type type, std::string_view contents)
+        : type(type), contents(contents), symbol(intern_contents(type, contents)),
+        linum(0), colnum(0) {}
+
+    Token(Token::Type type, std::string_view contents, Symbol symbol, unsigned linum, unsigned colnum)
+        : type(type), contents(contents), symbol(symbol), linum(linum), colnum(colnum) {}
 
-    Token(Token::Type type, const std::string &contents)
-        : type(type), contents(contents), linum(0), colnum(0) {}
+    Token(Token::Type type, Symbol symbol)
+        : type(type), contents(symbol_name(symbol)), symbol(symbol), linum(0), colnum(0) {}
+
+private:
+    static Symbol intern_contents(Token::Type type, std::string_view contents) {
+        return type == Token::Type::NUMERIC_LITERAL ? Symbol { 0 } : intern(contents);
+    }
 };
 
 void print_token(const Token &t);
@@ -38,20 +60,78 @@ void print_token(const Token &t);
 bool operator ==(const Token &t1, const Token &t2);
 bool operator !=(const Token &t1, const Token &t2);
 
-static const std::map<std::string, Token::Type> RESERVED_IDENTIFIERS = {
-    {"defn", Token::Type::DEFN},
-    {"extern", Token::Type::EXTERN},
-};
+/* Character classes used by the lexer, looked up through a 256 entry
+ * table built at compile time instead of <cctype> calls and std::sets.
+ * Bytes outside of ASCII have no class and are rejected. */
+namespace charclass {
+    enum : uint8_t {
+        NONE     = 0,
+        SPACE    = 1 << 0,  // ' ' \t \n \v \f \r
+        ALPHA    = 1 << 1,  // A-Z a-z
+        DIGIT    = 1 << 2,  // 0-9
+        DOT      = 1 << 3,  // .
+        OPERATOR = 1 << 4,  // characters operators are made of
+        RESERVED = 1 << 5,  // , ; : ( ) { }
+        COMMENT  = 1 << 6,  // #
+        END      = 1 << 7,  // NUL, treated as end of input
 
-static const std::set<std::string> RESERVED_SYMBOLS = {
-    ",", ";", ":", "(", ")", "{", "}"
-};
+        IDENTIFIER_BODY = ALPHA | DIGIT,
+        NUMBER_BODY = DIGIT | DOT
+    };
+
+    constexpr std::array<uint8_t, 256> make_table() {
+        std::array<uint8_t, 256> table = {};
+
+        for (int c = 'a'; c <= 'z'; c++) table[c] |= ALPHA;
+        for (int c = 'A'; c <= 'Z'; c++) table[c] |= ALPHA;
+        for (int c = '0'; c <= '9'; c++) table[c] |= DIGIT;
+        for (char c : { ' ', '\t', '\n', '\v', '\f', '\r' }) table[(uint8_t) c] |= SPACE;
+        for (char c : { '<', '>', '+', '-', '*', '!', '@', '$', '%', '^', '&', '|' })
+            table[(uint8_t) c] |= OPERATOR;
+        for (char c : { ',', ';', ':', '(', ')', '{', '}' }) table[(uint8_t) c] |= RESERVED;
+
+        table[(uint8_t) '.'] |= DOT;
+        table[(uint8_t) '#'] |= COMMENT;
+        table[0] |= END;
+
+        return table;
+    }
+
+    constexpr std::array<uint8_t, 256> TABLE = make_table();
+
+    constexpr uint8_t of(char c) { return TABLE[(uint8_t) c]; }
+    constexpr bool is(char c, uint8_t classes) { return (TABLE[(uint8_t) c] & classes) != 0; }
+}
 
 static inline bool isopch(const char c) {
-    static const std::set<char> ALLOWED_BIN_OP_CHARS = {
-        '<', '>', '+', '-', '*', '!', '@', '$', '%', '^', '&', '|'
-    };
-    return contains(ALLOWED_BIN_OP_CHARS, c);
+    return charclass::is(c, charclass::OPERATOR);
 }
 
-std::vector<Token> tokenize(const std::string &program);
+/* keyword recognizer, IDENTIFIER if the word is not reserved */
+static inline Token::Type keyword_type(std::string_view word) {
+    switch (word.size()) {
+        case 4: return word == "defn" ? Token::Type::DEFN : Token::Type::IDENTIFIER;
+        case 6: return word == "extern" ? Token::Type::EXTERN : Token::Type::IDENTIFIER;
+        default: return Token::Type::IDENTIFIER;
+    }
+}
+
+/* the predefined symbol of a reserved single character symbol */
+static inline Symbol reserved_symbol(char c) {
+    switch (c) {
+        case ',': return sym::COMMA;
+        case ';': return sym::SEMICOLON;
+        case ':': return sym::COLON;
+        case '(': return sym::OPEN_PAREN;
+        case ')': return sym::CLOSE_PAREN;
+        case '{': return sym::OPEN_CURL;
+        default:  return sym::CLOSE_CURL;
+    }
+}
+
+/* lex a whole program, the result always ends with an END_OF_FILE token */
+std::vector<Token> tokenize(std::string_view program);
+
+/* lex a fragment of a program (e.g. one line of REPL input), appending
+ * its tokens to 'tokens' with line numbers counted from first_linum */
+void tokenize(std::string_view program, std::vector<Token> &tokens, unsigned first_linum);
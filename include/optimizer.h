@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <string>
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Target/TargetMachine.h"
+
+/* accumulated cost of one pass pipeline */
+struct PipelineStats {
+    unsigned long runs;
+    std::chrono::nanoseconds elapsed;
+
+    PipelineStats& operator+=(const PipelineStats &other) {
+        runs += other.runs;
+        elapsed += other.elapsed;
+        return *this;
+    }
+
+    PipelineStats() : runs(0), elapsed(0) {}
+};
+
+/* LLVM pass pipelines for a single -O level. The function pipeline runs
+ * on each function as soon as FunctionGen finishes it, the module
+ * pipeline (inlining, interprocedural passes) runs on a whole module just
+ * before it is handed to the JIT or the backend. */
+class Optimizer {
+    const unsigned level;
+    std::unique_ptr<llvm::TargetMachine> target_machine;
+
+    llvm::LoopAnalysisManager loop_analyses;
+    llvm::FunctionAnalysisManager function_analyses;
+    llvm::CGSCCAnalysisManager cgscc_analyses;
+    llvm::ModuleAnalysisManager module_analyses;
+    llvm::PassBuilder pass_builder;
+
+    llvm::FunctionPassManager function_passes;
+    llvm::ModulePassManager module_passes;
+
+    PipelineStats function_stats;
+    PipelineStats module_stats;
+
+    void clear_analyses();
+
+public:
+    static const unsigned MAX_LEVEL = 3;
+
+    unsigned get_level() const { return level; }
+    llvm::TargetMachine& get_target_machine() { return *target_machine; }
+
+    void run_on_function(llvm::Function &function);
+    void run_on_module(llvm::Module &module);
+
+    /* compile a (normally already optimized) module to a native object
+     * file in memory with this optimizer's target machine */
+    std::unique_ptr<llvm::MemoryBuffer> emit_object(llvm::Module &module);
+
+    /* add the pipeline statistics of another optimizer at the same level
+     * (e.g. one owned by a codegen worker thread) to this one's */
+    void merge_stats(const Optimizer &other);
+
+    /* human readable summary of time spent in each pipeline */
+    void report(std::ostream &out) const;
+
+    /* code for object files and shared libraries must be position
+     * independent, code for the JIT need not be */
+    explicit Optimizer(unsigned level, bool position_independent = false);
+};
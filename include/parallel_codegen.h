@@ -0,0 +1,47 @@
+#pragma once
+
+#include "ast.h"
+#include "codegen.h"
+
+#include <vector>
+
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+/* Code generation for the definitions of a unit spread over a pool of
+ * worker threads. Every worker owns its own LLVMContext, module, builder
+ * and optimizer, and generates a contiguous run of the unit's defns (so
+ * that neighbouring definitions, which tend to call each other, can still
+ * be inlined into one another). All prototypes of the unit are made known
+ * to every worker up front, so calls between workers' modules are simply
+ * external declarations resolved when the modules are linked.
+ *
+ * Interning must not happen while the workers run; they only read names
+ * of symbols created by the parser. */
+
+/* output of one worker: its optimized module and, if requested (and an
+ * optimizer, which owns the target machine, is attached), the module
+ * compiled to a native object file on the worker's thread */
+struct GeneratedUnit {
+    llvm::orc::ThreadSafeModule module;
+    std::unique_ptr<llvm::MemoryBuffer> object;
+};
+
+/* number of workers worth starting for the unit, at most max_threads;
+ * zero or one means the unit should be generated serially */
+unsigned codegen_worker_count(const AST &ast, unsigned max_threads);
+
+/* Generate and optimize every function definition in the AST except the
+ * top level expressions, which are left to the caller. Extern
+ * declarations and user defined operators are generated into the
+ * context's own module first, and every prototype is registered in the
+ * context. Before any worker starts, every definition and top level
+ * expression is checked, in source order, to call only functions and
+ * operators defined before it (or itself), so that a unit is accepted
+ * exactly when serial generation would accept it. Returns one unit per
+ * worker, ready to be added to the JIT or written out. Errors from any
+ * worker are rethrown here, and the functions and instructions the
+ * workers generated are added to the context's CompileStats. */
+std::vector<GeneratedUnit>
+generate_in_parallel(const AST &ast, UnitGeneratorContext &context, unsigned workers,
+        bool emit_objects);
@@ -2,13 +2,14 @@
 
 #include "ast.h"
 #include "ast_printer.h"
+#include "compile_stats.h"
 #include "lexer.h"
 
-#include <functional>
-#include <map>
+#include <deque>
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 
 
@@ -28,7 +29,7 @@ public:
 };
 
 struct BinOp {
-    std::string symbol;
+    Symbol symbol;
     int prec;
 
     enum class Associativity {
@@ -36,68 +37,164 @@ struct BinOp {
         RIGHT
     } assoc;
 
-    BinOp(const std::string &symbol, int prec, Associativity assoc)
+    BinOp(Symbol symbol, int prec, Associativity assoc)
         : symbol(symbol), prec(prec), assoc(assoc) {}
-
-    /* overloaded operator for use in std::set, should never be used otherwise */
-    inline bool operator<(BinOp b) const { return symbol < b.symbol; }
 };
 
-const static std::set<BinOp> DEFAULT_BIN_OPS {
-    BinOp("<", 10, BinOp::Associativity::LEFT),
-        BinOp("+", 20, BinOp::Associativity::LEFT),
-        BinOp("-", 20, BinOp::Associativity::LEFT),
-        BinOp("*", 40, BinOp::Associativity::LEFT),
-        BinOp("^", 50, BinOp::Associativity::RIGHT)
+const static BinOp DEFAULT_BIN_OPS[] = {
+    BinOp(sym::LESS, 10, BinOp::Associativity::LEFT),
+        BinOp(sym::PLUS, 20, BinOp::Associativity::LEFT),
+        BinOp(sym::MINUS, 20, BinOp::Associativity::LEFT),
+        BinOp(sym::STAR, 40, BinOp::Associativity::LEFT),
+        BinOp(sym::CARET, 50, BinOp::Associativity::RIGHT)
 };
 
-struct ParserSettings {
-    std::set<BinOp> binops;
+/* user defined operators bind with a precedence from 1 to this */
+const static int MAX_PRECEDENCE = 100;
 
-    // add_binop(const BinOp &new_binop);
-    ParserSettings() : binops(DEFAULT_BIN_OPS) {}
+struct ParserSettings {
+    /* operators indexed directly by symbol id, so that precedence and
+     * associativity are found with a single bounds checked load; entries
+     * with a negative precedence are symbols that are not operators */
+    std::vector<BinOp> binops;
+
+    void add_binop(const BinOp &new_binop) {
+        if (new_binop.symbol.id >= binops.size())
+            binops.resize(new_binop.symbol.id + 1, BinOp(Symbol { 0 }, -1, BinOp::Associativity::LEFT));
+        binops[new_binop.symbol.id] = new_binop;
+    }
+
+    const BinOp* find_binop(Symbol s) const {
+        if (s.id >= binops.size() || binops[s.id].prec < 0) return nullptr;
+        return &binops[s.id];
+    }
+
+    ParserSettings() {
+        for (const BinOp &b : DEFAULT_BIN_OPS) add_binop(b);
+    }
 };
 
 class Parser {
     std::vector<Token> tokens;
     std::vector<Token>::const_iterator token_iter;
 
-    void consumption_handler(bool condition,
-            std::function<void(void)> success_action,
-            std::function<void(void)> failure_action);
-
-    bool accept(const Token &acceptable_type);
-    bool accept(const Token::Type acceptable_type);
-    bool accept_and_store(const Token::Type acceptable_type, std::string &container);
-
-    void expect(const Token &expected_token);
-    void expect(const Token::Type expected_type);
-    void expect_and_store(const Token::Type expected_type, std::string &container);
+    /* Token matching. Every consuming check first makes sure the current
+     * token is not END_OF_FILE (throwing ParseIncomplete so the REPL can
+     * ask for more input), then compares the token type and, for
+     * reserved symbols, the interned symbol id. */
+    void check_not_at_end() const {
+        if (token_iter->type == Token::Type::END_OF_FILE) throw ParseIncomplete();
+    }
+
+    bool at(Token::Type type, Symbol symbol) const {
+        return token_iter->type == type && token_iter->symbol == symbol;
+    }
+
+    bool accept(Token::Type acceptable_type) {
+        check_not_at_end();
+        if (token_iter->type != acceptable_type) return false;
+        token_iter++;
+        return true;
+    }
+
+    bool accept(Token::Type acceptable_type, Symbol acceptable_symbol) {
+        check_not_at_end();
+        if (!at(acceptable_type, acceptable_symbol)) return false;
+        token_iter++;
+        return true;
+    }
+
+    bool accept_and_store(Token::Type acceptable_type, Symbol &container) {
+        check_not_at_end();
+        if (token_iter->type != acceptable_type) return false;
+        container = token_iter->symbol;
+        token_iter++;
+        return true;
+    }
+
+    [[noreturn]] void unexpected_token() const;
+
+    void expect(Token::Type expected_type) {
+        if (!accept(expected_type)) unexpected_token();
+    }
+
+    void expect(Token::Type expected_type, Symbol expected_symbol) {
+        if (!accept(expected_type, expected_symbol)) unexpected_token();
+    }
+
+    void expect_and_store(Token::Type expected_type, Symbol &container) {
+        if (!accept_and_store(expected_type, container)) unexpected_token();
+    }
+
+    void expect_and_store(Token::Type expected_type, std::string_view &container) {
+        check_not_at_end();
+        if (token_iter->type != expected_type) unexpected_token();
+        container = token_iter->contents;
+        token_iter++;
+    }
+
+    /* scratch stacks for call arguments and prototype argument names;
+     * a finished list is copied into the arena and popped, so nested
+     * lists share the storage and parsing does not allocate per node */
+    std::vector<const ASTExpr*> expr_stack;
+    std::vector<Symbol> symbol_stack;
 
     ParserSettings settings;
-    inline int get_prec(const std::string &s) const;
-    inline BinOp::Associativity get_assoc(const std::string &s) const;
 
-    std::unique_ptr<PrototypeAST> parse_prototype();
+    /* arena of the AST currently being built by parse_text */
+    ASTArena* arena;
 
-    std::unique_ptr<ASTNode> parse_statement();
-    std::unique_ptr<ASTNode> parse_defn();
-    std::unique_ptr<ASTNode> parse_extern();
-    std::unique_ptr<ASTNode> parse_top_level_expression();
+    /* incremental parsing state (see parse_line): the text of every line
+     * whose tokens are still buffered, and the bracket nesting depth
+     * reached at the end of the buffered tokens */
+    std::deque<std::string> pending_lines;
+    int pending_depth;
+    unsigned next_linum;
 
-    std::unique_ptr<ASTExpr> parse_expr();
-    std::unique_ptr<ASTExpr> parse_expr(int p);
-    std::unique_ptr<ASTExpr> parse_primary_expr();
-    std::unique_ptr<ASTExpr> parse_identifier_expr();
-    std::unique_ptr<ASTExpr> parse_numeric_literal_expr();
-    std::unique_ptr<ASTExpr> parse_paren_expr();
-    std::unique_ptr<ASTExpr> parse_bin_op_rhs(int expr_prec, std::unique_ptr<ASTExpr> LHS);
+    void discard_pending();
 
-public:
-    Parser() : settings(ParserSettings()) {}
+    const PrototypeAST* parse_prototype();
+    const PrototypeAST* parse_operator_prototype();
 
-    AST parse_text(const std::string &text);
+    const ASTNode* parse_statement();
+    const ASTNode* parse_defn();
+    const ASTNode* parse_extern();
+    const ASTNode* parse_top_level_expression();
 
-    void reset() { settings = ParserSettings(); }
+    const ASTExpr* parse_expr();
+    const ASTExpr* parse_expr(int p);
+    const ASTExpr* parse_primary_expr();
+    const ASTExpr* parse_identifier_expr();
+    const ASTExpr* parse_numeric_literal_expr();
+    const ASTExpr* parse_paren_expr();
+
+public:
+    /* when set, parse_text charges lexing and parsing to their phases and
+     * counts the tokens */
+    CompileStats *stats;
+
+    Parser()
+        : settings(ParserSettings()), arena(nullptr), pending_depth(0), next_linum(1),
+        stats(nullptr) {}
+
+    /* text only needs to stay alive for the duration of the call, the
+     * returned AST does not refer back into it */
+    AST parse_text(std::string_view text);
+
+    /* Incremental interface for interactive input. Only the new line is
+     * lexed, its tokens are appended to those of earlier lines that did
+     * not yet form a complete statement, and parsing is only attempted
+     * once the buffered input could be complete (brackets balanced, not
+     * ending in an operator or separator). Throws ParseIncomplete while
+     * more input is needed, otherwise returns the statements parsed from
+     * all buffered lines. */
+    AST parse_line(std::string_view line);
+
+    bool has_pending_input() const { return !pending_lines.empty(); }
+
+    void reset() {
+        settings = ParserSettings();
+        discard_pending();
+    }
 };
 
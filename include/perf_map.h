@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+
+/* Appends a line 'START SIZE name' (both in hex) for every function in
+ * each object the JIT loads to /tmp/perf-<pid>.map, which is where perf
+ * looks up the names of samples that hit anonymous executable memory.
+ * Entries are never removed, so a symbol whose code was freed keeps its
+ * line; perf resolves an address to the first entry that covers it. */
+class PerfMapListener : public llvm::JITEventListener {
+    std::mutex mutex;
+    std::string path;
+    FILE *file;
+
+public:
+    void notifyObjectLoaded(ObjectKey key, const llvm::object::ObjectFile &object,
+            const llvm::RuntimeDyld::LoadedObjectInfo &info) override;
+
+    const std::string& get_path() const { return path; }
+
+    /* throws JITError if the map cannot be opened */
+    PerfMapListener();
+    ~PerfMapListener() override;
+
+    PerfMapListener(const PerfMapListener&) = delete;
+    PerfMapListener& operator=(const PerfMapListener&) = delete;
+};
@@ -1,9 +1,17 @@
 #pragma once
 
 #include "parser.h"
+#include "ast_optimizer.h"
 #include "ast_printer.h"
+#include "codegen.h"
+#include "compile_cache.h"
+#include "jit.h"
+#include "optimizer.h"
 
 #include <iostream>
 
-void repl(void);
+/* cache may be null; tiered as GuppyJIT::tiered, fp_flags as
+ * UnitGeneratorContext::fp_flags, profiling as GuppyJIT::enable_profiling */
+void repl(unsigned opt_level, CompileCache *cache, bool tiered, llvm::FastMathFlags fp_flags,
+        unsigned profiling);
 
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+/* Read-only view of a source file. The file is mapped into memory rather
+ * than copied, so tokens can refer straight into it for as long as the
+ * SourceBuffer is alive. */
+class SourceBuffer {
+    const char *data;
+    size_t size;
+    std::string name;
+
+public:
+    std::string_view contents() const { return std::string_view(data, size); }
+    const std::string& get_name() const { return name; }
+
+    /* throws std::system_error if the file cannot be opened or mapped */
+    explicit SourceBuffer(const std::string &filename);
+    ~SourceBuffer();
+
+    SourceBuffer(const SourceBuffer&) = delete;
+    SourceBuffer& operator=(const SourceBuffer&) = delete;
+};
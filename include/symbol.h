@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* Interned name. Every distinct identifier, operator and reserved symbol
+ * is stored once in the global SymbolTable, and everything downstream of
+ * the lexer refers to it by this small integer id. */
+struct Symbol {
+    uint32_t id;
+
+    bool operator==(Symbol other) const { return id == other.id; }
+    bool operator!=(Symbol other) const { return id != other.id; }
+    bool operator<(Symbol other) const { return id < other.id; }
+};
+
+namespace std {
+    template <>
+    struct hash<Symbol> {
+        size_t operator()(Symbol s) const { return std::hash<uint32_t>()(s.id); }
+    };
+}
+
+/* symbols the compiler itself needs to refer to, interned in this order
+ * when the table is created so that their ids are compile time constants */
+namespace sym {
+    constexpr Symbol ANON         = { 0 };  // "__ANON__"
+    constexpr Symbol LESS         = { 1 };  // "<"
+    constexpr Symbol PLUS         = { 2 };  // "+"
+    constexpr Symbol MINUS        = { 3 };  // "-"
+    constexpr Symbol STAR         = { 4 };  // "*"
+    constexpr Symbol CARET        = { 5 };  // "^"
+    constexpr Symbol COMMA        = { 6 };  // ","
+    constexpr Symbol SEMICOLON    = { 7 };  // ";"
+    constexpr Symbol COLON        = { 8 };  // ":"
+    constexpr Symbol OPEN_PAREN   = { 9 };  // "("
+    constexpr Symbol CLOSE_PAREN  = { 10 }; // ")"
+    constexpr Symbol OPEN_CURL    = { 11 }; // "{"
+    constexpr Symbol CLOSE_CURL   = { 12 }; // "}"
+    constexpr Symbol DEFN         = { 13 }; // "defn"
+    constexpr Symbol EXTERN       = { 14 }; // "extern"
+    constexpr Symbol BINARY       = { 15 }; // "binary"
+}
+
+/* Interning is thread safe, and only adding a name takes the lock:
+ * intern() and find() first look the name up without it. name() takes no
+ * lock either: names are kept in chunks that never move, and a symbol can
+ * only reach another thread through some synchronization after intern()
+ * created it. */
+class SymbolTable {
+    std::mutex mutex;
+
+    /* open addressing hash table of symbol ids, kept at most half full.
+     * A slot holds the name's hash in its high half and the id plus one
+     * (zero for an empty slot) in its low half, written with a release
+     * store once the name is in place. Growing copies the table and
+     * publishes the copy; replaced tables are kept (they add up to less
+     * than the current one) for readers still probing them, which at
+     * worst miss a name and take the lock. */
+    struct SlotTable {
+        size_t mask;
+        std::unique_ptr<std::atomic<uint64_t>[]> slots;
+
+        explicit SlotTable(size_t size)
+            : mask(size - 1), slots(new std::atomic<uint64_t>[size]()) {}
+    };
+    std::atomic<SlotTable*> slots;
+    std::vector<std::unique_ptr<SlotTable>> slot_tables;
+
+    /* names are copied into large blocks that are never moved or freed,
+     * so the views handed out by name() stay valid */
+    static const size_t STORAGE_BLOCK_SIZE = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> storage;
+    char *storage_cursor;
+    size_t storage_remaining;
+
+    /* names by id */
+    static const size_t NAMES_PER_CHUNK = 4096;
+    static const size_t MAX_NAME_CHUNKS = 16384;
+    std::unique_ptr<std::unique_ptr<std::string_view[]>[]> name_chunks;
+    std::atomic<size_t> count;
+
+    std::string_view& name_slot(uint32_t id) const {
+        return name_chunks[id / NAMES_PER_CHUNK][id % NAMES_PER_CHUNK];
+    }
+
+    static uint32_t hash(std::string_view name);
+
+    /* the symbol of a name in the table, else false and the empty slot
+     * that ends its probe sequence in end */
+    bool probe(const SlotTable &table, std::string_view name, uint32_t h,
+            Symbol &s, size_t &end) const;
+    std::string_view store(std::string_view name);
+    void grow();
+
+    SymbolTable();
+
+public:
+    static SymbolTable& global();
+
+    Symbol intern(std::string_view name);
+    std::string_view name(Symbol s) const { return name_slot(s.id); }
+
+    /* the symbol of a name if it has been interned, without interning it
+     * (names are never freed, so looking up arbitrary strings from a
+     * host program must not add them) */
+    bool find(std::string_view name, Symbol &s);
+    size_t size();
+
+    SymbolTable(const SymbolTable&) = delete;
+    SymbolTable& operator=(const SymbolTable&) = delete;
+};
+
+inline Symbol intern(std::string_view name) { return SymbolTable::global().intern(name); }
+inline bool find_symbol(std::string_view name, Symbol &s) { return SymbolTable::global().find(name, s); }
+inline std::string_view symbol_name(Symbol s) { return SymbolTable::global().name(s); }
+
+inline std::ostream& operator<<(std::ostream &out, Symbol s) { return out << symbol_name(s); }
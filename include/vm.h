@@ -0,0 +1,135 @@
+#pragma once
+
+#include "ast.h"
+#include "compile_stats.h"
+#include "symbol.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* A register based bytecode interpreter: an execution tier that needs no
+ * LLVM, for processes that only evaluate a few formulas and would spend
+ * most of their time initializing and running the JIT. */
+
+class VMError : public std::runtime_error
+{
+public:
+    VMError(std::string const &msg) : std::runtime_error(msg) {}
+};
+
+enum class Opcode : uint8_t {
+    LOAD_CONST,   // r[a] = constants[b]
+    MOVE,         // r[a] = r[b]
+    ADD,          // r[a] = r[b] + r[c]
+    SUB,          // r[a] = r[b] - r[c]
+    MUL,          // r[a] = r[b] * r[c]
+    DIV,          // r[a] = r[b] / r[c]
+    POW,          // r[a] = pow(r[b], r[c])
+    LESS,         // r[a] = r[b] < r[c] or unordered ? 1 : 0
+    CALL,         // r[a] = functions[c](r[b] .. r[b + argc - 1])
+    CALL_EXTERN,  // r[a] = externs[c](r[b] .. r[b + argc - 1])
+    RET           // return r[a]
+};
+
+struct Instruction {
+    Opcode op;
+    uint8_t argc;
+    uint16_t a, b, c;
+};
+
+/* Every value is a double in a register. A frame's registers start with
+ * the arguments, followed by one register per distinct subexpression:
+ * bodies have no control flow, so registers are never reused, and a
+ * subexpression the AST optimizer shared is evaluated only once. */
+struct BytecodeFunction {
+    std::string name;
+    uint16_t arity;
+    uint16_t registers;
+    std::vector<Instruction> code;
+    std::vector<double> constants;
+
+    bool defined() const { return !code.empty(); }
+};
+
+struct ExternFunction {
+    std::string name;
+    uint16_t arity;
+    void *address;  // null until resolved
+};
+
+/* functions (user operators included, under the operator's symbol) and
+ * externs by index; calls refer to these indices, so redefining a
+ * function replaces its code for every caller */
+struct BytecodeProgram {
+    std::vector<BytecodeFunction> functions;
+    std::unordered_map<Symbol, uint16_t> function_index;
+
+    std::vector<ExternFunction> externs;
+    std::unordered_map<Symbol, uint16_t> extern_index;
+
+    /* resolve an extern from the host process, or bind it to address */
+    uint16_t declare_extern(Symbol name, size_t arity, void *address = nullptr);
+
+    /* compile a definition into its function slot; a top level
+     * expression gets a fresh slot that the caller removes again */
+    uint16_t compile(const DefnASTNode &defn);
+};
+
+/* externs take up to this many arguments in the VM */
+static const size_t MAX_EXTERN_ARITY = 8;
+
+/* adds each node it visits to a program, resolving externs and compiling
+ * definitions, and returns the node's extern or function slot */
+class BytecodeCompiler : public NodeVisitor<BytecodeCompiler, uint16_t> {
+    BytecodeProgram &program;
+
+public:
+    uint16_t apply_to(const ExternASTNode &extern_node);
+    uint16_t apply_to(const DefnASTNode &defn_node);
+
+    explicit BytecodeCompiler(BytecodeProgram &program) : program(program) {}
+};
+
+class VM {
+    BytecodeProgram program;
+
+    /* registers of every active frame, and the saved state of callers */
+    struct Frame {
+        const Instruction *return_pc;
+        double *registers;
+        const BytecodeFunction *function;
+        uint16_t destination;
+    };
+    std::unique_ptr<double[]> stack;
+    std::unique_ptr<Frame[]> frames;
+
+public:
+    static const size_t STACK_REGISTERS = 1 << 20;
+    static const size_t MAX_CALL_DEPTH = 1 << 16;
+
+    /* evaluate function index with args (arity of them) */
+    double call(uint16_t function, const double *args);
+
+    /* compile each node in turn and evaluate each top level expression
+     * as soon as the definitions preceding it are compiled, passing its
+     * value to on_result (if given), like GuppyJIT::execute */
+    std::vector<double> execute(const AST &ast,
+            const std::function<void(double)> &on_result = nullptr);
+
+    /* make a host function double(double, ...) callable from guppy code
+     * without an extern declaration */
+    void register_extern(const std::string &name, void *address, size_t arity);
+
+    const BytecodeProgram& get_program() const { return program; }
+
+    /* when set, execute() charges compiling to bytecode to codegen, and
+     * evaluating top level expressions to run */
+    CompileStats *stats;
+
+    VM();
+};
@@ -0,0 +1,127 @@
+#include "aot.h"
+#include "codegen.h"
+#include "optimizer.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+static bool
+is_top_level_expression(const ASTNode *node)
+{
+    return node->kind == ASTNode::Kind::DEFN
+        && static_cast<const DefnASTNode*>(node)->prototype->name == sym::ANON;
+}
+
+size_t
+count_top_level_expressions(const AST &ast)
+{
+    size_t count = 0;
+    for (auto const &node : ast) {
+        if (is_top_level_expression(node)) count++;
+    }
+    return count;
+}
+
+static std::unique_ptr<llvm::MemoryBuffer>
+compile_unit(const AST &ast, unsigned opt_level, llvm::FastMathFlags fp_flags,
+        CompileStats *stats)
+{
+    Optimizer optimizer(opt_level, true);
+    UnitGeneratorContext context;
+    context.set_optimizer(&optimizer);
+    context.set_fp_flags(fp_flags);
+    context.stats = stats;
+
+    FunctionGen fgen(&context);
+    for (auto const &node : ast) {
+        if (is_top_level_expression(node)) continue;
+        fgen.visit(node);
+    }
+
+    {
+        CompileStats::Scope optimize_scope(stats, CompileStats::Phase::OPTIMIZE);
+        optimizer.run_on_module(*context.llvm_module);
+    }
+    if (stats != nullptr)
+        stats->optimized_instructions += context.llvm_module->getInstructionCount();
+
+    CompileStats::Scope emit_scope(stats, CompileStats::Phase::EMIT);
+    return optimizer.emit_object(*context.llvm_module);
+}
+
+static void
+write_file(const std::string &path, const llvm::MemoryBuffer &contents)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(contents.getBufferStart(), contents.getBufferSize());
+    out.close();
+
+    if (!out) throw AOTError("could not write '" + path + "'");
+}
+
+void
+compile_to_object(const AST &ast, unsigned opt_level, const std::string &output_path,
+        llvm::FastMathFlags fp_flags, CompileStats *stats)
+{
+    write_file(output_path, *compile_unit(ast, opt_level, fp_flags, stats));
+}
+
+/* run a program without going through a shell, so that paths need no
+ * quoting, and return its exit status */
+static int
+run_program(const std::vector<std::string> &args)
+{
+    std::vector<char*> argv;
+    for (auto const &a : args) argv.push_back(const_cast<char*>(a.c_str()));
+    argv.push_back(nullptr);
+
+    pid_t pid = ::fork();
+    if (pid < 0) throw AOTError(std::string("fork failed: ") + std::strerror(errno));
+
+    if (pid == 0) {
+        ::execvp(argv[0], argv.data());
+        std::fprintf(stderr, "guppy: could not run '%s': %s\n", argv[0], std::strerror(errno));
+        ::_exit(127);
+    }
+
+    int status;
+    while (::waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) throw AOTError(std::string("waitpid failed: ") + std::strerror(errno));
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void
+compile_to_shared_library(const AST &ast, unsigned opt_level, const std::string &output_path,
+        llvm::FastMathFlags fp_flags, CompileStats *stats)
+{
+    auto object = compile_unit(ast, opt_level, fp_flags, stats);
+
+    char object_path[] = "/tmp/guppy-XXXXXX.o";
+    int fd = ::mkstemps(object_path, 2);
+    if (fd < 0) throw AOTError(std::string("could not create temporary file: ") + std::strerror(errno));
+    ::close(fd);
+
+    const char *cc = std::getenv("CC");
+    int status;
+    try {
+        write_file(object_path, *object);
+        status = run_program({ cc != nullptr && *cc != '\0' ? cc : "cc",
+                "-shared", "-o", output_path, object_path, "-lm" });
+    } catch (...) {
+        std::remove(object_path);
+        throw;
+    }
+    std::remove(object_path);
+
+    if (status != 0)
+        throw AOTError("linking '" + output_path + "' failed");
+}
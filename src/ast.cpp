@@ -1,8 +1,129 @@
 #include "ast.h"
 
-void ExternASTNode::inject(NodeTraverser &traverser) const { traverser.apply_to(*this); }
-void DefnASTNode::inject(NodeTraverser &traverser) const { traverser.apply_to(*this); }
-void VariableASTExpr::inject(ExprTraverser &traverser) const { traverser.apply_to(*this); }
-void LiteralDoubleASTExpr::inject(ExprTraverser &traverser) const { traverser.apply_to(*this); }
-void BinOpASTExpr::inject(ExprTraverser &traverser) const { traverser.apply_to(*this); }
-void CallASTExpr::inject(ExprTraverser &traverser) const { traverser.apply_to(*this); }
+#include <cmath>
+#include <unordered_map>
+
+void*
+ASTArena::allocate_slow(size_t size, size_t align)
+{
+    /* oversized requests get a block of their own so that the
+     * remainder of the current block is not wasted */
+    size_t block_size = size + align > BLOCK_SIZE ? size + align : BLOCK_SIZE;
+
+    blocks.emplace_back(new char[block_size]);
+    bytes_reserved += block_size;
+
+    char *block = blocks.back().get();
+    if (block_size == BLOCK_SIZE || cursor == nullptr) {
+        cursor = block;
+        block_end = block + block_size;
+        return allocate(size, align);
+    }
+
+    uintptr_t p = (reinterpret_cast<uintptr_t>(block) + align - 1) & ~(uintptr_t)(align - 1);
+    bytes_used += size;
+    return reinterpret_cast<void*>(p);
+}
+
+bool
+expanded_exponent(const ASTExpr *exponent, int &n)
+{
+    if (exponent->kind != ASTExpr::Kind::LITERAL_DOUBLE) return false;
+
+    double value = static_cast<const LiteralDoubleASTExpr*>(exponent)->value;
+    if (!(std::fabs(value) <= MAX_EXPANDED_EXPONENT) || value != std::trunc(value))
+        return false;
+
+    n = static_cast<int>(value);
+    return true;
+}
+
+const PrototypeAST*
+copy_prototype(const PrototypeAST *proto, ASTArena &arena)
+{
+    ArenaArray<Symbol> args(arena.copy_array(proto->args.begin(), proto->args.size()),
+            proto->args.size());
+
+    if (proto->is_operator())
+        return arena.create<PrototypeAST>(proto->name, args, proto->precedence, proto->location);
+    return arena.create<PrototypeAST>(proto->name, args, proto->location);
+}
+
+typedef std::unordered_map<const ASTExpr*, const ASTExpr*> ExprCopies;
+
+static const ASTExpr*
+copy_shared_expr(const ASTExpr *expr, ASTArena &arena, ExprCopies &copies);
+
+/* the copy of a single expression node, whose children are copied
+ * through copies */
+static const ASTExpr*
+copy_expr_node(const ASTExpr *expr, ASTArena &arena, ExprCopies &copies)
+{
+    switch (expr->kind) {
+        case ASTExpr::Kind::VARIABLE:
+            return arena.create<VariableASTExpr>(static_cast<const VariableASTExpr*>(expr)->name);
+
+        case ASTExpr::Kind::LITERAL_DOUBLE:
+            return arena.create<LiteralDoubleASTExpr>(
+                    static_cast<const LiteralDoubleASTExpr*>(expr)->value);
+
+        case ASTExpr::Kind::BINOP: {
+            auto binop = static_cast<const BinOpASTExpr*>(expr);
+            auto LHS = copy_shared_expr(binop->LHS, arena, copies);
+            auto RHS = copy_shared_expr(binop->RHS, arena, copies);
+            return arena.create<BinOpASTExpr>(binop->binop, LHS, RHS, binop->location);
+        }
+
+        case ASTExpr::Kind::CALL: {
+            auto call = static_cast<const CallASTExpr*>(expr);
+            size_t count = call->args.size();
+
+            const ASTExpr **args = count == 0 ? nullptr : static_cast<const ASTExpr**>(
+                    arena.allocate(sizeof(const ASTExpr*) * count, alignof(const ASTExpr*)));
+            for (size_t i = 0; i < count; i++)
+                args[i] = copy_shared_expr(call->args[i], arena, copies);
+
+            return arena.create<CallASTExpr>(call->callee, ArenaArray<const ASTExpr*>(args, count),
+                    call->location);
+        }
+    }
+
+    return nullptr;
+}
+
+static const ASTExpr*
+copy_shared_expr(const ASTExpr *expr, ASTArena &arena, ExprCopies &copies)
+{
+    auto it = copies.find(expr);
+    if (it != copies.end()) return it->second;
+
+    const ASTExpr *copy = copy_expr_node(expr, arena, copies);
+    copies.emplace(expr, copy);
+    return copy;
+}
+
+const ASTExpr*
+copy_expr(const ASTExpr *expr, ASTArena &arena)
+{
+    ExprCopies copies;
+    return copy_shared_expr(expr, arena, copies);
+}
+
+const ASTNode*
+copy_node(const ASTNode *node, ASTArena &arena)
+{
+    switch (node->kind) {
+        case ASTNode::Kind::EXTERN: {
+            auto extern_node = static_cast<const ExternASTNode*>(node);
+            return arena.create<ExternASTNode>(copy_prototype(extern_node->prototype, arena));
+        }
+
+        case ASTNode::Kind::DEFN: {
+            auto defn_node = static_cast<const DefnASTNode*>(node);
+            auto prototype = copy_prototype(defn_node->prototype, arena);
+            return arena.create<DefnASTNode>(prototype, copy_expr(defn_node->body, arena));
+        }
+    }
+
+    return nullptr;
+}
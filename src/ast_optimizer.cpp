@@ -0,0 +1,216 @@
+#include "ast_optimizer.h"
+
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+
+static uint64_t
+double_bits(double value)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static double
+bits_double(uint64_t bits)
+{
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static bool
+is_builtin_binop(Symbol op)
+{
+    return op == sym::PLUS || op == sym::MINUS || op == sym::STAR || op == sym::LESS;
+}
+
+static bool
+is_literal(const ASTExpr *expr, double &value)
+{
+    if (expr->kind != ASTExpr::Kind::LITERAL_DOUBLE) return false;
+    value = static_cast<const LiteralDoubleASTExpr*>(expr)->value;
+    return true;
+}
+
+/* what the code ValueGen emits for the operator would compute */
+static double
+fold(Symbol op, double l, double r)
+{
+    if (op == sym::PLUS) return l + r;
+    if (op == sym::MINUS) return l - r;
+    if (op == sym::STAR) return l * r;
+
+    /* '<' is an unordered compare: true when either side is a NaN */
+    return (std::isnan(l) || std::isnan(r) || l < r) ? 1.0 : 0.0;
+}
+
+size_t
+ASTOptimizer::KeyHash::operator()(const Key &k) const
+{
+    uint64_t h = static_cast<uint64_t>(k.kind) * 0x9E3779B97F4A7C15ull;
+    h ^= (h >> 29) ^ (k.symbol + 0x632BE59BD9B4E019ull + (h << 6));
+    h ^= (h >> 31) ^ (k.bits + 0xBF58476D1CE4E5B9ull + (h << 6));
+    h ^= (h >> 27) ^ (reinterpret_cast<uintptr_t>(k.LHS) + (h << 6));
+    h ^= (h >> 33) ^ (reinterpret_cast<uintptr_t>(k.RHS) + (h << 6));
+    return static_cast<size_t>(h * 0x94D049BB133111EBull);
+}
+
+const ASTExpr*
+ASTOptimizer::canonical(const Key &key, const ASTExpr *original, SourceLocation location)
+{
+    auto it = table.find(key);
+    if (it != table.end()) {
+        if (it->second != original && key.kind == ASTExpr::Kind::BINOP) stats.shared++;
+        return it->second;
+    }
+
+    const ASTExpr *node = original;
+    if (node == nullptr) {
+        switch (key.kind) {
+            case ASTExpr::Kind::LITERAL_DOUBLE:
+                node = arena.create<LiteralDoubleASTExpr>(bits_double(key.bits));
+                break;
+            case ASTExpr::Kind::BINOP:
+                node = arena.create<BinOpASTExpr>(Symbol { key.symbol }, key.LHS, key.RHS, location);
+                break;
+            default:
+                node = arena.create<VariableASTExpr>(Symbol { key.symbol });
+                break;
+        }
+    }
+
+    table.emplace(key, node);
+    stats.nodes_out++;
+    return node;
+}
+
+const ASTExpr*
+ASTOptimizer::rewrite_binop(const BinOpASTExpr *binop)
+{
+    const ASTExpr *LHS = rewrite(binop->LHS);
+    const ASTExpr *RHS = rewrite(binop->RHS);
+    const Symbol op = binop->binop;
+    const ASTExpr *original = LHS == binop->LHS && RHS == binop->RHS ? binop : nullptr;
+
+    /* user defined operators are calls, which are never merged */
+    if (!is_builtin_binop(op)) {
+        stats.nodes_out++;
+        return original != nullptr ? original
+            : arena.create<BinOpASTExpr>(op, LHS, RHS, binop->location);
+    }
+
+    double l, r;
+    bool l_literal = is_literal(LHS, l);
+    bool r_literal = is_literal(RHS, r);
+
+    if (l_literal && r_literal) {
+        stats.folded++;
+        return canonical(Key { ASTExpr::Kind::LITERAL_DOUBLE, 0,
+                double_bits(fold(op, l, r)), nullptr, nullptr }, nullptr);
+    }
+
+    if (r_literal) {
+        bool identity = (op == sym::STAR && r == 1.0)
+            || (op == sym::PLUS && r == 0.0 && std::signbit(r))
+            || (op == sym::MINUS && r == 0.0 && !std::signbit(r));
+        if (identity) {
+            stats.simplified++;
+            return LHS;
+        }
+    }
+
+    if (l_literal) {
+        bool identity = (op == sym::STAR && l == 1.0)
+            || (op == sym::PLUS && l == 0.0 && std::signbit(l));
+        if (identity) {
+            stats.simplified++;
+            return RHS;
+        }
+    }
+
+    return canonical(Key { ASTExpr::Kind::BINOP, op.id, 0, LHS, RHS }, original, binop->location);
+}
+
+const ASTExpr*
+ASTOptimizer::rewrite_call(const CallASTExpr *call)
+{
+    size_t base = arg_stack.size();
+    bool changed = false;
+
+    for (auto const &a : call->args) {
+        const ASTExpr *arg = rewrite(a);
+        changed = changed || arg != a;
+        arg_stack.push_back(arg);
+    }
+
+    const ASTExpr *result = call;
+    if (changed) {
+        size_t count = arg_stack.size() - base;
+        ArenaArray<const ASTExpr*> args(arena.copy_array(arg_stack.data() + base, count), count);
+        result = arena.create<CallASTExpr>(call->callee, args, call->location);
+    }
+
+    arg_stack.resize(base);
+    stats.nodes_out++;
+    return result;
+}
+
+const ASTExpr*
+ASTOptimizer::rewrite(const ASTExpr *expr)
+{
+    stats.nodes_in++;
+
+    switch (expr->kind) {
+        case ASTExpr::Kind::VARIABLE:
+            return canonical(Key { ASTExpr::Kind::VARIABLE,
+                    static_cast<const VariableASTExpr*>(expr)->name.id, 0, nullptr, nullptr }, expr);
+
+        case ASTExpr::Kind::LITERAL_DOUBLE:
+            return canonical(Key { ASTExpr::Kind::LITERAL_DOUBLE, 0,
+                    double_bits(static_cast<const LiteralDoubleASTExpr*>(expr)->value),
+                    nullptr, nullptr }, expr);
+
+        case ASTExpr::Kind::BINOP:
+            return rewrite_binop(static_cast<const BinOpASTExpr*>(expr));
+
+        case ASTExpr::Kind::CALL:
+            return rewrite_call(static_cast<const CallASTExpr*>(expr));
+    }
+
+    return expr;
+}
+
+void
+ASTOptimizer::run(AST &ast)
+{
+    for (size_t i = 0; i < ast.size(); i++) {
+        if (ast[i]->kind != ASTNode::Kind::DEFN) continue;
+
+        auto defn = static_cast<const DefnASTNode*>(ast[i]);
+        const ASTExpr *body = rewrite(defn->body);
+        if (body != defn->body)
+            ast.replace(i, arena.create<DefnASTNode>(defn->prototype, body));
+    }
+}
+
+void
+ASTOptimizer::report(std::ostream &out) const
+{
+    out << "ast optimizer:\n"
+        << "  " << stats.nodes_in << " expression nodes in, " << stats.nodes_out << " out";
+    if (stats.nodes_in > 0)
+        out << " (" << std::fixed << std::setprecision(1)
+            << 100.0 * stats.nodes_out / stats.nodes_in << "%)" << std::defaultfloat;
+    out << "\n  " << stats.folded << " folded, " << stats.simplified << " simplified, "
+        << stats.shared << " shared\n";
+}
+
+ASTOptimizerStats
+optimize_ast(AST &ast)
+{
+    ASTOptimizer optimizer(ast.get_arena());
+    optimizer.run(ast);
+    return optimizer.get_stats();
+}
@@ -1,32 +1,27 @@
 #include "ast_printer.h"
 
-void
-ASTPrinter::append_line_to_output(std::ostringstream &line)
+std::ostream&
+ASTPrinter::line()
 {
-    if (tab_level == 0) {
-        node_output << line.str() << '\n';
-    } else {
-        for (unsigned i = 0; i < tab_level; i++)
-            node_output << '|' << "  ";
-        node_output << line.str() << '\n';
-    }
-    line.str("");
-    line.clear();
+    for (unsigned i = 0; i < tab_level; i++)
+        node_output << '|' << "  ";
+    return node_output;
 }
 
 void
 ASTPrinter::process_prototype(const PrototypeAST &proto)
 {
-    std::ostringstream tmp;
-
-    tmp << "FUNCTION NAME: " << proto.name;
-    append_line_to_output(tmp);
+    if (proto.is_operator()) {
+        line() << "BINARY OPERATOR: " << proto.name << '\n';
+        line() << "PRECEDENCE: " << proto.precedence << '\n';
+    } else {
+        line() << "FUNCTION NAME: " << proto.name << '\n';
+    }
 
-    tmp << "FUNCTION ARGS: ";
+    std::ostream &args = line() << "FUNCTION ARGS: ";
     for (auto arg : proto.args)
-        tmp << arg <<  " ";
-
-    append_line_to_output(tmp);
+        args << arg <<  " ";
+    args << '\n';
 }
 
 void
@@ -41,9 +36,7 @@ ASTPrinter::print_node_output()
 void
 ASTPrinter::apply_to(const ExternASTNode &extern_node)
 {
-    std::ostringstream tmp;
-    tmp << "EXTERN:";
-    append_line_to_output(tmp);
+    line() << "EXTERN:" << '\n';
     tab_level++;
 
     process_prototype(*extern_node.prototype);
@@ -54,18 +47,15 @@ ASTPrinter::apply_to(const ExternASTNode &extern_node)
 void
 ASTPrinter::apply_to(const DefnASTNode &defn_node)
 {
-    std::ostringstream tmp;
-    tmp << "DEFN:";
-    append_line_to_output(tmp);
+    line() << "DEFN:" << '\n';
     tab_level++;
 
     process_prototype(*defn_node.prototype);
 
-    tmp << "BODY:";
-    append_line_to_output(tmp);
+    line() << "BODY:" << '\n';
     tab_level++;
 
-    defn_node.body->inject(*this);
+    visit(defn_node.body);
 
     print_node_output();
 }
@@ -73,56 +63,42 @@ ASTPrinter::apply_to(const DefnASTNode &defn_node)
 void
 ASTPrinter::apply_to(const VariableASTExpr &var_expr)
 {
-    std::ostringstream tmp;
-    tmp << "VARIABLE: " << var_expr.name;
-    append_line_to_output(tmp);
+    line() << "VARIABLE: " << var_expr.name << '\n';
 }
 
 void
 ASTPrinter::apply_to(const LiteralDoubleASTExpr &double_expr)
 {
-    std::ostringstream tmp;
-    tmp << "DOUBLE: " << double_expr.value;
-    append_line_to_output(tmp);
+    line() << "DOUBLE: " << double_expr.value << '\n';
 }
 
 void
 ASTPrinter::apply_to(const BinOpASTExpr &bin_op_expr)
 {
-    std::ostringstream tmp;
-    tmp << "BINOP: " << bin_op_expr.binop;
-    append_line_to_output(tmp);
+    line() << "BINOP: " << bin_op_expr.binop << '\n';
     tab_level++;
 
-    tmp << "LHS:";
-    bin_op_expr.LHS->inject(*this);
-
-    tmp << "RHS:";
-    bin_op_expr.RHS->inject(*this);
+    visit(bin_op_expr.LHS);
+    visit(bin_op_expr.RHS);
     tab_level--;
 }
 
 void
 ASTPrinter::apply_to(const CallASTExpr &call_expr)
 {
-    std::ostringstream tmp;
-    tmp << "CALL:";
-    append_line_to_output(tmp);
+    line() << "CALL:" << '\n';
     tab_level++;
 
-    tmp << "FUNCTION: " << call_expr.callee;
-    append_line_to_output(tmp);
-    tmp << "ARGUMENTS: ";
-    append_line_to_output(tmp);
+    line() << "FUNCTION: " << call_expr.callee << '\n';
+    line() << "ARGUMENTS: " << '\n';
     tab_level++;
 
     unsigned int i = 1;
     for (auto &a : call_expr.args) {
-        tmp << "ARG " << i << ":";
-        append_line_to_output(tmp);
+        line() << "ARG " << i << ":" << '\n';
         i++;
         tab_level++;
-        a->inject(*this);
+        visit(a);
         tab_level--;
     }
 
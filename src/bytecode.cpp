@@ -0,0 +1,349 @@
+#include "vm.h"
+
+#include <cstring>
+#include <limits>
+
+#include <dlfcn.h>
+
+static const size_t MAX_INDEX = std::numeric_limits<uint16_t>::max();
+
+namespace {
+
+/* compiles the body of one definition, each node into the register
+ * holding its value */
+class BytecodeGen : public ExprVisitor<BytecodeGen, uint16_t> {
+    const BytecodeProgram &program;
+    const PrototypeAST &proto;
+    BytecodeFunction &function;
+
+    /* registers of the operator nodes compiled so far, so that
+     * subexpressions the AST optimizer merged are evaluated once */
+    std::unordered_map<const ASTExpr*, uint16_t> expr_registers;
+
+    /* constant pool slots by bit pattern */
+    std::unordered_map<uint64_t, uint16_t> constant_slots;
+
+    uint16_t new_register();
+    void emit(Opcode op, uint16_t a, uint16_t b, uint16_t c, size_t argc = 0);
+
+    /* registers of the arguments of the calls being compiled, shared by
+     * nested calls like the AST optimizer's */
+    std::vector<uint16_t> arg_stack;
+
+    /* load a constant into a new register */
+    uint16_t constant(double value);
+
+    /* base ^ n as multiplications, in the same order as ValueGen */
+    uint16_t expand_power(uint16_t base, int n);
+
+    /* copy the values of arg_stack[first..] into consecutive new
+     * registers and pop them, returning the first new register */
+    uint16_t arguments(size_t first);
+
+public:
+    /* register holding the value of a subexpression */
+    uint16_t register_of(const ASTExpr *expr);
+
+    uint16_t apply_to(const VariableASTExpr &var_expr);
+    uint16_t apply_to(const LiteralDoubleASTExpr &double_expr);
+    uint16_t apply_to(const BinOpASTExpr &bin_op_expr);
+    uint16_t apply_to(const CallASTExpr &call_expr);
+
+    BytecodeGen(const BytecodeProgram &program, const PrototypeAST &proto,
+            BytecodeFunction &function)
+        : program(program), proto(proto), function(function) {}
+};
+
+}
+
+uint16_t
+BytecodeGen::new_register()
+{
+    if (function.registers == MAX_INDEX)
+        throw VMError("'" + function.name + "' needs too many registers");
+
+    return function.registers++;
+}
+
+void
+BytecodeGen::emit(Opcode op, uint16_t a, uint16_t b, uint16_t c, size_t argc)
+{
+    function.code.push_back(Instruction { op, static_cast<uint8_t>(argc), a, b, c });
+}
+
+uint16_t
+BytecodeGen::arguments(size_t first)
+{
+    uint16_t base = function.registers;
+    for (size_t i = first; i < arg_stack.size(); i++)
+        emit(Opcode::MOVE, new_register(), arg_stack[i], 0);
+
+    arg_stack.resize(first);
+    return base;
+}
+
+uint16_t
+BytecodeGen::register_of(const ASTExpr *expr)
+{
+    if (expr->kind != ASTExpr::Kind::BINOP)
+        return visit(expr);
+
+    auto it = expr_registers.find(expr);
+    if (it != expr_registers.end()) return it->second;
+
+    uint16_t value = visit(expr);
+    expr_registers.emplace(expr, value);
+    return value;
+}
+
+uint16_t
+BytecodeGen::apply_to(const VariableASTExpr &var_expr)
+{
+    for (size_t i = 0; i < proto.args.size(); i++) {
+        if (proto.args[i] == var_expr.name)
+            return static_cast<uint16_t>(i);
+    }
+
+    throw VMError("unknown variable '" + std::string(symbol_name(var_expr.name)) + "'");
+}
+
+uint16_t
+BytecodeGen::constant(double value)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    auto it = constant_slots.find(bits);
+    uint16_t slot;
+    if (it != constant_slots.end()) {
+        slot = it->second;
+    } else {
+        if (function.constants.size() > MAX_INDEX)
+            throw VMError("'" + function.name + "' has too many constants");
+
+        slot = static_cast<uint16_t>(function.constants.size());
+        function.constants.push_back(value);
+        constant_slots.emplace(bits, slot);
+    }
+
+    uint16_t result = new_register();
+    emit(Opcode::LOAD_CONST, result, slot, 0);
+    return result;
+}
+
+uint16_t
+BytecodeGen::expand_power(uint16_t base, int n)
+{
+    unsigned bits = n < 0 ? -n : n;
+    if (bits == 0) return constant(1.0);
+
+    uint16_t power = 0;
+    bool have_power = false;
+    while (bits != 0) {
+        if (bits & 1) {
+            if (have_power) {
+                uint16_t product = new_register();
+                emit(Opcode::MUL, product, power, base);
+                power = product;
+            } else {
+                power = base;
+                have_power = true;
+            }
+        }
+        bits >>= 1;
+        if (bits != 0) {
+            uint16_t square = new_register();
+            emit(Opcode::MUL, square, base, base);
+            base = square;
+        }
+    }
+
+    if (n > 0) return power;
+
+    uint16_t one = constant(1.0);
+    uint16_t quotient = new_register();
+    emit(Opcode::DIV, quotient, one, power);
+    return quotient;
+}
+
+uint16_t
+BytecodeGen::apply_to(const LiteralDoubleASTExpr &double_expr)
+{
+    return constant(double_expr.value);
+}
+
+uint16_t
+BytecodeGen::apply_to(const BinOpASTExpr &bin_op_expr)
+{
+    uint16_t lhs = register_of(bin_op_expr.LHS);
+    uint16_t rhs = register_of(bin_op_expr.RHS);
+
+    Opcode op;
+    if (bin_op_expr.binop == sym::PLUS) {
+        op = Opcode::ADD;
+    } else if (bin_op_expr.binop == sym::MINUS) {
+        op = Opcode::SUB;
+    } else if (bin_op_expr.binop == sym::STAR) {
+        op = Opcode::MUL;
+    } else if (bin_op_expr.binop == sym::LESS) {
+        op = Opcode::LESS;
+    } else if (bin_op_expr.binop == sym::CARET) {
+        int n;
+        if (expanded_exponent(bin_op_expr.RHS, n))
+            return expand_power(lhs, n);
+        op = Opcode::POW;
+    } else {
+        /* a user operator is a function of two arguments */
+        auto it = program.function_index.find(bin_op_expr.binop);
+        if (it == program.function_index.end())
+            throw VMError("unsupported binary operator '"
+                    + std::string(symbol_name(bin_op_expr.binop)) + "'");
+
+        size_t first = arg_stack.size();
+        arg_stack.push_back(lhs);
+        arg_stack.push_back(rhs);
+        uint16_t args = arguments(first);
+        uint16_t result = new_register();
+        emit(Opcode::CALL, result, args, it->second, 2);
+        return result;
+    }
+
+    uint16_t result = new_register();
+    emit(op, result, lhs, rhs);
+    return result;
+}
+
+uint16_t
+BytecodeGen::apply_to(const CallASTExpr &call_expr)
+{
+    std::string callee(symbol_name(call_expr.callee));
+
+    Opcode op;
+    uint16_t index;
+    size_t arity;
+
+    auto function_it = program.function_index.find(call_expr.callee);
+    auto extern_it = program.extern_index.find(call_expr.callee);
+    if (function_it != program.function_index.end()) {
+        op = Opcode::CALL;
+        index = function_it->second;
+        arity = program.functions[index].arity;
+    } else if (extern_it != program.extern_index.end()) {
+        op = Opcode::CALL_EXTERN;
+        index = extern_it->second;
+        arity = program.externs[index].arity;
+
+        if (program.externs[index].address == nullptr)
+            throw VMError("unresolved extern '" + callee + "'");
+    } else {
+        throw VMError("call to unknown function '" + callee + "'");
+    }
+
+    if (arity != call_expr.args.size())
+        throw VMError("wrong number of arguments in call to '" + callee + "'");
+
+    size_t first = arg_stack.size();
+    for (auto const &a : call_expr.args)
+        arg_stack.push_back(register_of(a));
+
+    uint16_t base = arguments(first);
+    uint16_t result = new_register();
+    emit(op, result, base, index, arity);
+    return result;
+}
+
+uint16_t
+BytecodeProgram::declare_extern(Symbol name, size_t arity, void *address)
+{
+    std::string extern_name(symbol_name(name));
+    if (arity > MAX_EXTERN_ARITY)
+        throw VMError("extern '" + extern_name + "' has too many arguments");
+
+    if (address == nullptr)
+        address = dlsym(RTLD_DEFAULT, extern_name.c_str());
+
+    auto it = extern_index.find(name);
+    if (it != extern_index.end()) {
+        externs[it->second] = ExternFunction { extern_name, static_cast<uint16_t>(arity), address };
+        return it->second;
+    }
+
+    if (externs.size() > MAX_INDEX)
+        throw VMError("too many externs");
+
+    uint16_t index = static_cast<uint16_t>(externs.size());
+    externs.push_back(ExternFunction { extern_name, static_cast<uint16_t>(arity), address });
+    extern_index.emplace(name, index);
+    return index;
+}
+
+uint16_t
+BytecodeProgram::compile(const DefnASTNode &defn)
+{
+    const PrototypeAST &proto = *defn.prototype;
+    std::string name(symbol_name(proto.name));
+    bool anonymous = proto.name == sym::ANON;
+
+    if (proto.args.size() > std::numeric_limits<uint8_t>::max())
+        throw VMError("'" + name + "' has too many arguments");
+
+    /* the slot is registered before the body is compiled, so that the
+     * body can call the function itself */
+    uint16_t index;
+    bool redefined = false;
+    BytecodeFunction previous;
+
+    auto it = anonymous ? function_index.end() : function_index.find(proto.name);
+    if (it != function_index.end()) {
+        index = it->second;
+        /* callers were compiled against the old arity */
+        if (functions[index].arity != proto.args.size())
+            throw VMError("cannot change the number of arguments of '" + name + "'");
+
+        previous = std::move(functions[index]);
+        redefined = true;
+    } else {
+        if (functions.size() > MAX_INDEX)
+            throw VMError("too many functions");
+
+        index = static_cast<uint16_t>(functions.size());
+        functions.emplace_back();
+        if (!anonymous) function_index.emplace(proto.name, index);
+    }
+
+    BytecodeFunction &function = functions[index];
+    function.name = name;
+    function.arity = static_cast<uint16_t>(proto.args.size());
+    function.registers = function.arity;
+    function.code.clear();
+    function.constants.clear();
+
+    try {
+        BytecodeGen gen(*this, proto, function);
+        uint16_t value = gen.register_of(defn.body);
+        function.code.push_back(Instruction { Opcode::RET, 0, value, 0, 0 });
+    } catch (...) {
+        if (redefined) {
+            function = std::move(previous);
+        } else {
+            functions.pop_back();
+            if (!anonymous) function_index.erase(proto.name);
+        }
+        throw;
+    }
+
+    return index;
+}
+
+uint16_t
+BytecodeCompiler::apply_to(const ExternASTNode &extern_node)
+{
+    const PrototypeAST &proto = *extern_node.prototype;
+    return program.declare_extern(proto.name, proto.args.size());
+}
+
+uint16_t
+BytecodeCompiler::apply_to(const DefnASTNode &defn_node)
+{
+    return program.compile(defn_node);
+}
@@ -1,148 +1,928 @@
 #include "codegen.h"
+#include "optimizer.h"
+
+#include <cassert>
+#include <mutex>
+
+#include "llvm/BinaryFormat/Dwarf.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TargetSelect.h"
+
+void
+initialize_native_target(void)
+{
+    static std::once_flag native_target_initialized;
+    std::call_once(native_target_initialized, []() {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+    });
+}
+
+static void
+configure_target(llvm::Module &module, Optimizer* optimizer)
+{
+    if (optimizer == nullptr) return;
+
+    auto &tm = optimizer->get_target_machine();
+    module.setTargetTriple(tm.getTargetTriple().str());
+    module.setDataLayout(tm.createDataLayout());
+}
+
+/* start the module's compile unit, see UnitGeneratorContext::debug_info */
+static void
+configure_debug_info(UnitGeneratorContext &context)
+{
+    if (!context.debug_info || context.di_builder) return;
+
+    llvm::Module &module = *context.llvm_module;
+    module.addModuleFlag(llvm::Module::Warning, "Debug Info Version",
+            llvm::DEBUG_METADATA_VERSION);
+    module.addModuleFlag(llvm::Module::Warning, "Dwarf Version", 4);
+
+    context.di_builder = std::make_unique<llvm::DIBuilder>(module);
+    llvm::DIFile *file = context.di_builder->createFile(
+            llvm::sys::path::filename(context.source_name),
+            llvm::sys::path::parent_path(context.source_name));
+    bool optimized = context.optimizer != nullptr && context.optimizer->get_level() > 0;
+    context.di_unit = context.di_builder->createCompileUnit(llvm::dwarf::DW_LANG_C, file,
+            "guppy", optimized, "", 0);
+}
+
+void
+UnitGeneratorContext::reset_module()
+{
+    named_values.clear();
+    functions.clear();
+    builder.reset();
+    di_builder.reset();
+    di_unit = nullptr;
+    llvm_module.reset();
+
+    llvm_context = std::make_unique<llvm::LLVMContext>();
+    llvm_module = std::make_unique<llvm::Module>("__UNIT__", *llvm_context);
+    builder = std::make_unique<llvm::IRBuilder<>>(*llvm_context);
+    builder->setFastMathFlags(fp_flags);
+
+    configure_target(*llvm_module, optimizer);
+    configure_debug_info(*this);
+}
+
+void
+UnitGeneratorContext::set_fp_flags(llvm::FastMathFlags flags)
+{
+    fp_flags = flags;
+    builder->setFastMathFlags(fp_flags);
+}
+
+void
+UnitGeneratorContext::set_debug_info(const std::string &name)
+{
+    debug_info = true;
+    source_name = name;
+    configure_debug_info(*this);
+}
+
+void
+UnitGeneratorContext::begin_debug_info(llvm::Function *function, const PrototypeAST &proto)
+{
+    if (!di_builder) return;
+
+    /* guppy functions take and return doubles; batch entry points are
+     * described without a type */
+    llvm::SmallVector<llvm::Metadata*, 8> types;
+    if (function->getReturnType()->isDoubleTy()) {
+        llvm::DIType *double_type = di_builder->createBasicType("double", 64,
+                llvm::dwarf::DW_ATE_float);
+        types.assign(function->arg_size() + 1, double_type);
+    }
+
+    unsigned line = proto.location.linum;
+    llvm::DISubprogram *subprogram = di_builder->createFunction(di_unit, function->getName(),
+            function->getName(), di_unit->getFile(), line,
+            di_builder->createSubroutineType(di_builder->getOrCreateTypeArray(types)), line,
+            llvm::DINode::FlagPrototyped, llvm::DISubprogram::SPFlagDefinition);
+    function->setSubprogram(subprogram);
+    di_builder->finalizeSubprogram(subprogram);
+
+    builder->SetCurrentDebugLocation(llvm::DILocation::get(*llvm_context, line,
+                proto.location.colnum, subprogram));
+}
+
+void
+UnitGeneratorContext::set_debug_location(SourceLocation location)
+{
+    if (!di_builder || location.linum == 0) return;
+
+    llvm::DISubprogram *subprogram = builder->GetInsertBlock()->getParent()->getSubprogram();
+    if (subprogram == nullptr) return;
+
+    builder->SetCurrentDebugLocation(llvm::DILocation::get(*llvm_context, location.linum,
+                location.colnum, subprogram));
+}
+
+static const struct {
+    const char *name;
+    void (llvm::FastMathFlags::*set)(bool);
+    bool (llvm::FastMathFlags::*test)() const;
+} FP_FLAGS[] = {
+    { "contract", &llvm::FastMathFlags::setAllowContract, &llvm::FastMathFlags::allowContract },
+    { "reassoc", &llvm::FastMathFlags::setAllowReassoc, &llvm::FastMathFlags::allowReassoc },
+    { "nnan", &llvm::FastMathFlags::setNoNaNs, &llvm::FastMathFlags::noNaNs },
+    { "ninf", &llvm::FastMathFlags::setNoInfs, &llvm::FastMathFlags::noInfs },
+    { "nsz", &llvm::FastMathFlags::setNoSignedZeros, &llvm::FastMathFlags::noSignedZeros },
+    { "arcp", &llvm::FastMathFlags::setAllowReciprocal, &llvm::FastMathFlags::allowReciprocal },
+    { "afn", &llvm::FastMathFlags::setApproxFunc, &llvm::FastMathFlags::approxFunc },
+};
+
+llvm::FastMathFlags
+parse_fp_mode(const std::string &mode)
+{
+    llvm::FastMathFlags flags;
+    if (mode == "strict") return flags;
+
+    if (mode == "fast") {
+        flags.setFast();
+        return flags;
+    }
+
+    size_t start = 0;
+    while (start <= mode.size()) {
+        size_t end = mode.find(',', start);
+        if (end == std::string::npos) end = mode.size();
+        std::string flag = mode.substr(start, end - start);
+
+        bool known = false;
+        for (auto const &f : FP_FLAGS) {
+            if (flag == f.name) {
+                (flags.*f.set)(true);
+                known = true;
+            }
+        }
+        if (!known)
+            throw CodegenError("unknown floating point mode '" + flag + "'");
+
+        start = end + 1;
+    }
+
+    return flags;
+}
+
+std::string
+fp_mode_name(llvm::FastMathFlags flags)
+{
+    if (flags.isFast()) return "fast";
+
+    std::string name;
+    for (auto const &f : FP_FLAGS) {
+        if (!(flags.*f.test)()) continue;
+        if (!name.empty()) name += ",";
+        name += f.name;
+    }
+
+    return name.empty() ? "strict" : name;
+}
+
+void
+UnitGeneratorContext::set_optimizer(Optimizer* new_optimizer)
+{
+    optimizer = new_optimizer;
+    configure_target(*llvm_module, optimizer);
+}
 
 llvm::Function*
-FunctionGen::process_prototype(const PrototypeAST &proto)
+UnitGeneratorContext::get_function(Symbol name)
 {
-    assert(result == nullptr);
+    auto fit = functions.find(name);
+    if (fit != functions.end()) return fit->second;
 
-    std::vector<llvm::Type*> type_vector(proto.args.size(),
-            llvm::Type::getDoubleTy(llvm::getGlobalContext()));
+    auto it = prototypes.find(name);
+    if (it == prototypes.end()) return nullptr;
+
+    std::vector<llvm::Type*> type_vector(it->second,
+            llvm::Type::getDoubleTy(*llvm_context));
 
     llvm::FunctionType *func_type = llvm::FunctionType::get(
-            llvm::Type::getDoubleTy(llvm::getGlobalContext()), type_vector, false);
+            llvm::Type::getDoubleTy(*llvm_context), type_vector, false);
+
+    llvm::Function* function = llvm::Function::Create(func_type,
+            llvm::Function::ExternalLinkage, symbol_name(name), llvm_module.get());
+    functions[name] = function;
+
+    return function;
+}
+
+llvm::Function*
+UnitGeneratorContext::get_operator(Symbol op)
+{
+    auto fit = functions.find(op);
+    if (fit != functions.end()) return fit->second;
+
+    auto it = operators.find(op);
+    if (it == operators.end()) return nullptr;
+
+    /* this is reached while generating the body of another function, so
+     * its insertion point and arguments have to survive */
+    auto saved_insert_point = builder->saveIP();
+    llvm::DebugLoc saved_location = builder->getCurrentDebugLocation();
+    auto saved_values = std::move(named_values);
+    auto saved_expr_values = std::move(expr_values);
+
+    llvm::Function* function = nullptr;
+    try {
+        function = FunctionGen(this).generate_definition(*it->second);
+    } catch (...) {
+        builder->restoreIP(saved_insert_point);
+        builder->SetCurrentDebugLocation(saved_location);
+        named_values = std::move(saved_values);
+        expr_values = std::move(saved_expr_values);
+        throw;
+    }
+
+    builder->restoreIP(saved_insert_point);
+    builder->SetCurrentDebugLocation(saved_location);
+    named_values = std::move(saved_values);
+    expr_values = std::move(saved_expr_values);
+
+    return function;
+}
+
+namespace {
+
+/* finds a call or operator use that is not (yet) known to be pure */
+class PurityCheck : public ExprVisitor<PurityCheck> {
+    const UnitGeneratorContext &context;
+    Symbol self;
 
-    llvm::Function* func = llvm::Function::Create(func_type,
-            llvm::Function::ExternalLinkage, proto.name, context->llvm_module.get());
+    /* the AST optimizer shares subtrees, visit each only once */
+    std::unordered_set<const ASTExpr*> visited;
+
+public:
+    bool pure;
+
+    void apply_to(const VariableASTExpr&) {}
+    void apply_to(const LiteralDoubleASTExpr&) {}
+
+    void apply_to(const BinOpASTExpr &bin_op_expr) {
+        if (!pure || !visited.insert(&bin_op_expr).second) return;
+
+        if (context.operators.count(bin_op_expr.binop)
+                && !context.pure_functions.count(bin_op_expr.binop)) {
+            pure = false;
+            return;
+        }
+
+        visit(bin_op_expr.LHS);
+        visit(bin_op_expr.RHS);
+    }
+
+    void apply_to(const CallASTExpr &call_expr) {
+        if (!pure) return;
+
+        if (call_expr.callee != self && !context.pure_functions.count(call_expr.callee)
+                && !context.math_intrinsics.count(call_expr.callee)) {
+            pure = false;
+            return;
+        }
+
+        for (auto const &a : call_expr.args) visit(a);
+    }
+
+    PurityCheck(const UnitGeneratorContext &context, Symbol self)
+        : context(context), self(self), pure(true) {}
+};
+
+}
+
+bool
+UnitGeneratorContext::record_purity(const DefnASTNode &defn)
+{
+    Symbol name = defn.prototype->name;
+    if (name == sym::ANON) return false;
+
+    /* always this body, which may redefine a pure function as impure */
+    PurityCheck check(*this, name);
+    check.visit(defn.body);
+    if (check.pure) {
+        pure_functions.insert(name);
+    } else {
+        pure_functions.erase(name);
+    }
+
+    return check.pure;
+}
+
+bool
+UnitGeneratorContext::is_memoized(const PrototypeAST &proto) const
+{
+    return memoize && !proto.is_operator() && !proto.args.empty()
+        && pure_functions.count(proto.name);
+}
+
+static llvm::GlobalVariable*
+create_zeroed_global(llvm::Module &module, llvm::Type *type,
+        llvm::GlobalValue::LinkageTypes linkage, const std::string &name)
+{
+    auto *global = llvm::cast<llvm::GlobalVariable>(module.getOrInsertGlobal(name, type));
+    global->setLinkage(linkage);
+    global->setInitializer(llvm::Constant::getNullValue(type));
+    return global;
+}
+
+bool
+is_builtin_operator(Symbol op)
+{
+    return op == sym::PLUS || op == sym::MINUS || op == sym::STAR || op == sym::LESS
+        || op == sym::CARET;
+}
+
+llvm::Function*
+FunctionGen::process_prototype(const PrototypeAST &proto)
+{
+    std::vector<llvm::Type*> type_vector(proto.args.size(),
+            llvm::Type::getDoubleTy(*context->llvm_context));
+
+    llvm::FunctionType *func_type = llvm::FunctionType::get(
+            llvm::Type::getDoubleTy(*context->llvm_context), type_vector, false);
+
+    llvm::Function* func;
+    if (proto.is_operator()) {
+        /* every module gets its own private copy, see get_operator */
+        func = llvm::Function::Create(func_type, llvm::Function::InternalLinkage,
+                "binary" + std::string(symbol_name(proto.name)), context->llvm_module.get());
+        func->addFnAttr(llvm::Attribute::AlwaysInline);
+    } else {
+        func = llvm::Function::Create(func_type, llvm::Function::ExternalLinkage,
+                symbol_name(proto.name), context->llvm_module.get());
+    }
 
     unsigned int i = 0;
     for (auto &f_arg : func->args())
     {
-        f_arg.setName(proto.args[i++]);
+        f_arg.setName(symbol_name(proto.args[i++]));
     }
 
+    context->functions[proto.name] = func;
+    if (!proto.is_operator())
+        context->prototypes[proto.name] = proto.args.size();
+
     return func;
 }
 
-void
+/* the intrinsic for the libm function of this name and arity, if any */
+static llvm::Intrinsic::ID
+math_intrinsic(std::string_view name, size_t arity)
+{
+    static const struct {
+        const char *name;
+        size_t arity;
+        llvm::Intrinsic::ID id;
+    } intrinsics[] = {
+        { "sqrt", 1, llvm::Intrinsic::sqrt },
+        { "sin", 1, llvm::Intrinsic::sin },
+        { "cos", 1, llvm::Intrinsic::cos },
+        { "exp", 1, llvm::Intrinsic::exp },
+        { "exp2", 1, llvm::Intrinsic::exp2 },
+        { "log", 1, llvm::Intrinsic::log },
+        { "log2", 1, llvm::Intrinsic::log2 },
+        { "log10", 1, llvm::Intrinsic::log10 },
+        { "fabs", 1, llvm::Intrinsic::fabs },
+        { "floor", 1, llvm::Intrinsic::floor },
+        { "ceil", 1, llvm::Intrinsic::ceil },
+        { "trunc", 1, llvm::Intrinsic::trunc },
+        { "round", 1, llvm::Intrinsic::round },
+        { "rint", 1, llvm::Intrinsic::rint },
+        { "nearbyint", 1, llvm::Intrinsic::nearbyint },
+        { "pow", 2, llvm::Intrinsic::pow },
+        { "fmin", 2, llvm::Intrinsic::minnum },
+        { "fmax", 2, llvm::Intrinsic::maxnum },
+        { "copysign", 2, llvm::Intrinsic::copysign },
+        { "fma", 3, llvm::Intrinsic::fma },
+    };
+
+    for (auto const &intrinsic : intrinsics) {
+        if (name == intrinsic.name && arity == intrinsic.arity) return intrinsic.id;
+    }
+
+    return llvm::Intrinsic::not_intrinsic;
+}
+
+llvm::Function*
 FunctionGen::apply_to(const ExternASTNode &extern_expr)
 {
-    assert(result == nullptr);
+    CompileStats::Scope codegen_scope(context->stats, CompileStats::Phase::CODEGEN);
+    const PrototypeAST &proto = *extern_expr.prototype;
+
+    llvm::Intrinsic::ID id = math_intrinsic(symbol_name(proto.name), proto.args.size());
+    if (id != llvm::Intrinsic::not_intrinsic) {
+        context->math_intrinsics[proto.name] = id;
+    } else {
+        context->math_intrinsics.erase(proto.name);
+    }
+    context->externs.insert(proto.name);
 
-    result = process_prototype(*extern_expr.prototype);
+    return process_prototype(proto);
 }
 
-void
+llvm::Function*
 FunctionGen::apply_to(const DefnASTNode &defn_expr)
 {
-    assert(result == nullptr);
+    CompileStats::Scope codegen_scope(context->stats, CompileStats::Phase::CODEGEN);
+    const PrototypeAST &proto = *defn_expr.prototype;
+    if (proto.is_operator() && is_builtin_operator(proto.name))
+        throw CodegenError("cannot redefine built-in operator '"
+                + std::string(symbol_name(proto.name)) + "'");
+
+    context->record_purity(defn_expr);
+    llvm::Function *function = generate_definition(defn_expr);
 
-    llvm::Function* function = context->llvm_module->getFunction(defn_expr.prototype->name);
+    /* later modules emit their own copy of the operator on first use */
+    if (proto.is_operator())
+        context->operators[proto.name] = static_cast<const DefnASTNode*>(
+                copy_node(&defn_expr, context->operator_arena));
+
+    return function;
+}
+
+llvm::Function*
+FunctionGen::generate_definition(const DefnASTNode &defn_expr)
+{
+    const PrototypeAST &proto = *defn_expr.prototype;
+    std::string name(symbol_name(proto.name));
+    context->math_intrinsics.erase(proto.name);
+    context->externs.erase(proto.name);
+
+    /* operators are only ever defined, as a private copy per module */
+    llvm::Function* function;
+    if (proto.is_operator()) {
+        auto it = context->functions.find(proto.name);
+        function = it != context->functions.end() ? it->second : nullptr;
+    } else {
+        function = context->get_function(proto.name);
+    }
+
+    /* redefined within this module: the new body goes into a function
+     * of its own, which takes over the old one's name and callers once
+     * it is complete */
+    llvm::Function* replaced = nullptr;
+    std::string replaced_name;
+    if (function != nullptr && !function->empty()) {
+        if (function->arg_size() != proto.args.size() && !function->use_empty())
+            throw CodegenError("cannot change the number of arguments of '" + name
+                    + "', it is called by earlier definitions");
+        replaced = function;
+        replaced_name = replaced->getName().str();
+        replaced->setName(replaced_name + ".replaced");
+        function = nullptr;
+    }
+    bool declared_here = function == nullptr && replaced == nullptr;
 
     if (function == nullptr) {
-        function = process_prototype(*defn_expr.prototype);
+        function = process_prototype(proto);
     }
 
     if (function == nullptr) {
-        throw 0;
+        throw CodegenError("failed to create function '" + name + "'");
     }
 
+    try {
+        if (context->is_memoized(proto)) {
+            generate_memoized_body(function, defn_expr);
+        } else {
+            generate_body(function, defn_expr);
+        }
+    } catch (const CodegenError&) {
+        /* don't let later code call a function that was never defined */
+        if (declared_here)
+            context->prototypes.erase(proto.name);
+        context->functions.erase(proto.name);
+
+        if (replaced != nullptr) {
+            /* left as a declaration if it failed verification */
+            llvm::Function *failed = context->llvm_module->getFunction(replaced_name);
+            if (failed != nullptr && failed->use_empty()) failed->eraseFromParent();
+
+            replaced->setName(replaced_name);
+            context->functions[proto.name] = replaced;
+            context->prototypes[proto.name] = replaced->arg_size();
+        }
+        throw;
+    }
 
-    llvm::BasicBlock *bb = llvm::BasicBlock::Create(llvm::getGlobalContext(), "entry", function);
-    context->builder.SetInsertPoint(bb);
+    if (replaced != nullptr) {
+        if (!replaced->use_empty()) replaced->replaceAllUsesWith(function);
+        replaced->eraseFromParent();
+    }
+
+    if (context->count_calls && !proto.is_operator() && proto.name != sym::ANON) {
+        llvm::Type *i64 = context->builder->getInt64Ty();
+        llvm::GlobalVariable *counter = create_zeroed_global(*context->llvm_module, i64,
+                llvm::GlobalValue::ExternalLinkage, name + ".calls");
+
+        llvm::IRBuilder<> counter_builder(&*function->getEntryBlock().getFirstInsertionPt());
+        llvm::LoadInst *calls = counter_builder.CreateAlignedLoad(i64, counter, llvm::Align(8));
+        calls->setAtomic(llvm::AtomicOrdering::Monotonic);
+        llvm::StoreInst *store = counter_builder.CreateAlignedStore(
+                counter_builder.CreateAdd(calls, counter_builder.getInt64(1)), counter, llvm::Align(8));
+        store->setAtomic(llvm::AtomicOrdering::Monotonic);
+    }
+
+    return function;
+}
+
+void
+FunctionGen::generate_body(llvm::Function *function, const DefnASTNode &defn_expr)
+{
+    llvm::BasicBlock *bb = llvm::BasicBlock::Create(*context->llvm_context, "entry", function);
+    context->builder->SetInsertPoint(bb);
+    context->begin_debug_info(function, *defn_expr.prototype);
 
     context->named_values.clear();
+    context->expr_values.clear();
+    unsigned int i = 0;
     for (auto &farg : function->args())
     {
-        context->named_values[farg.getName()] = &farg;
+        context->named_values[defn_expr.prototype->args[i++]] = &farg;
     }
 
-    ValueGen body_gen(context);
-    defn_expr.body->inject(body_gen);
+    llvm::Value* func_return_value = nullptr;
 
-    llvm::Value* func_return_value = body_gen.extract();
-    if (func_return_value != nullptr)
-    {
-        context->builder.CreateRet(func_return_value);
-        llvm::verifyFunction(*function);
-        result = function;
-    } else {
+    try {
+        func_return_value = ValueGen(context).visit(defn_expr.body);
+    } catch (const CodegenError&) {
         function->eraseFromParent();
-        throw -1;
+        throw;
+    }
+
+    if (func_return_value == nullptr) {
+        function->eraseFromParent();
+        throw CodegenError("failed to generate body of function '"
+                + std::string(symbol_name(defn_expr.prototype->name)) + "'");
     }
-}
 
+    context->builder->CreateRet(func_return_value);
+    finish_function(*function);
+}
 
 void
-ValueGen::apply_to(const VariableASTExpr &var_expr)
+FunctionGen::finish_function(llvm::Function &function)
 {
-    assert(result == nullptr);
+    CompileStats *stats = context->stats;
+    if (stats != nullptr) {
+        stats->functions++;
+        stats->instructions += function.getInstructionCount();
+    }
 
-    auto it = context->named_values.find(var_expr.name);
+    {
+        CompileStats::Scope verify_scope(stats, CompileStats::Phase::VERIFY);
+        std::string problems;
+        llvm::raw_string_ostream out(problems);
+        if (llvm::verifyFunction(function, &out)) {
+            /* a declaration is still valid for its callers */
+            std::string name = function.getName().str();
+            function.deleteBody();
+            throw CodegenError("invalid code generated for '" + name + "': " + out.str());
+        }
+    }
 
-    if (it != context->named_values.end()) {
-        result = it->second;
-    } else {
-        throw 0;
+    if (context->optimizer != nullptr) {
+        CompileStats::Scope optimize_scope(stats, CompileStats::Phase::OPTIMIZE);
+        context->optimizer->run_on_function(function);
     }
 }
 
+/* linear probes before a memo lookup gives up and the insertion evicts */
+static const unsigned MEMO_PROBES = 8;
+
 void
-ValueGen::apply_to(const LiteralDoubleASTExpr &double_expr)
+FunctionGen::generate_memoized_body(llvm::Function *function, const DefnASTNode &defn_expr)
 {
-    assert(result == nullptr);
+    const PrototypeAST &proto = *defn_expr.prototype;
+    llvm::LLVMContext &llvm_context = *context->llvm_context;
+    llvm::Module &module = *context->llvm_module;
+    llvm::IRBuilder<> &builder = *context->builder;
+    std::string name(symbol_name(proto.name));
+    size_t arity = proto.args.size();
+
+    assert((context->memo_table_size & (context->memo_table_size - 1)) == 0);
+
+    /* the definition itself, inlined into the miss path below; calls to
+     * the function from within it go through the table */
+    llvm::Function* compute = llvm::Function::Create(function->getFunctionType(),
+            llvm::Function::InternalLinkage, name + ".compute", &module);
+    compute->addFnAttr(llvm::Attribute::AlwaysInline);
+    try {
+        generate_body(compute, defn_expr);
+    } catch (const CodegenError&) {
+        function->eraseFromParent();
+        throw;
+    }
+    context->begin_debug_info(function, proto);
+
+    llvm::Type *i64 = builder.getInt64Ty();
+    llvm::Type *double_type = builder.getDoubleTy();
+
+    /* entry: { i64 tag (zero when empty), [arity x i64] key, double value } */
+    llvm::StructType *entry_type = llvm::StructType::get(llvm_context,
+            { i64, llvm::ArrayType::get(i64, arity), double_type });
+    auto memo_global = [&](llvm::Type *type, const std::string &global_name) {
+        if (context->share_memo_tables)
+            return llvm::cast<llvm::GlobalVariable>(module.getOrInsertGlobal(global_name, type));
+        return create_zeroed_global(module, type, llvm::GlobalValue::ExternalLinkage, global_name);
+    };
+    llvm::ArrayType *table_type = llvm::ArrayType::get(entry_type, context->memo_table_size);
+    llvm::GlobalVariable *table = memo_global(table_type, name + ".memo");
+
+    llvm::StructType *stats_type = llvm::StructType::get(llvm_context, { i64, i64 });
+    llvm::GlobalVariable *stats = memo_global(stats_type, name + ".memo_stats");
+
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(llvm_context, "entry", function);
+    llvm::BasicBlock *probe = llvm::BasicBlock::Create(llvm_context, "probe", function);
+    llvm::BasicBlock *compare = llvm::BasicBlock::Create(llvm_context, "compare", function);
+    llvm::BasicBlock *hit = llvm::BasicBlock::Create(llvm_context, "hit", function);
+    llvm::BasicBlock *next = llvm::BasicBlock::Create(llvm_context, "next", function);
+    llvm::BasicBlock *miss = llvm::BasicBlock::Create(llvm_context, "miss", function);
+
+    auto count = [&](unsigned field) {
+        llvm::Value *counter = builder.CreateStructGEP(stats_type, stats, field);
+        builder.CreateStore(builder.CreateAdd(builder.CreateLoad(i64, counter),
+                    builder.getInt64(1)), counter);
+    };
+
+    /* hash the argument bits, as SymbolTable::hash mixes words */
+    builder.SetInsertPoint(entry);
+    std::vector<llvm::Value*> args, key;
+    llvm::Value *hash = builder.getInt64(0x9E3779B97F4A7C15ull);
+    for (auto &arg : function->args()) {
+        args.push_back(&arg);
+        key.push_back(builder.CreateBitCast(&arg, i64));
+        hash = builder.CreateMul(builder.CreateXor(hash, key.back()),
+                builder.getInt64(0xBF58476D1CE4E5B9ull));
+        hash = builder.CreateXor(hash, builder.CreateLShr(hash, 31));
+    }
+    /* multiplying only carries bits upwards, and what tells small
+     * integers apart (the exponent and leading mantissa bits) is at the
+     * top of a double: fold it back down, or they all share a home slot */
+    hash = builder.CreateMul(hash, builder.getInt64(0x94D049BB133111EBull));
+    hash = builder.CreateXor(hash, builder.CreateLShr(hash, 32));
+    llvm::Value *tag = builder.CreateOr(hash, 1, "tag");
+    llvm::Value *mask = builder.getInt64(context->memo_table_size - 1);
+    llvm::Value *home = builder.CreateAnd(hash, mask, "home");
+    llvm::Value *home_ptr = builder.CreateInBoundsGEP(table_type, table,
+            { builder.getInt64(0), home });
+    builder.CreateBr(probe);
+
+    builder.SetInsertPoint(probe);
+    llvm::PHINode *probe_index = builder.CreatePHI(i64, 2, "i");
+    probe_index->addIncoming(builder.getInt64(0), entry);
+    llvm::Value *slot = builder.CreateAnd(builder.CreateAdd(home, probe_index), mask, "slot");
+    llvm::Value *slot_ptr = builder.CreateInBoundsGEP(table_type, table,
+            { builder.getInt64(0), slot });
+    llvm::Value *slot_tag = builder.CreateLoad(i64, builder.CreateStructGEP(entry_type, slot_ptr, 0));
+    builder.CreateCondBr(builder.CreateICmpEQ(slot_tag, builder.getInt64(0)), miss, compare);
+
+    builder.SetInsertPoint(compare);
+    llvm::Value *match = builder.CreateICmpEQ(slot_tag, tag);
+    for (size_t k = 0; k < arity; k++) {
+        llvm::Value *key_ptr = builder.CreateInBoundsGEP(entry_type, slot_ptr,
+                { builder.getInt64(0), builder.getInt32(1), builder.getInt64(k) });
+        match = builder.CreateAnd(match,
+                builder.CreateICmpEQ(builder.CreateLoad(i64, key_ptr), key[k]));
+    }
+    builder.CreateCondBr(match, hit, next);
+
+    builder.SetInsertPoint(hit);
+    count(0);
+    builder.CreateRet(builder.CreateLoad(double_type,
+                builder.CreateStructGEP(entry_type, slot_ptr, 2), "memo"));
+
+    builder.SetInsertPoint(next);
+    llvm::Value *next_index = builder.CreateAdd(probe_index, builder.getInt64(1));
+    probe_index->addIncoming(next_index, next);
+    builder.CreateCondBr(builder.CreateICmpEQ(next_index, builder.getInt64(MEMO_PROBES)),
+            miss, probe);
+
+    /* an empty slot, or (when every probed slot is taken) the home slot */
+    builder.SetInsertPoint(miss);
+    llvm::PHINode *victim = builder.CreatePHI(slot_ptr->getType(), 2, "victim");
+    victim->addIncoming(slot_ptr, probe);
+    victim->addIncoming(home_ptr, next);
+    count(1);
+    llvm::Value *value = builder.CreateCall(compute, args, "value");
+    for (size_t k = 0; k < arity; k++) {
+        builder.CreateStore(key[k], builder.CreateInBoundsGEP(entry_type, victim,
+                    { builder.getInt64(0), builder.getInt32(1), builder.getInt64(k) }));
+    }
+    builder.CreateStore(value, builder.CreateStructGEP(entry_type, victim, 2));
+    builder.CreateStore(tag, builder.CreateStructGEP(entry_type, victim, 0));
+    builder.CreateRet(value);
 
-    result = llvm::ConstantFP::get(llvm::getGlobalContext(), llvm::APFloat(double_expr.value));
+    finish_function(*function);
 }
 
-void
+llvm::Function*
+FunctionGen::generate_batch(const DefnASTNode &defn_expr)
+{
+    CompileStats::Scope codegen_scope(context->stats, CompileStats::Phase::CODEGEN);
+    const PrototypeAST &proto = *defn_expr.prototype;
+    llvm::LLVMContext &llvm_context = *context->llvm_context;
+    llvm::IRBuilder<> &builder = *context->builder;
+    std::string name(symbol_name(proto.name));
+
+    llvm::Type *double_type = llvm::Type::getDoubleTy(llvm_context);
+    llvm::Type *double_ptr_type = double_type->getPointerTo();
+    llvm::Type *size_type = context->llvm_module->getDataLayout().getIntPtrType(llvm_context);
+
+    /* the loop calls a private copy of the definition, which is inlined
+     * into it, so that the vectorizer sees the body rather than a call */
+    std::vector<llvm::Type*> arg_types(proto.args.size(), double_type);
+    llvm::Function* scalar = llvm::Function::Create(
+            llvm::FunctionType::get(double_type, arg_types, false),
+            llvm::Function::InternalLinkage, name + ".scalar", context->llvm_module.get());
+    scalar->addFnAttr(llvm::Attribute::AlwaysInline);
+    generate_body(scalar, defn_expr);
+
+    /* void <name>_batch(const double* const* columns, double* out, size_t rows) */
+    llvm::FunctionType *batch_type = llvm::FunctionType::get(llvm::Type::getVoidTy(llvm_context),
+            { double_ptr_type->getPointerTo(), double_ptr_type, size_type }, false);
+    llvm::Function* batch = llvm::Function::Create(batch_type, llvm::Function::ExternalLinkage,
+            name + "_batch", context->llvm_module.get());
+
+    llvm::Argument *columns = batch->getArg(0);
+    llvm::Argument *out = batch->getArg(1);
+    llvm::Argument *rows = batch->getArg(2);
+    columns->setName("columns");
+    out->setName("out");
+    rows->setName("rows");
+    batch->addParamAttr(0, llvm::Attribute::ReadOnly);
+    batch->addParamAttr(1, llvm::Attribute::NoAlias);
+    context->begin_debug_info(batch, proto);
+
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(llvm_context, "entry", batch);
+    llvm::BasicBlock *loop = llvm::BasicBlock::Create(llvm_context, "loop", batch);
+    llvm::BasicBlock *exit = llvm::BasicBlock::Create(llvm_context, "exit", batch);
+
+    builder.SetInsertPoint(entry);
+    std::vector<llvm::Value*> column_ptrs;
+    for (size_t k = 0; k < proto.args.size(); k++) {
+        llvm::Value *slot = builder.CreateConstInBoundsGEP1_64(double_ptr_type, columns, k);
+        column_ptrs.push_back(builder.CreateLoad(double_ptr_type, slot,
+                    std::string(symbol_name(proto.args[k]))));
+    }
+    builder.CreateCondBr(builder.CreateICmpEQ(rows, llvm::ConstantInt::get(size_type, 0)),
+            exit, loop);
+
+    builder.SetInsertPoint(loop);
+    llvm::PHINode *row = builder.CreatePHI(size_type, 2, "row");
+    row->addIncoming(llvm::ConstantInt::get(size_type, 0), entry);
+
+    std::vector<llvm::Value*> arg_vals;
+    for (llvm::Value *column : column_ptrs) {
+        llvm::Value *element = builder.CreateInBoundsGEP(double_type, column, row);
+        arg_vals.push_back(builder.CreateLoad(double_type, element));
+    }
+    llvm::Value *value = builder.CreateCall(scalar, arg_vals, "value");
+    builder.CreateStore(value, builder.CreateInBoundsGEP(double_type, out, row));
+
+    llvm::Value *next_row = builder.CreateNUWAdd(row, llvm::ConstantInt::get(size_type, 1), "next");
+    row->addIncoming(next_row, loop);
+    builder.CreateCondBr(builder.CreateICmpEQ(next_row, rows), exit, loop);
+
+    builder.SetInsertPoint(exit);
+    builder.CreateRetVoid();
+
+    try {
+        finish_function(*batch);
+    } catch (const CodegenError&) {
+        /* neither is called from anywhere else in the module */
+        batch->eraseFromParent();
+        scalar->eraseFromParent();
+        throw;
+    }
+    return batch;
+}
+
+llvm::Value*
+ValueGen::value_of(const ASTExpr *expr)
+{
+    /* only operator nodes are merged by the AST optimizer and worth
+     * remembering, variables and literals cost nothing to regenerate and
+     * calls are never merged */
+    if (expr->kind != ASTExpr::Kind::BINOP)
+        return visit(expr);
+
+    auto it = context->expr_values.find(expr);
+    if (it != context->expr_values.end()) return it->second;
+
+    llvm::Value* value = visit(expr);
+    context->expr_values.emplace(expr, value);
+
+    return value;
+}
+
+llvm::Value*
+ValueGen::apply_to(const VariableASTExpr &var_expr)
+{
+    auto it = context->named_values.find(var_expr.name);
+
+    if (it == context->named_values.end())
+        throw CodegenError("unknown variable '" + std::string(symbol_name(var_expr.name)) + "'");
+
+    return it->second;
+}
+
+llvm::Value*
+ValueGen::apply_to(const LiteralDoubleASTExpr &double_expr)
+{
+    return llvm::ConstantFP::get(*context->llvm_context, llvm::APFloat(double_expr.value));
+}
+
+llvm::Value*
 ValueGen::apply_to(const BinOpASTExpr &binop_expr)
 {
-    assert(result == nullptr);
-
-    ValueGen lhs_valgen(context);
-    binop_expr.LHS->inject(lhs_valgen);
-    llvm::Value* lhs_val = lhs_valgen.extract();
-
-    ValueGen rhs_valgen(context);
-    binop_expr.RHS->inject(rhs_valgen);
-    llvm::Value* rhs_val = rhs_valgen.extract();
-
-    if (binop_expr.binop == "+") {
-        result = context->builder.CreateFAdd(lhs_val, rhs_val, "addtmp");
-    } else if (binop_expr.binop == "-") {
-        result = context->builder.CreateFSub(lhs_val, rhs_val, "subtmp");
-    } else if (binop_expr.binop == "*") {
-        result = context->builder.CreateFMul(lhs_val, rhs_val, "multmp");
-    } else if (binop_expr.binop == "<") {
-        lhs_val = context->builder.CreateFCmpULT(lhs_val, rhs_val, "cmptmp");
-        result = context->builder.CreateUIToFP(lhs_val,
-                llvm::Type::getDoubleTy(llvm::getGlobalContext()), "booltmp");
-    } else {
-        throw 0;
+    llvm::Value* lhs_val = value_of(binop_expr.LHS);
+    llvm::Value* rhs_val = value_of(binop_expr.RHS);
+    context->set_debug_location(binop_expr.location);
+
+    if (binop_expr.binop == sym::PLUS) {
+        return context->builder->CreateFAdd(lhs_val, rhs_val, "addtmp");
+    } else if (binop_expr.binop == sym::MINUS) {
+        return context->builder->CreateFSub(lhs_val, rhs_val, "subtmp");
+    } else if (binop_expr.binop == sym::STAR) {
+        return context->builder->CreateFMul(lhs_val, rhs_val, "multmp");
+    } else if (binop_expr.binop == sym::LESS) {
+        lhs_val = context->builder->CreateFCmpULT(lhs_val, rhs_val, "cmptmp");
+        return context->builder->CreateUIToFP(lhs_val,
+                llvm::Type::getDoubleTy(*context->llvm_context), "booltmp");
+    } else if (binop_expr.binop == sym::CARET) {
+        int n;
+        if (expanded_exponent(binop_expr.RHS, n))
+            return expand_power(lhs_val, n);
+
+        llvm::Function *pow = llvm::Intrinsic::getDeclaration(context->llvm_module.get(),
+                llvm::Intrinsic::pow, { lhs_val->getType() });
+        return context->builder->CreateCall(pow, { lhs_val, rhs_val }, "powtmp");
+    } else if (llvm::Function* op_func = context->get_operator(binop_expr.binop)) {
+        return context->builder->CreateCall(op_func, { lhs_val, rhs_val }, "binop");
     }
+
+    throw CodegenError("unsupported binary operator '"
+            + std::string(symbol_name(binop_expr.binop)) + "'");
 }
 
-void
+llvm::Value*
 ValueGen::apply_to(const CallASTExpr &call_expr)
 {
-    assert(result == nullptr);
-
-    llvm::Function* callee_func = context->llvm_module->getFunction(call_expr.callee);
+    llvm::Function* callee_func = context->get_function(call_expr.callee);
 
-    if (!callee_func) throw -1;
+    if (!callee_func)
+        throw CodegenError("call to unknown function '"
+                + std::string(symbol_name(call_expr.callee)) + "'");
 
-    if (callee_func->arg_size() != call_expr.args.size()) throw -1;
+    if (callee_func->arg_size() != call_expr.args.size())
+        throw CodegenError("wrong number of arguments in call to '"
+                + std::string(symbol_name(call_expr.callee)) + "'");
 
-    std::vector<llvm::Value*> arg_vals;
+    /* arguments live on the stack for all but very wide calls */
+    llvm::SmallVector<llvm::Value*, 8> arg_vals;
 
-    std::unique_ptr<ValueGen> vg;
     for (auto const &a : call_expr.args)
     {
-        vg.reset(new ValueGen(context));
-        a->inject(*vg);
-        arg_vals.push_back(vg->extract());
+        arg_vals.push_back(value_of(a));
+    }
+    context->set_debug_location(call_expr.location);
+
+    auto intrinsic = context->math_intrinsics.find(call_expr.callee);
+    if (intrinsic != context->math_intrinsics.end()) {
+        callee_func = llvm::Intrinsic::getDeclaration(context->llvm_module.get(),
+                intrinsic->second, { llvm::Type::getDoubleTy(*context->llvm_context) });
+    }
+
+    llvm::CallInst *call = context->builder->CreateCall(callee_func, arg_vals, "calltmp");
+    if (intrinsic == context->math_intrinsics.end() && !context->externs.count(call_expr.callee))
+        call->addFnAttr(llvm::Attribute::NoBuiltin);
+
+    return call;
+}
+
+llvm::Value*
+ValueGen::expand_power(llvm::Value *base, int n)
+{
+    llvm::IRBuilder<> &builder = *context->builder;
+    unsigned bits = n < 0 ? -n : n;
+
+    llvm::Value *power = nullptr;
+    while (bits != 0) {
+        if (bits & 1)
+            power = power ? builder.CreateFMul(power, base, "powtmp") : base;
+        bits >>= 1;
+        if (bits != 0)
+            base = builder.CreateFMul(base, base, "squaretmp");
     }
 
-    result = context->builder.CreateCall(callee_func, arg_vals, "calltmp");
+    llvm::Value *one = llvm::ConstantFP::get(base->getType(), 1.0);
+    if (power == nullptr) return one;
+    if (n < 0) return builder.CreateFDiv(one, power, "powtmp");
+
+    return power;
 }
 
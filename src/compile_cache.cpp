@@ -0,0 +1,295 @@
+#include "compile_cache.h"
+#include "optimizer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/SHA1.h"
+
+namespace fs = std::filesystem;
+
+/* bump whenever codegen changes in a way that alters the generated code
+ * for the same source, so that stale entries are never reused */
+static const char CACHE_FORMAT[] = "guppy-object-cache-3";
+
+namespace {
+
+/* Serializes a definition into a canonical text form for hashing.
+ * Argument names are replaced by their positions, and user operators are
+ * expanded to their own canonical definitions (once each). */
+class KeyWriter : public ExprVisitor<KeyWriter> {
+    const UnitGeneratorContext &context;
+    const PrototypeAST *proto;
+    std::unordered_set<uint32_t> expanded_operators;
+    std::string &out;
+
+    void write_prototype(const PrototypeAST &p) {
+        out += p.is_operator() ? "binary " : "defn ";
+        out += symbol_name(p.name);
+        out += "/" + std::to_string(p.args.size());
+        if (p.is_operator()) out += " prec " + std::to_string(p.precedence);
+        write_location(p.location);
+        out += "\n";
+    }
+
+    /* with debug info the object holds line numbers, which must match */
+    void write_location(SourceLocation location) {
+        if (!context.debug_info) return;
+        out += "@" + std::to_string(location.linum) + ":" + std::to_string(location.colnum) + " ";
+    }
+
+public:
+    void write_defn(const DefnASTNode &defn) {
+        const PrototypeAST *outer = proto;
+        proto = defn.prototype;
+
+        write_prototype(*proto);
+        visit(defn.body);
+        out += "\n";
+
+        proto = outer;
+    }
+
+    void apply_to(const VariableASTExpr &var_expr) {
+        for (size_t i = 0; i < proto->args.size(); i++) {
+            if (proto->args[i] == var_expr.name) {
+                out += "$" + std::to_string(i) + " ";
+                return;
+            }
+        }
+        /* an unknown variable fails codegen anyway */
+        out += "?" + std::string(symbol_name(var_expr.name)) + " ";
+    }
+
+    void apply_to(const LiteralDoubleASTExpr &double_expr) {
+        uint64_t bits;
+        std::memcpy(&bits, &double_expr.value, sizeof(bits));
+        out += "#" + llvm::utohexstr(bits) + " ";
+    }
+
+    void apply_to(const BinOpASTExpr &bin_op_expr) {
+        out += "(";
+        out += symbol_name(bin_op_expr.binop);
+        out += " ";
+        write_location(bin_op_expr.location);
+        visit(bin_op_expr.LHS);
+        visit(bin_op_expr.RHS);
+        out += ") ";
+
+        auto it = context.operators.find(bin_op_expr.binop);
+        if (it != context.operators.end()
+                && expanded_operators.insert(bin_op_expr.binop.id).second) {
+            pending_operators.push_back(it->second);
+        }
+    }
+
+    void apply_to(const CallASTExpr &call_expr) {
+        /* calls compile to a declaration of the callee, which is fully
+         * described by its name and arity, or to a math intrinsic. Only
+         * calls to externs may be taken for library calls. */
+        if (context.math_intrinsics.count(call_expr.callee)) {
+            out += "(intrinsic ";
+        } else if (context.externs.count(call_expr.callee)) {
+            out += "(extern ";
+        } else {
+            out += "(call ";
+        }
+        out += symbol_name(call_expr.callee);
+        out += "/" + std::to_string(call_expr.args.size()) + " ";
+        write_location(call_expr.location);
+        for (auto const &a : call_expr.args) visit(a);
+        out += ") ";
+    }
+
+    std::vector<const DefnASTNode*> pending_operators;
+
+    KeyWriter(const UnitGeneratorContext &context, std::string &out)
+        : context(context), proto(nullptr), out(out) {}
+};
+
+}
+
+std::string
+cache_key(const DefnASTNode &defn, const UnitGeneratorContext &context)
+{
+    llvm::TargetMachine &tm = context.optimizer->get_target_machine();
+
+    std::string text = CACHE_FORMAT;
+    text += "\nllvm " LLVM_VERSION_STRING "\n";
+    text += tm.getTargetTriple().str() + " " + tm.getTargetCPU().str() + " "
+        + tm.getTargetFeatureString().str() + "\n";
+    text += "-O" + std::to_string(context.optimizer->get_level()) + "\n";
+    if (context.is_memoized(*defn.prototype))
+        text += "memoize " + std::to_string(context.memo_table_size) + "\n";
+    text += "fp " + fp_mode_name(context.fp_flags) + "\n";
+    if (context.debug_info) text += "debug " + context.source_name + "\n";
+
+    KeyWriter writer(context, text);
+    writer.write_defn(defn);
+    while (!writer.pending_operators.empty()) {
+        const DefnASTNode *op = writer.pending_operators.back();
+        writer.pending_operators.pop_back();
+        writer.write_defn(*op);
+    }
+
+    llvm::SHA1 hasher;
+    hasher.update(text);
+    return llvm::toHex(hasher.final(), true);
+}
+
+std::string
+CompileCache::default_directory()
+{
+    if (const char *dir = std::getenv("GUPPY_CACHE_DIR"); dir != nullptr && *dir != '\0')
+        return dir;
+    if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg != nullptr && *xdg != '\0')
+        return std::string(xdg) + "/guppy";
+    if (const char *home = std::getenv("HOME"); home != nullptr && *home != '\0')
+        return std::string(home) + "/.cache/guppy";
+    return ".guppy-cache";
+}
+
+CompileCache::CompileCache(const std::string &directory, uint64_t max_bytes)
+    : directory(directory), max_bytes(max_bytes)
+{
+    std::error_code ec;
+    fs::create_directories(directory, ec);
+    if (ec || !fs::is_directory(directory))
+        throw std::runtime_error("cannot create cache directory '" + directory + "'"
+                + (ec ? ": " + ec.message() : std::string()));
+}
+
+std::string
+CompileCache::entry_path(const std::string &key) const
+{
+    return directory + "/" + key + ".o";
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+CompileCache::lookup(const std::string &key)
+{
+    std::string path = entry_path(key);
+
+    auto buffer = llvm::MemoryBuffer::getFile(path, false, false);
+    if (!buffer || (*buffer)->getBufferSize() == 0) {
+        stats.misses++;
+        return nullptr;
+    }
+
+    /* refresh the entry's position in the LRU order */
+    ::utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+
+    stats.hits++;
+    stats.bytes_read += (*buffer)->getBufferSize();
+    return std::move(*buffer);
+}
+
+void
+CompileCache::store(const std::string &key, const llvm::MemoryBuffer &object)
+{
+    std::string temp_path = directory + "/.tmp-" + key + "-XXXXXX";
+    int fd = ::mkstemp(&temp_path[0]);
+    if (fd < 0) return;
+
+    const char *data = object.getBufferStart();
+    size_t remaining = object.getBufferSize();
+    while (remaining > 0) {
+        ssize_t n = ::write(fd, data, remaining);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        data += n;
+        remaining -= n;
+    }
+
+    bool written = remaining == 0;
+    written = ::close(fd) == 0 && written;
+
+    /* rename is atomic, so concurrent readers see either no entry or a
+     * complete one, and concurrent writers of the same key (which write
+     * identical contents) simply replace each other */
+    if (!written || ::rename(temp_path.c_str(), entry_path(key).c_str()) != 0) {
+        ::unlink(temp_path.c_str());
+        return;
+    }
+
+    stats.stores++;
+    stats.bytes_written += object.getBufferSize();
+}
+
+void
+CompileCache::trim()
+{
+    /* one process evicts at a time, the others skip this round */
+    std::string lock_path = directory + "/.lock";
+    int lock_fd = ::open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock_fd < 0) return;
+    if (::flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        ::close(lock_fd);
+        return;
+    }
+
+    struct Entry {
+        fs::path path;
+        fs::file_time_type last_use;
+        uint64_t size;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+
+    std::error_code ec;
+    for (auto it = fs::directory_iterator(directory, ec); !ec && it != fs::directory_iterator();
+            it.increment(ec)) {
+        if (it->path().extension() != ".o") continue;
+
+        std::error_code entry_ec;
+        uint64_t size = it->file_size(entry_ec);
+        auto last_use = it->last_write_time(entry_ec);
+        if (entry_ec) continue;
+
+        entries.push_back(Entry { it->path(), last_use, size });
+        total += size;
+    }
+
+    if (total > max_bytes) {
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+            return a.last_use < b.last_use;
+        });
+
+        for (auto const &entry : entries) {
+            if (total <= max_bytes) break;
+            if (fs::remove(entry.path, ec)) stats.evictions++;
+            total -= entry.size;
+        }
+    }
+
+    ::flock(lock_fd, LOCK_UN);
+    ::close(lock_fd);
+}
+
+void
+CompileCache::report(std::ostream &out) const
+{
+    unsigned long lookups = stats.hits + stats.misses;
+    out << "compilation cache (" << directory << "):\n"
+        << "  " << stats.hits << " hits, " << stats.misses << " misses";
+    if (lookups > 0)
+        out << " (" << std::fixed << std::setprecision(1)
+            << 100.0 * stats.hits / lookups << "% hit rate)" << std::defaultfloat;
+    out << "\n  " << stats.stores << " stored, " << stats.evictions << " evicted, "
+        << stats.bytes_read << " bytes read, " << stats.bytes_written << " bytes written\n";
+}
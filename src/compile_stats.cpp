@@ -0,0 +1,259 @@
+#include "compile_stats.h"
+
+#include <iomanip>
+
+#include <sys/resource.h>
+#include <time.h>
+
+std::atomic<uint64_t> heap_allocations(0);
+
+static std::chrono::nanoseconds
+process_cpu_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+static long
+peak_rss_kib(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss; // kilobytes on linux
+}
+
+CompileStats::CompileStats()
+    : source_bytes(0), tokens(0), functions(0), instructions(0), optimized_instructions(0),
+    current(-1), wall_mark(std::chrono::steady_clock::now()), cpu_mark(process_cpu_time()),
+    allocations_mark(heap_allocations.load(std::memory_order_relaxed)),
+    start(wall_mark), cpu_start(cpu_mark), allocations_start(allocations_mark) {}
+
+int
+CompileStats::switch_to(int phase)
+{
+    auto wall = std::chrono::steady_clock::now();
+    auto cpu = process_cpu_time();
+    uint64_t allocations = heap_allocations.load(std::memory_order_relaxed);
+
+    if (current >= 0) {
+        PhaseStats &stats = phases[current];
+        stats.wall += wall - wall_mark;
+        stats.cpu += cpu - cpu_mark;
+        stats.allocations += allocations - allocations_mark;
+        stats.peak_rss_kib = peak_rss_kib();
+    }
+
+    int previous = current;
+    current = phase;
+    wall_mark = wall;
+    cpu_mark = cpu;
+    allocations_mark = allocations;
+
+    return previous;
+}
+
+CompileStats::Scope::Scope(CompileStats *stats, Phase phase) : stats(stats), outer(-1)
+{
+    if (stats == nullptr) return;
+
+    outer = stats->switch_to(static_cast<int>(phase));
+    stats->phases[static_cast<size_t>(phase)].entries++;
+}
+
+CompileStats::Scope::~Scope()
+{
+    if (stats != nullptr) stats->switch_to(outer);
+}
+
+namespace {
+
+class NodeCounter : public ExprVisitor<NodeCounter> {
+    CompileStats::NodeCounts &counts;
+
+public:
+    void apply_to(const VariableASTExpr&) { counts.variables++; }
+    void apply_to(const LiteralDoubleASTExpr&) { counts.literals++; }
+
+    void apply_to(const BinOpASTExpr &bin_op_expr) {
+        counts.binops++;
+        visit(bin_op_expr.LHS);
+        visit(bin_op_expr.RHS);
+    }
+
+    void apply_to(const CallASTExpr &call_expr) {
+        counts.calls++;
+        for (auto const &a : call_expr.args) visit(a);
+    }
+
+    explicit NodeCounter(CompileStats::NodeCounts &counts) : counts(counts) {}
+};
+
+}
+
+void
+CompileStats::count_nodes(const AST &ast)
+{
+    NodeCounter counter(nodes);
+
+    for (auto const &node : ast) {
+        if (node->kind == ASTNode::Kind::EXTERN) {
+            nodes.externs++;
+            continue;
+        }
+
+        auto defn = static_cast<const DefnASTNode*>(node);
+        if (defn->prototype->is_operator()) {
+            nodes.operators++;
+        } else if (defn->prototype->name == sym::ANON) {
+            nodes.top_level++;
+        } else {
+            nodes.definitions++;
+        }
+        counter.visit(defn->body);
+    }
+}
+
+void
+CompileStats::merge_counts(const CompileStats &other)
+{
+    functions += other.functions;
+    instructions += other.instructions;
+    optimized_instructions += other.optimized_instructions;
+}
+
+const char*
+CompileStats::phase_name(Phase phase)
+{
+    static const char *names[PHASES] = {
+        "read", "lex", "parse", "ast-opt", "codegen", "verify", "optimize", "emit", "run"
+    };
+    return names[static_cast<size_t>(phase)];
+}
+
+static double
+milliseconds(std::chrono::nanoseconds ns)
+{
+    return std::chrono::duration<double, std::milli>(ns).count();
+}
+
+static std::string
+json_string(const std::string &s)
+{
+    std::string quoted = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            static const char hex[] = "0123456789abcdef";
+            quoted += "\\u00";
+            quoted += hex[(c >> 4) & 0xf];
+            quoted += hex[c & 0xf];
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+void
+CompileStats::report(std::ostream &out) const
+{
+    /* everything since the stats were created, and what no phase
+     * accounts for (e.g. setting up the JIT) */
+    PhaseStats total, other;
+    total.wall = std::chrono::steady_clock::now() - start;
+    total.cpu = process_cpu_time() - cpu_start;
+    total.allocations = heap_allocations.load(std::memory_order_relaxed) - allocations_start;
+    total.peak_rss_kib = peak_rss_kib();
+
+    other = total;
+    for (auto const &phase : phases) {
+        other.wall -= phase.wall;
+        other.cpu -= phase.cpu;
+        other.allocations -= phase.allocations;
+    }
+
+    auto print_row = [&out](const char *name, const PhaseStats &stats, bool runs) {
+        out << "  " << std::left << std::setw(10) << name << std::right;
+        if (runs) {
+            out << std::setw(8) << stats.entries;
+        } else {
+            out << std::setw(8) << "";
+        }
+        out << std::fixed << std::setprecision(3)
+            << std::setw(12) << milliseconds(stats.wall)
+            << std::setw(12) << milliseconds(stats.cpu)
+            << std::setw(13) << stats.allocations;
+        if (stats.peak_rss_kib > 0)
+            out << std::setprecision(1) << std::setw(12) << stats.peak_rss_kib / 1024.0;
+        out << std::defaultfloat << '\n';
+    };
+
+    out << "compile statistics";
+    if (!source_name.empty()) out << " for " << source_name;
+    out << ":\n";
+    out << "  " << std::left << std::setw(10) << "phase" << std::right << std::setw(8) << "runs"
+        << std::setw(12) << "wall ms" << std::setw(12) << "cpu ms" << std::setw(13) << "allocations"
+        << std::setw(12) << "peak MiB" << '\n';
+    for (size_t i = 0; i < PHASES; i++) {
+        if (phases[i].entries > 0)
+            print_row(phase_name(static_cast<Phase>(i)), phases[i], true);
+    }
+    other.peak_rss_kib = 0;
+    print_row("other", other, false);
+    print_row("total", total, false);
+
+    out << "  " << source_bytes << " bytes, " << tokens << " tokens\n"
+        << "  AST: " << nodes.externs << " externs, " << nodes.definitions << " definitions, "
+        << nodes.operators << " operators, " << nodes.top_level << " top level expressions\n"
+        << "       " << nodes.variables << " variables, " << nodes.literals << " literals, "
+        << nodes.binops << " binary operations, " << nodes.calls << " calls\n";
+    if (functions > 0)
+        out << "  " << functions << " functions, " << instructions
+            << " LLVM instructions generated, " << optimized_instructions
+            << " after optimization\n";
+}
+
+void
+CompileStats::write_json(std::ostream &out) const
+{
+    auto wall = std::chrono::steady_clock::now() - start;
+    auto cpu = process_cpu_time() - cpu_start;
+    uint64_t allocations = heap_allocations.load(std::memory_order_relaxed) - allocations_start;
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\n  \"source\": " << json_string(source_name) << ",\n  \"phases\": {";
+    for (size_t i = 0; i < PHASES; i++) {
+        const PhaseStats &phase = phases[i];
+        out << (i == 0 ? "\n" : ",\n")
+            << "    " << json_string(phase_name(static_cast<Phase>(i))) << ": { "
+            << "\"runs\": " << phase.entries
+            << ", \"wall_ms\": " << milliseconds(phase.wall)
+            << ", \"cpu_ms\": " << milliseconds(phase.cpu)
+            << ", \"allocations\": " << phase.allocations
+            << ", \"peak_rss_kib\": " << phase.peak_rss_kib << " }";
+    }
+    out << "\n  },\n"
+        << "  \"total\": { \"wall_ms\": " << milliseconds(wall)
+        << ", \"cpu_ms\": " << milliseconds(cpu)
+        << ", \"allocations\": " << allocations
+        << ", \"peak_rss_kib\": " << peak_rss_kib() << " },\n"
+        << "  \"counts\": {\n"
+        << "    \"bytes\": " << source_bytes << ",\n"
+        << "    \"tokens\": " << tokens << ",\n"
+        << "    \"nodes\": { \"extern\": " << nodes.externs
+        << ", \"definition\": " << nodes.definitions
+        << ", \"operator\": " << nodes.operators
+        << ", \"top_level\": " << nodes.top_level
+        << ", \"variable\": " << nodes.variables
+        << ", \"literal\": " << nodes.literals
+        << ", \"binop\": " << nodes.binops
+        << ", \"call\": " << nodes.calls << " },\n"
+        << "    \"functions\": " << functions << ",\n"
+        << "    \"llvm_instructions\": " << instructions << ",\n"
+        << "    \"llvm_instructions_optimized\": " << optimized_instructions << "\n"
+        << "  }\n}\n";
+    out << std::defaultfloat;
+}
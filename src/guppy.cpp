@@ -0,0 +1,163 @@
+#include "guppy.h"
+#include "ast_optimizer.h"
+#include "codegen.h"
+#include "jit.h"
+#include "optimizer.h"
+#include "parser.h"
+
+#include <cstdlib>
+#include <mutex>
+
+namespace guppy {
+
+struct Engine::State {
+    std::mutex mutex;
+
+    unsigned opt_level;
+    Optimizer optimizer;
+    UnitGeneratorContext context;
+    GuppyJIT jit;
+
+    /* keeps the operators defined by earlier source */
+    Parser parser;
+
+    /* the name of the last function defined by source, or sym::ANON */
+    Symbol compile(const std::string &source);
+
+    State(unsigned opt_level) : opt_level(opt_level), optimizer(opt_level) {
+        context.set_optimizer(&optimizer);
+
+        /* formulas can be redefined; host threads may be running the
+         * old body at any time, so it is never freed */
+        jit.incremental = true;
+        jit.keep_replaced_bodies = true;
+
+        /* GUPPY_PERF=map|jitdump|all, as guppy --perf; line numbers are
+         * those within each source string compiled */
+        if (const char *profiling = std::getenv("GUPPY_PERF")) {
+            try {
+                unsigned flags = GuppyJIT::parse_profiling(profiling);
+                jit.enable_profiling(flags);
+                if (flags & GuppyJIT::JITDUMP) context.set_debug_info("<guppy source>");
+            } catch (const std::runtime_error &err) {
+                throw Error(err.what());
+            }
+        }
+    }
+};
+
+Symbol
+Engine::State::compile(const std::string &source)
+{
+    AST ast;
+    try {
+        ast = parser.parse_text(source);
+    } catch (ParseIncomplete) {
+        throw Error("unexpected end of source");
+    } catch (const std::runtime_error &err) {
+        throw Error(err.what());
+    }
+
+    if (opt_level >= 1) optimize_ast(ast);
+
+    try {
+        jit.execute(ast, context);
+    } catch (const std::runtime_error &err) {
+        throw Error(err.what());
+    }
+
+    Symbol last = sym::ANON;
+    for (auto const &node : ast) {
+        if (node->kind != ASTNode::Kind::DEFN) continue;
+
+        auto proto = static_cast<const DefnASTNode*>(node)->prototype;
+        if (proto->name != sym::ANON && !proto->is_operator())
+            last = proto->name;
+    }
+
+    return last;
+}
+
+static void
+check_arity(const std::string &name, size_t arity, size_t expected)
+{
+    if (arity != expected)
+        throw Error("'" + name + "' takes " + std::to_string(arity) + " argument(s), not "
+                + std::to_string(expected));
+}
+
+Engine::Engine(unsigned opt_level) : state(std::make_unique<State>(opt_level)) {}
+
+Engine::~Engine() = default;
+
+void
+Engine::define(const std::string &source)
+{
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->compile(source);
+}
+
+void*
+Engine::compile_function(const std::string &source, size_t arity)
+{
+    std::lock_guard<std::mutex> lock(state->mutex);
+
+    Symbol last = state->compile(source);
+    if (last == sym::ANON) throw Error("no function definition in source");
+
+    std::string name(symbol_name(last));
+    check_arity(name, state->context.prototypes[last], arity);
+
+    try {
+        return state->jit.lookup(name);
+    } catch (const std::runtime_error &err) {
+        throw Error(err.what());
+    }
+}
+
+void*
+Engine::lookup_function(const std::string &name, size_t arity)
+{
+    std::lock_guard<std::mutex> lock(state->mutex);
+
+    Symbol symbol;
+    auto proto = find_symbol(name, symbol) ? state->context.prototypes.find(symbol)
+        : state->context.prototypes.end();
+    if (proto == state->context.prototypes.end())
+        throw Error("unknown function '" + name + "'");
+    check_arity(name, proto->second, arity);
+
+    try {
+        return state->jit.lookup(name);
+    } catch (const std::runtime_error &err) {
+        throw Error(err.what());
+    }
+}
+
+void
+Engine::add_extern(const std::string &name, void *address, size_t arity)
+{
+    std::lock_guard<std::mutex> lock(state->mutex);
+
+    Symbol symbol = intern(name);
+    if (state->context.prototypes.count(symbol))
+        throw Error("'" + name + "' is already defined");
+
+    try {
+        state->jit.define_symbol(name, address);
+    } catch (const std::runtime_error &err) {
+        throw Error(err.what());
+    }
+    state->context.prototypes[symbol] = arity;
+}
+
+Engine&
+default_engine()
+{
+    /* deliberately leaked: host threads may still be calling compiled
+     * functions while static destructors run at exit */
+    static Engine* engine = new Engine();
+    return *engine;
+}
+
+}
@@ -0,0 +1,846 @@
+#include "jit.h"
+#include "compile_cache.h"
+#include "optimizer.h"
+#include "parallel_codegen.h"
+#include "perf_map.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <unordered_set>
+
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+
+static std::string
+error_string(llvm::Error err)
+{
+    return llvm::toString(std::move(err));
+}
+
+GuppyJIT::GuppyJIT()
+    : jitdump_listener(nullptr), object_layer(nullptr), batch_dylibs(0),
+      next_definition_order(0),
+      session_context(nullptr), tier_up_stop(false), dump_ir(false), codegen_threads(1),
+      cache(nullptr), incremental(false), keep_replaced_bodies(false), tiered(false),
+      tier_up_threshold(DEFAULT_TIER_UP_THRESHOLD), tier_up_level(3)
+{
+    initialize_native_target();
+
+    /* the layer LLJIT would create by default, kept at hand so that
+     * profilers can be attached to it */
+    auto jit = llvm::orc::LLJITBuilder()
+        .setObjectLinkingLayerCreator([this](llvm::orc::ExecutionSession &session,
+                    const llvm::Triple&) -> llvm::Expected<std::unique_ptr<llvm::orc::ObjectLayer>> {
+            auto layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(session,
+                    []() { return std::make_unique<llvm::SectionMemoryManager>(); });
+            object_layer = layer.get();
+            return std::move(layer);
+        })
+        .create();
+    if (!jit) throw JITError(error_string(jit.takeError()));
+    lljit = std::move(*jit);
+
+    /* make symbols from the host process (libm etc.) visible to guppy
+     * code, so that 'extern sin(x)' resolves to the C library sin */
+    auto generator = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            lljit->getDataLayout().getGlobalPrefix());
+    if (!generator) throw JITError(error_string(generator.takeError()));
+    lljit->getMainJITDylib().addGenerator(std::move(*generator));
+
+    auto stubs_builder = llvm::orc::createLocalIndirectStubsManagerBuilder(
+            lljit->getTargetTriple());
+    if (!stubs_builder) throw JITError("no indirect stubs for the host target");
+    stubs = stubs_builder();
+}
+
+GuppyJIT::~GuppyJIT()
+{
+    if (tier_up_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(session_mutex);
+            tier_up_stop = true;
+        }
+        tier_up_wakeup.notify_all();
+        tier_up_thread.join();
+    }
+}
+
+llvm::orc::ThreadSafeModule
+GuppyJIT::take_module(UnitGeneratorContext &context)
+{
+    optimize_module(context);
+    finish_module(*context.llvm_module);
+
+    llvm::orc::ThreadSafeModule tsm(std::move(context.llvm_module),
+            std::move(context.llvm_context));
+    context.reset_module();
+
+    return tsm;
+}
+
+void
+GuppyJIT::optimize_module(UnitGeneratorContext &context)
+{
+    if (context.optimizer != nullptr) {
+        CompileStats::Scope optimize_scope(context.stats, CompileStats::Phase::OPTIMIZE);
+        context.optimizer->run_on_module(*context.llvm_module);
+    }
+
+    if (context.stats != nullptr)
+        context.stats->optimized_instructions += context.llvm_module->getInstructionCount();
+}
+
+void
+GuppyJIT::finish_module(llvm::Module &module)
+{
+    module.setDataLayout(lljit->getDataLayout());
+
+    if (dump_ir) module.print(llvm::errs(), nullptr);
+}
+
+void
+GuppyJIT::add_module(llvm::orc::ThreadSafeModule module)
+{
+    module.withModuleDo([this](llvm::Module &m) { finish_module(m); });
+
+    if (auto err = lljit->addIRModule(std::move(module)))
+        throw JITError(error_string(std::move(err)));
+}
+
+void
+GuppyJIT::add_object(std::unique_ptr<llvm::MemoryBuffer> object)
+{
+    if (auto err = lljit->addObjectFile(std::move(object)))
+        throw JITError(error_string(std::move(err)));
+}
+
+void
+GuppyJIT::add_unit(UnitGeneratorContext &context)
+{
+    if (context.llvm_module->empty()) return;
+
+    if (auto err = lljit->addIRModule(take_module(context)))
+        throw JITError(error_string(std::move(err)));
+}
+
+void
+GuppyJIT::define_symbol(const std::string &name, void *address)
+{
+    llvm::orc::SymbolMap symbols;
+    symbols[lljit->mangleAndIntern(name)] = llvm::JITEvaluatedSymbol(
+            llvm::pointerToJITTargetAddress(address),
+            llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+
+    if (auto err = lljit->getMainJITDylib().define(llvm::orc::absoluteSymbols(std::move(symbols))))
+        throw JITError(error_string(std::move(err)));
+}
+
+void*
+GuppyJIT::lookup(const std::string &name)
+{
+    auto symbol = lljit->lookup(name);
+    if (!symbol) throw JITError(error_string(symbol.takeError()));
+
+    return reinterpret_cast<void*>(symbol->getAddress());
+}
+
+llvm::Expected<llvm::JITEvaluatedSymbol>
+GuppyJIT::lookup_emitting(llvm::orc::JITDylib &dylib, const std::string &name,
+        UnitGeneratorContext &context)
+{
+    CompileStats::Scope emit_scope(context.stats, CompileStats::Phase::EMIT);
+    return lljit->lookup(dylib, name);
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+GuppyJIT::cached_object(const DefnASTNode &defn, UnitGeneratorContext &context)
+{
+    Symbol name = defn.prototype->name;
+
+    /* what generating the definition records, a cache hit included:
+     * calls to the name now go to the definition rather than to a math
+     * intrinsic or a library function, and take its number of arguments */
+    context.math_intrinsics.erase(name);
+    context.externs.erase(name);
+    bool declared = context.prototypes.count(name) > 0;
+    context.prototypes[name] = defn.prototype->args.size();
+
+    context.record_purity(defn);
+    std::string key = cache_key(defn, context);
+    auto object = cache->lookup(key);
+
+    if (!object) {
+        /* alone in its module, the object code depends on nothing but
+         * what went into the key */
+        add_unit(context);
+
+        FunctionGen fgen(&context);
+        try {
+            fgen.apply_to(defn);
+        } catch (const CodegenError&) {
+            if (!declared) context.prototypes.erase(name);
+            throw;
+        }
+
+        optimize_module(context);
+        finish_module(*context.llvm_module);
+        {
+            CompileStats::Scope emit_scope(context.stats, CompileStats::Phase::EMIT);
+            object = context.optimizer->emit_object(*context.llvm_module);
+        }
+        context.reset_module();
+
+        cache->store(key, *object);
+    }
+
+    return object;
+}
+
+bool
+GuppyJIT::add_through_cache(const ASTNode &node, UnitGeneratorContext &context)
+{
+    if (node.kind != ASTNode::Kind::DEFN || context.optimizer == nullptr) return false;
+
+    auto &defn = static_cast<const DefnASTNode&>(node);
+    if (defn.prototype->name == sym::ANON || defn.prototype->is_operator()) return false;
+
+    add_object(cached_object(defn, context));
+
+    return true;
+}
+
+namespace {
+
+/* the functions and user operators a definition's body refers to */
+class UseCollector : public ExprVisitor<UseCollector> {
+    const UnitGeneratorContext &context;
+    std::unordered_set<const ASTExpr*> visited;
+
+public:
+    std::vector<Symbol> uses;
+
+    void apply_to(const VariableASTExpr&) {}
+    void apply_to(const LiteralDoubleASTExpr&) {}
+
+    void apply_to(const BinOpASTExpr &bin_op_expr) {
+        if (!visited.insert(&bin_op_expr).second) return;
+        if (context.operators.count(bin_op_expr.binop)) uses.push_back(bin_op_expr.binop);
+        visit(bin_op_expr.LHS);
+        visit(bin_op_expr.RHS);
+    }
+
+    void apply_to(const CallASTExpr &call_expr) {
+        uses.push_back(call_expr.callee);
+        for (auto const &a : call_expr.args) visit(a);
+    }
+
+    explicit UseCollector(const UnitGeneratorContext &context) : context(context) {}
+};
+
+}
+
+void
+GuppyJIT::compile_incrementally(const DefnASTNode &defn, UnitGeneratorContext &context)
+{
+    Symbol name = defn.prototype->name;
+
+    /* pending externs and the like go to the main dylib as usual */
+    add_unit(context);
+
+    if (defn.prototype->is_operator()) {
+        /* only recorded, every user inlines its own copy */
+        FunctionGen fgen(&context);
+        fgen.apply_to(defn);
+        context.reset_module();
+        return;
+    }
+
+    std::string function_name(symbol_name(name));
+    auto &dylib = lljit->getExecutionSession().createBareJITDylib(
+            function_name + "#" + std::to_string(next_definition_order));
+    dylib.setLinkOrder({ { &lljit->getMainJITDylib(),
+            llvm::orc::JITDylibLookupFlags::MatchExportedSymbolsOnly } });
+
+    llvm::Error err = llvm::Error::success();
+    if (cache != nullptr && context.optimizer != nullptr && !tiered) {
+        err = lljit->addObjectFile(dylib, cached_object(defn, context));
+    } else {
+        /* the baseline tier: no optimization, and a call counter */
+        Optimizer *optimizer = context.optimizer;
+        if (tiered) {
+            if (!baseline_optimizer) baseline_optimizer = std::make_unique<Optimizer>(0);
+            context.set_optimizer(baseline_optimizer.get());
+            context.count_calls = true;
+        }
+
+        FunctionGen fgen(&context);
+        try {
+            fgen.apply_to(defn);
+        } catch (const CodegenError&) {
+            context.reset_module();
+            context.set_optimizer(optimizer);
+            context.count_calls = false;
+            llvm::consumeError(lljit->getExecutionSession().removeJITDylib(dylib));
+            throw;
+        }
+        err = lljit->addIRModule(dylib, take_module(context));
+
+        context.set_optimizer(optimizer);
+        context.count_calls = false;
+    }
+
+    auto body = err ? llvm::Expected<llvm::JITEvaluatedSymbol>(std::move(err))
+        : lookup_emitting(dylib, function_name, context);
+    if (!body) {
+        llvm::consumeError(lljit->getExecutionSession().removeJITDylib(dylib));
+        throw JITError(error_string(body.takeError()));
+    }
+
+    /* callers elsewhere jump through the stub, so they never need to be
+     * recompiled when the body moves */
+    if (!stubs->findStub(function_name, false)) {
+        auto flags = llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+        if (auto stub_err = stubs->createStub(function_name, body->getAddress(), flags))
+            throw JITError(error_string(std::move(stub_err)));
+
+        llvm::orc::SymbolMap symbols;
+        symbols[lljit->mangleAndIntern(function_name)] = stubs->findStub(function_name, false);
+        if (auto define_err = lljit->getMainJITDylib().define(
+                    llvm::orc::absoluteSymbols(std::move(symbols))))
+            throw JITError(error_string(std::move(define_err)));
+    } else if (auto update_err = stubs->updatePointer(function_name, body->getAddress())) {
+        throw JITError(error_string(std::move(update_err)));
+    }
+
+    auto &definition = definitions[name];
+    if (!keep_replaced_bodies) {
+        for (llvm::orc::JITDylib *old : { definition.dylib, definition.memo_dylib }) {
+            if (old != nullptr)
+                llvm::consumeError(lljit->getExecutionSession().removeJITDylib(*old));
+        }
+    }
+    definition.dylib = &dylib;
+    definition.memo_dylib = nullptr;
+    definition.version++;
+    definition.tier = 0;
+    definition.calls = nullptr;
+
+    for (auto &entry : inlined_into) entry.second.erase(name);
+
+    if (tiered) {
+        auto calls = lljit->lookup(dylib, function_name + ".calls");
+        if (!calls) throw JITError(error_string(calls.takeError()));
+        definition.calls = reinterpret_cast<const uint64_t*>(calls->getAddress());
+        tier_stats.baseline++;
+
+        if (!tier_up_thread.joinable())
+            tier_up_thread = std::thread(&GuppyJIT::tier_up_loop, this);
+    }
+}
+
+std::vector<Symbol>
+GuppyJIT::dependents(Symbol name, const UnitGeneratorContext &context)
+{
+    std::vector<Symbol> result;
+    std::vector<Symbol> work = { name };
+    std::unordered_set<Symbol> seen = { name };
+
+    while (!work.empty()) {
+        Symbol used = work.back();
+        work.pop_back();
+
+        auto add = [&](const std::unordered_set<Symbol> &dependent) {
+            for (Symbol user : dependent) {
+                if (seen.insert(user).second) {
+                    result.push_back(user);
+                    work.push_back(user);
+                }
+            }
+        };
+
+        /* optimized bodies with an inlined copy are always stale */
+        auto copies = inlined_into.find(used);
+        if (copies != inlined_into.end()) add(copies->second);
+
+        /* operators are inlined into their users; memoized callers depend
+         * on whether the callee is pure. Other callers only see the stub. */
+        bool inlined = context.operators.count(used) > 0;
+        if (!inlined && !context.memoize) continue;
+
+        auto it = users.find(used);
+        if (it != users.end()) add(it->second);
+    }
+
+    std::sort(result.begin(), result.end(), [this](Symbol a, Symbol b) {
+        return definitions[a].order < definitions[b].order;
+    });
+    return result;
+}
+
+void
+GuppyJIT::define_incrementally(const DefnASTNode &defn, UnitGeneratorContext &context)
+{
+    const PrototypeAST &proto = *defn.prototype;
+    auto existing = definitions.find(proto.name);
+    bool redefinition = existing != definitions.end();
+
+    if (redefinition && !proto.is_operator()
+            && context.prototypes[proto.name] != proto.args.size()) {
+        auto it = users.find(proto.name);
+        if (it != users.end() && !it->second.empty())
+            throw JITError("cannot change the number of arguments of '"
+                    + std::string(symbol_name(proto.name)) + "', it is called by '"
+                    + std::string(symbol_name(*it->second.begin())) + "'");
+    }
+    if (!proto.is_operator())
+        context.prototypes[proto.name] = proto.args.size();
+
+    /* every definition is kept so that it can be recompiled when
+     * something it inlined changes */
+    auto copy = static_cast<const DefnASTNode*>(copy_node(&defn, definitions_arena));
+    std::vector<Symbol> affected = redefinition ? dependents(proto.name, context)
+        : std::vector<Symbol>();
+
+    context.pure_functions.erase(proto.name);
+    for (Symbol s : affected) context.pure_functions.erase(s);
+
+    /* batch entry points inline the body they were compiled from */
+    batch_functions.erase(proto.name);
+    for (Symbol s : affected) batch_functions.erase(s);
+
+    compile_incrementally(*copy, context);
+
+    Definition &definition = definitions[proto.name];
+    for (Symbol used : definition.uses) users[used].erase(proto.name);
+
+    UseCollector collector(context);
+    collector.visit(copy->body);
+    definition.defn = copy;
+    definition.uses = std::move(collector.uses);
+    if (!redefinition) definition.order = next_definition_order;
+    next_definition_order++;
+    for (Symbol used : definition.uses) users[used].insert(proto.name);
+
+    for (Symbol s : affected)
+        compile_incrementally(*definitions[s].defn, context);
+}
+
+double
+GuppyJIT::run_top_level(const DefnASTNode &node, UnitGeneratorContext &context,
+        std::unique_lock<std::mutex> &lock)
+{
+    /* no guppy code runs between top level expressions */
+    release_retired();
+
+    /* everything defined so far must be linked before the expression
+     * runs, and the expression gets a module of its own so that it can
+     * be removed again once it has been evaluated */
+    add_unit(context);
+
+    FunctionGen fgen(&context);
+    fgen.apply_to(node);
+
+    auto tracker = lljit->getMainJITDylib().createResourceTracker();
+    if (auto err = lljit->addIRModule(tracker, take_module(context)))
+        throw JITError(error_string(std::move(err)));
+
+    double value;
+    try {
+        auto symbol = lookup_emitting(lljit->getMainJITDylib(), "__ANON__", context);
+        if (!symbol) throw JITError(error_string(symbol.takeError()));
+        auto anon_func = reinterpret_cast<double (*)()>(symbol->getAddress());
+
+        /* the tier-up thread may swap in new bodies meanwhile */
+        lock.unlock();
+        {
+            CompileStats::Scope run_scope(context.stats, CompileStats::Phase::RUN);
+            value = anon_func();
+        }
+        lock.lock();
+    } catch (const JITError&) {
+        llvm::consumeError(tracker->remove());
+        throw;
+    }
+
+    if (auto err = tracker->remove())
+        throw JITError(error_string(std::move(err)));
+
+    return value;
+}
+
+void
+GuppyJIT::check_redefinitions(const AST &ast)
+{
+    std::unordered_set<Symbol> defined;
+    bool redefines = false;
+
+    for (auto const &node : ast) {
+        if (node->kind != ASTNode::Kind::DEFN) continue;
+
+        Symbol name = static_cast<const DefnASTNode*>(node)->prototype->name;
+        if (name == sym::ANON) continue;
+
+        if (fixed_definitions.count(name))
+            throw JITError("cannot redefine '" + std::string(symbol_name(name))
+                    + "', it was compiled outside incremental mode");
+        if (!defined.insert(name).second) redefines = true;
+    }
+
+    if (redefines) incremental = true;
+}
+
+std::vector<double>
+GuppyJIT::execute(const AST &ast, UnitGeneratorContext &context,
+        const std::function<void(double)> &on_result)
+{
+    std::vector<double> results;
+    FunctionGen fgen(&context);
+
+    std::unique_lock<std::mutex> lock(session_mutex);
+    session_context = &context;
+    struct SessionEnd {
+        GuppyJIT &jit;
+        ~SessionEnd() { jit.session_context = nullptr; }
+    } session_end = { *this };
+
+    check_redefinitions(ast);
+
+    /* in a large unit all definitions are generated (and compiled to
+     * machine code) up front on worker threads. Each node may still only
+     * refer to what precedes it, as when generating serially. IR dumps
+     * need the modules themselves, so they are added as IR and compiled
+     * here instead. */
+    unsigned workers = codegen_threads > 1 && cache == nullptr && !incremental
+        ? codegen_worker_count(ast, codegen_threads) : 0;
+    if (workers > 1) {
+        CompileStats::Scope codegen_scope(context.stats, CompileStats::Phase::CODEGEN);
+        for (auto &unit : generate_in_parallel(ast, context, workers, !dump_ir)) {
+            if (unit.object) {
+                add_object(std::move(unit.object));
+            } else {
+                add_module(std::move(unit.module));
+            }
+        }
+
+        for (auto const &node : ast) {
+            if (node->kind == ASTNode::Kind::DEFN
+                    && static_cast<const DefnASTNode*>(node)->prototype->name != sym::ANON)
+                fixed_definitions.insert(static_cast<const DefnASTNode*>(node)->prototype->name);
+        }
+    }
+
+    for (auto const &node : ast)
+    {
+        bool is_top_level_expr = node->kind == ASTNode::Kind::DEFN
+            && static_cast<const DefnASTNode*>(node)->prototype->name == sym::ANON;
+
+        if (is_top_level_expr) {
+            results.push_back(run_top_level(*static_cast<const DefnASTNode*>(node), context, lock));
+            if (on_result) on_result(results.back());
+        } else if (incremental && node->kind == ASTNode::Kind::DEFN) {
+            define_incrementally(*static_cast<const DefnASTNode*>(node), context);
+        } else if (workers <= 1) {
+            if (cache == nullptr || !add_through_cache(*node, context)) fgen.visit(node);
+            if (node->kind == ASTNode::Kind::DEFN)
+                fixed_definitions.insert(static_cast<const DefnASTNode*>(node)->prototype->name);
+        }
+    }
+
+    add_unit(context);
+    release_retired();
+
+    return results;
+}
+
+BatchFunction
+GuppyJIT::compile_batch(const DefnASTNode &defn, UnitGeneratorContext &context)
+{
+    auto cached = batch_functions.find(defn.prototype->name);
+    if (cached != batch_functions.end()) return cached->second;
+
+    if (defn.prototype->name == sym::ANON || defn.prototype->is_operator())
+        throw JITError("no batch entry point for '"
+                + std::string(symbol_name(defn.prototype->name)) + "'");
+
+    add_unit(context);
+
+    FunctionGen fgen(&context);
+    std::string name = fgen.generate_batch(defn)->getName().str();
+
+    /* a JITDylib of its own, so that the entry point can be compiled
+     * again once the definition changes; the old one is kept, as the
+     * host may still be calling it */
+    auto &dylib = lljit->getExecutionSession().createBareJITDylib(
+            name + "#" + std::to_string(batch_dylibs++));
+    dylib.setLinkOrder({ { &lljit->getMainJITDylib(),
+            llvm::orc::JITDylibLookupFlags::MatchExportedSymbolsOnly } });
+    if (auto err = lljit->addIRModule(dylib, take_module(context)))
+        throw JITError(error_string(std::move(err)));
+
+    auto symbol = lookup_emitting(dylib, name, context);
+    if (!symbol) throw JITError(error_string(symbol.takeError()));
+    auto batch = reinterpret_cast<BatchFunction>(symbol->getAddress());
+    batch_functions[defn.prototype->name] = batch;
+    return batch;
+}
+
+void
+GuppyJIT::report_memo_stats(const UnitGeneratorContext &context, std::ostream &out)
+{
+    std::vector<std::pair<std::string, Symbol>> names;
+    for (Symbol name : context.pure_functions) {
+        auto proto = context.prototypes.find(name);
+        if (proto != context.prototypes.end() && proto->second > 0)
+            names.emplace_back(std::string(symbol_name(name)), name);
+    }
+    std::sort(names.begin(), names.end());
+
+    std::lock_guard<std::mutex> lock(session_mutex);
+
+    out << "memoized functions:\n";
+    for (auto const &[name, symbol] : names) {
+        /* compiled incrementally, the counters are in the definition's
+         * own dylib; otherwise in the main one */
+        auto definition = definitions.find(symbol);
+        llvm::orc::JITDylib &dylib = definition != definitions.end()
+            && definition->second.dylib != nullptr
+            ? *definition->second.dylib : lljit->getMainJITDylib();
+
+        auto address = lljit->lookup(dylib, name + ".memo_stats");
+        if (!address) throw JITError(error_string(address.takeError()));
+        auto stats = reinterpret_cast<const uint64_t*>(address->getAddress());
+
+        uint64_t calls = stats[0] + stats[1];
+        out << "  " << name << ": " << stats[0] << " hits, " << stats[1] << " misses";
+        if (calls > 0)
+            out << " (" << std::fixed << std::setprecision(1) << 100.0 * stats[0] / calls
+                << "% hit rate)" << std::defaultfloat;
+        out << "\n";
+    }
+}
+
+void
+GuppyJIT::enable_profiling(unsigned profiling)
+{
+    if ((profiling & PERF_MAP) && !perf_map_listener) {
+        perf_map_listener = std::make_unique<PerfMapListener>();
+        object_layer->registerJITEventListener(*perf_map_listener);
+    }
+
+    if ((profiling & JITDUMP) && jitdump_listener == nullptr) {
+        jitdump_listener = llvm::JITEventListener::createPerfJITEventListener();
+        if (jitdump_listener == nullptr)
+            throw JITError("LLVM was built without jitdump support");
+        object_layer->registerJITEventListener(*jitdump_listener);
+    }
+}
+
+unsigned
+GuppyJIT::parse_profiling(const std::string &mode)
+{
+    if (mode == "map") return PERF_MAP;
+    if (mode == "jitdump") return JITDUMP;
+    if (mode == "all") return PERF_MAP | JITDUMP;
+
+    throw JITError("unknown profiling mode '" + mode + "'");
+}
+
+/* how often the tier-up thread looks at the call counters */
+static const std::chrono::milliseconds TIER_UP_POLL_INTERVAL(10);
+
+/* callee definitions copied into an optimized body for inlining */
+static const size_t TIER_UP_INLINE_BUDGET = 16;
+
+void
+GuppyJIT::tier_up_loop()
+{
+    std::unique_lock<std::mutex> lock(session_mutex);
+
+    while (!tier_up_stop) {
+        tier_up_wakeup.wait_for(lock, TIER_UP_POLL_INTERVAL);
+        if (tier_up_stop || session_context == nullptr) continue;
+        /* nothing to gain over the baseline (whose tier is also 0) */
+        if (tier_up_level == 0) continue;
+
+        Symbol hottest = sym::ANON;
+        uint64_t most_calls = 0;
+        for (auto const &entry : definitions) {
+            const Definition &definition = entry.second;
+            if (definition.tier != 0 || definition.calls == nullptr) continue;
+
+            uint64_t calls = __atomic_load_n(definition.calls, __ATOMIC_RELAXED);
+            if (calls >= tier_up_threshold && calls > most_calls) {
+                hottest = entry.first;
+                most_calls = calls;
+            }
+        }
+
+        if (hottest != sym::ANON) tier_up(hottest, lock);
+    }
+}
+
+void
+GuppyJIT::tier_up(Symbol name, std::unique_lock<std::mutex> &lock)
+{
+    Definition &definition = definitions[name];
+    size_t version = definition.version;
+    const DefnASTNode *defn = definition.defn;
+    std::string function_name(symbol_name(name));
+
+    /* the functions it calls, breadth first, to be inlined */
+    std::vector<const DefnASTNode*> callees;
+    std::unordered_set<Symbol> seen = { name };
+    std::vector<Symbol> work = definition.uses;
+    for (size_t i = 0; i < work.size() && callees.size() < TIER_UP_INLINE_BUDGET; i++) {
+        auto callee = definitions.find(work[i]);
+        if (callee == definitions.end() || callee->second.dylib == nullptr
+                || !seen.insert(work[i]).second)
+            continue;
+
+        /* a copy would start with an empty memo table of its own; the
+         * session's function is called through its stub instead */
+        if (session_context->is_memoized(*callee->second.defn->prototype)) continue;
+
+        callees.push_back(callee->second.defn);
+        work.insert(work.end(), callee->second.uses.begin(), callee->second.uses.end());
+    }
+
+    /* everything else the compilation needs from the session, copied
+     * while the caller's thread cannot change it */
+    UnitGeneratorContext context;
+    context.prototypes = session_context->prototypes;
+    for (const auto &[op, op_defn] : session_context->operators) {
+        /* the session's copies live in the caller's arena, which can go
+         * away while this compiles */
+        context.operators[op] = static_cast<const DefnASTNode*>(
+                copy_node(op_defn, context.operator_arena));
+    }
+    context.pure_functions = session_context->pure_functions;
+    context.math_intrinsics = session_context->math_intrinsics;
+    context.externs = session_context->externs;
+    context.memoize = session_context->memoize;
+    context.memo_table_size = session_context->memo_table_size;
+    context.set_fp_flags(session_context->fp_flags);
+    if (session_context->debug_info)
+        context.set_debug_info(session_context->source_name);
+
+    /* mark it taken, so that the next round picks another function */
+    unsigned level = tier_up_level;
+    definition.tier = level;
+
+    /* a memoized function keeps the baseline body's table and counters,
+     * so that promotion loses neither what it memoized nor its stats */
+    llvm::orc::JITDylib *baseline = definition.dylib;
+    llvm::orc::SymbolMap memo_symbols;
+    if (session_context->is_memoized(*defn->prototype)) {
+        for (const char *suffix : { ".memo", ".memo_stats" }) {
+            auto symbol = lljit->lookup(*baseline, function_name + suffix);
+            if (!symbol) {
+                llvm::consumeError(symbol.takeError());
+                tier_stats.discarded++;
+                return;
+            }
+            memo_symbols[lljit->mangleAndIntern(function_name + suffix)] = *symbol;
+        }
+        context.share_memo_tables = true;
+    }
+
+    lock.unlock();
+
+    /* compiled to an object here with an optimizer (and target machine)
+     * of our own; LLJIT's compiler belongs to the caller's thread */
+    llvm::orc::JITDylib *dylib = nullptr;
+    llvm::JITTargetAddress address = 0;
+    std::unique_ptr<Optimizer> optimizer;
+    try {
+        optimizer = std::make_unique<Optimizer>(level);
+        context.set_optimizer(optimizer.get());
+
+        FunctionGen fgen(&context);
+        for (const DefnASTNode *callee : callees)
+            fgen.generate_definition(*callee)->setLinkage(llvm::GlobalValue::InternalLinkage);
+        fgen.generate_definition(*defn);
+
+        optimizer->run_on_module(*context.llvm_module);
+        finish_module(*context.llvm_module);
+        auto object = optimizer->emit_object(*context.llvm_module);
+
+        dylib = &lljit->getExecutionSession().createBareJITDylib(
+                function_name + "#" + std::to_string(version) + "-O"
+                + std::to_string(level));
+        dylib->setLinkOrder({ { &lljit->getMainJITDylib(),
+                llvm::orc::JITDylibLookupFlags::MatchExportedSymbolsOnly } });
+        if (!memo_symbols.empty()) {
+            if (auto err = dylib->define(llvm::orc::absoluteSymbols(std::move(memo_symbols))))
+                throw JITError(error_string(std::move(err)));
+        }
+
+        if (auto err = lljit->addObjectFile(*dylib, std::move(object)))
+            throw JITError(error_string(std::move(err)));
+
+        auto body = lljit->lookup(*dylib, function_name);
+        if (!body) throw JITError(error_string(body.takeError()));
+        address = body->getAddress();
+    } catch (const std::runtime_error&) {
+        /* keep running the baseline body */
+        address = 0;
+    }
+
+    lock.lock();
+
+    if (optimizer && session_context != nullptr && session_context->optimizer != nullptr)
+        session_context->optimizer->merge_stats(*optimizer);
+
+    /* redefined (or the session ended) while we were compiling */
+    auto current = definitions.find(name);
+    if (address == 0 || current == definitions.end() || current->second.version != version
+            || llvm::errorToBool(stubs->updatePointer(function_name, address))) {
+        if (dylib != nullptr)
+            llvm::consumeError(lljit->getExecutionSession().removeJITDylib(*dylib));
+        tier_stats.discarded++;
+        return;
+    }
+
+    if (context.share_memo_tables)
+        current->second.memo_dylib = baseline;
+    else
+        retired.push_back(baseline);
+    current->second.dylib = dylib;
+    current->second.calls = nullptr;
+    for (const DefnASTNode *callee : callees)
+        inlined_into[callee->prototype->name].insert(name);
+    tier_stats.promoted++;
+}
+
+void
+GuppyJIT::release_retired()
+{
+    if (!keep_replaced_bodies) {
+        for (llvm::orc::JITDylib *dylib : retired)
+            llvm::consumeError(lljit->getExecutionSession().removeJITDylib(*dylib));
+    }
+    retired.clear();
+}
+
+void
+GuppyJIT::report_tiering(std::ostream &out)
+{
+    std::lock_guard<std::mutex> lock(session_mutex);
+
+    out << "tiered compilation: " << tier_stats.baseline << " baseline bodies, "
+        << tier_stats.promoted << " promoted to -O" << tier_up_level;
+    if (tier_stats.discarded > 0) out << ", " << tier_stats.discarded << " discarded";
+    out << "\n";
+
+    std::vector<std::pair<std::string, unsigned>> tiers;
+    for (auto const &entry : definitions) {
+        if (entry.second.dylib != nullptr && entry.second.tier != 0)
+            tiers.emplace_back(std::string(symbol_name(entry.first)), entry.second.tier);
+    }
+    std::sort(tiers.begin(), tiers.end());
+    for (auto const &tier : tiers)
+        out << "  " << tier.first << ": -O" << tier.second << "\n";
+}
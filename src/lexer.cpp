@@ -1,133 +1,259 @@
 #include "util.h"
 #include "lexer.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 bool operator ==(const Token &t1, const Token &t2) {
-    return std::tie(t1.type, t1.contents) == std::tie(t2.type, t2.contents);
+    if (t1.type != t2.type) return false;
+
+    return t1.type == Token::Type::NUMERIC_LITERAL
+        ? t1.contents == t2.contents
+        : t1.symbol == t2.symbol;
 }
 
 bool operator !=(const Token &t1, const Token &t2) {
     return !(t1 == t2);
 }
 
-std::vector<Token>
-tokenize(const std::string &program)
+/* Length of the run of characters at p (stopping at end) whose class
+ * intersects 'classes'. The SSE2 paths below handle the common runs 16
+ * bytes at a time and fall back to this for the tail of the input. */
+static inline const char*
+skip_class(const char *p, const char *end, uint8_t classes)
 {
-    std::vector<Token> tokens;
-    std::string::const_iterator it = program.begin();
-    unsigned linum = 1;
-    unsigned colnum = 1;
-
-    /* advance the iterator without accidentally stepping past
-     * the end of the program string */
-    auto safe_advance = [&it, &program, &linum, &colnum]() -> void {
-        if (it != program.end()) {
-            if (*it == '\n') {
-                linum++;
-                colnum = 1;
-            } else {
-                colnum++;
-            }
-            it++;
+    while (p != end && charclass::is(*p, classes)) p++;
+    return p;
+}
+
+#if defined(__SSE2__)
+
+/* mask of the bytes of v lying in [lo, lo + len] */
+static inline __m128i
+bytes_in_range(__m128i v, char lo, char len)
+{
+    __m128i offset = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(len)), offset);
+}
+
+static inline const char*
+skip_identifier_body(const char *p, const char *end)
+{
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i alpha = bytes_in_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 25);
+        __m128i digit = bytes_in_range(v, '0', 9);
+        unsigned stop = ~_mm_movemask_epi8(_mm_or_si128(alpha, digit)) & 0xFFFF;
+        if (stop != 0) return p + __builtin_ctz(stop);
+        p += 16;
+    }
+    return skip_class(p, end, charclass::IDENTIFIER_BODY);
+}
+
+/* skips whitespace, counting the newlines passed over and remembering
+ * where the last line began */
+static inline const char*
+skip_whitespace(const char *p, const char *end, unsigned &linum, const char *&line_start)
+{
+    /* most tokens are separated by at most a single space */
+    if (p != end && *p == ' ') p++;
+    if (p == end || !charclass::is(*p, charclass::SPACE)) return p;
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                bytes_in_range(v, '\t', '\r' - '\t'));
+        unsigned stop = ~_mm_movemask_epi8(space) & 0xFFFF;
+        unsigned run = stop != 0 ? __builtin_ctz(stop) : 16;
+
+        unsigned newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')))
+            & ((1u << run) - 1);
+        if (newlines != 0) {
+            linum += __builtin_popcount(newlines);
+            line_start = p + (31 - __builtin_clz(newlines)) + 1;
         }
-    };
 
-    /* helper function to add line/column number to token constructor */
-    auto make_token = [&linum, &colnum]
-        (Token::Type tt, const std::string &s) -> Token {
-            return Token(tt, s, linum, colnum - s.size());
+        p += run;
+        if (stop != 0) return p;
+    }
+
+    for (; p != end && charclass::is(*p, charclass::SPACE); p++) {
+        if (*p == '\n') {
+            linum++;
+            line_start = p + 1;
+        }
+    }
+    return p;
+}
+
+/* comments run up to (not including) the next '\n' or '\r' */
+static inline const char*
+skip_comment(const char *p, const char *end)
+{
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        unsigned stop = _mm_movemask_epi8(_mm_or_si128(
+                    _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                    _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        if (stop != 0) return p + __builtin_ctz(stop);
+        p += 16;
+    }
+    while (p != end && *p != '\n' && *p != '\r') p++;
+    return p;
+}
+
+#else
+
+static inline const char*
+skip_identifier_body(const char *p, const char *end)
+{
+    return skip_class(p, end, charclass::IDENTIFIER_BODY);
+}
+
+static inline const char*
+skip_whitespace(const char *p, const char *end, unsigned &linum, const char *&line_start)
+{
+    for (; p != end && charclass::is(*p, charclass::SPACE); p++) {
+        if (*p == '\n') {
+            linum++;
+            line_start = p + 1;
+        }
+    }
+    return p;
+}
+
+static inline const char*
+skip_comment(const char *p, const char *end)
+{
+    while (p != end && *p != '\n' && *p != '\r') p++;
+    return p;
+}
+
+#endif
+
+void
+tokenize(std::string_view program, std::vector<Token> &tokens, unsigned first_linum)
+{
+    /* the program is not necessarily null terminated (it may be a
+     * mapped file), so every scan is bounded by 'end' */
+    const char *p = program.data();
+    const char *const end = p + program.size();
+
+    /* columns are computed from the start of the current line when a
+     * token is made, so only whitespace needs to watch for newlines */
+    unsigned linum = first_linum;
+    const char *line_start = p;
+
+    auto make_token = [&linum, &line_start]
+        (Token::Type tt, const char *start, const char *stop, Symbol symbol) -> Token {
+            return Token(tt, std::string_view(start, stop - start), symbol,
+                    linum, static_cast<unsigned>(start - line_start) + 1);
     };
 
-    while (it != program.end())
+    while (true)
     {
         /******************************/
         /* WHITESPACE | TAB | NEWLINE */
         /******************************/
-        while (isspace(*it)) safe_advance();
+        p = skip_whitespace(p, end, linum, line_start);
+
+        if (p == end) break;
+
+        const char *start = p;
+
+        switch (charclass::of(*p)) {
 
         /*****************************/
         /* IDENTIFIER | DEF | EXTERN */
         /*****************************/
-        if (isalpha(*it)) { // first letter must be alphabetic
-            std::string identifier_str;
-            do {
-                identifier_str.push_back(*it);
-                safe_advance();
-            } while (isalnum(*it)); // the rest can be alphanumeric
-
-            auto rit = RESERVED_IDENTIFIERS.find(identifier_str);
-            if (rit != RESERVED_IDENTIFIERS.end()) {
-                tokens.push_back(make_token(rit->second, identifier_str));
+        case charclass::ALPHA: { // first letter must be alphabetic
+            p = skip_identifier_body(p + 1, end); // the rest can be alphanumeric
+
+            std::string_view word(start, p - start);
+            Token::Type type = keyword_type(word);
+
+            if (type == Token::Type::DEFN) {
+                tokens.push_back(make_token(type, start, p, sym::DEFN));
+            } else if (type == Token::Type::EXTERN) {
+                tokens.push_back(make_token(type, start, p, sym::EXTERN));
             } else {
-                tokens.push_back(make_token(Token::Type::IDENTIFIER, identifier_str));
+                tokens.push_back(make_token(type, start, p, intern(word)));
             }
+            break;
+        }
 
         /**********/
         /* NUMBER */
         /**********/
-        } else if (isdigit(*it)) {
-            std::string double_str;
+        case charclass::DIGIT:
+            p = skip_class(p + 1, end, charclass::NUMBER_BODY);
 
-            do {
-                double_str.push_back(*it);
-                safe_advance();
-            } while (isdigit(*it) || *it == '.');
-
-            tokens.push_back(make_token(Token::Type::NUMERIC_LITERAL, double_str));
+            /* numeric literals are converted by the parser, not interned */
+            tokens.push_back(make_token(Token::Type::NUMERIC_LITERAL, start, p, Symbol { 0 }));
+            break;
 
         /***********/
         /* COMMENT */
         /***********/
-        } else if (*it == '#') {
-
-            do safe_advance(); while
-                (it != program.end() && *it != '\n' && *it != '\r');
+        case charclass::COMMENT:
+            p = skip_comment(p + 1, end);
+            break;
 
-        /*******************************/
-        /* OPERATOR OR RESERVED SYMBOL */
-        /*******************************/
+        /************/
+        /* OPERATOR */
+        /************/
             // TODO: check that length of operator <= 3
-        } else if (isopch(*it)) { // OPERATOR
-            std::string operator_str;
-            do {
-                operator_str.push_back(*it);
-                safe_advance();
-            } while (isopch(*it));
+        case charclass::OPERATOR:
+            p = skip_class(p + 1, end, charclass::OPERATOR);
 
-            tokens.push_back(make_token(Token::Type::OPERATOR, operator_str));
+            tokens.push_back(make_token(Token::Type::OPERATOR, start, p,
+                        intern(std::string_view(start, p - start))));
+            break;
+
+        /*******************/
+        /* RESERVED SYMBOL */
+        /*******************/
+        case charclass::RESERVED:
+            p++;
+            tokens.push_back(make_token(Token::Type::RESERVED_SYMBOL, start, p,
+                        reserved_symbol(*start)));
+            break;
 
         /***************/
         /* END OF FILE */
         /***************/
-        } else if ( (int) *it == 0 ) { // null/eof
-            tokens.push_back(make_token(Token::Type::END_OF_FILE, ""));
-
-        /***************************/
-        /* RESERVED | UNRECOGNIZED */
-        /***************************/
-        } else {
-            std::string symbol;
-            bool is_reserved_symbol = false;
-
-            do {
-                symbol.push_back(*it);
-                is_reserved_symbol = contains(RESERVED_SYMBOLS, symbol);
-                safe_advance();
-            } while (!isspace(*it) && !is_reserved_symbol && symbol.size() <= 3);
-
-            if (is_reserved_symbol) {
-                tokens.push_back(make_token(Token::Type::RESERVED_SYMBOL, symbol));
-            } else {
-                std::ostringstream err_msg;
-                err_msg << "unrecognized character '";
-                err_msg << *it << "' encountered during lexing";
-                throw std::runtime_error(err_msg.str());
-            }
+        case charclass::END: // null/eof
+            tokens.push_back(make_token(Token::Type::END_OF_FILE, start, start, Symbol { 0 }));
+            return;
+
+        /****************/
+        /* UNRECOGNIZED */
+        /****************/
+        default: {
+            std::ostringstream err_msg;
+            err_msg << "unrecognized character '";
+            err_msg << *start << "' encountered during lexing";
+            throw std::runtime_error(err_msg.str());
+        }
         }
     }
+}
+
+std::vector<Token>
+tokenize(std::string_view program)
+{
+    std::vector<Token> tokens;
+
+    /* source text usually averages several characters per token, so this
+     * keeps regrowth of the token vector to a handful of reallocations */
+    tokens.reserve(program.size() / 4 + 1);
+
+    tokenize(program, tokens, 1);
 
-    if (tokens.back().type != Token::Type::END_OF_FILE)
-        tokens.push_back(Token(Token::Type::END_OF_FILE,""));
+    if (tokens.empty() || tokens.back().type != Token::Type::END_OF_FILE)
+        tokens.push_back(Token(Token::Type::END_OF_FILE, ""));
 
     return tokens;
 }
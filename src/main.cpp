@@ -1,46 +1,403 @@
 #include "ast.h"
+#include "ast_optimizer.h"
 #include "ast_printer.h"
+#include "compile_stats.h"
 #include "parser.h"
-#include "repl.h"
+#include "source.h"
+#include "vm.h"
+
+#ifdef GUPPY_HAVE_LLVM
+#include "aot.h"
 #include "codegen.h"
+#include "compile_cache.h"
+#include "jit.h"
+#include "optimizer.h"
+#include "repl.h"
+#endif
 
-#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <memory>
+#include <new>
 #include <string>
+#include <thread>
 
-std::string get_file_contents(const char *filename)
+/* count every allocation for --time-report and --stats; operator new[]
+ * and the nothrow forms end up here as well */
+void*
+operator new(std::size_t size)
 {
-  std::ifstream in(filename, std::ios::in);
-  if (in)
-  {
-    std::string contents;
-    in.seekg(0, std::ios::end);
-    contents.resize(in.tellg());
-    in.seekg(0, std::ios::beg);
-    in.read(&contents[0], contents.size());
-    in.close();
-    return(contents);
-  }
-  throw(errno);
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+
+    for (;;) {
+        if (void *p = std::malloc(size != 0 ? size : 1)) return p;
+
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) throw std::bad_alloc();
+        handler();
+    }
 }
 
-int main(void) {
-    std::string fstr = get_file_contents("foo.gup");
-    Parser p = Parser();
-    AST ast = p.parse_text(fstr);
+void
+operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void
+operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
 
-    UnitGeneratorContext ugc;
+static void print_usage(void) {
+#ifdef GUPPY_HAVE_LLVM
+    std::cerr << "usage: guppy [-O0|-O1|-O2|-O3] [-j<n>] [--opt-report] [--dump-ir] [file.gup]" << std::endl;
+    std::cerr << "       guppy [-O0|-O1|-O2|-O3] (-c|--shared) [-o output] file.gup" << std::endl;
+    std::cerr << "       guppy [-O0|-O1|-O2|-O3] --vm [--opt-report] file.gup" << std::endl;
+    std::cerr << "  with no file, an interactive session is started" << std::endl;
+    std::cerr << "  -c            compile to a native object file (default file.o)" << std::endl;
+    std::cerr << "  --shared      compile to a shared library (default file.so)" << std::endl;
+    std::cerr << "  -o <path>     output path for -c and --shared" << std::endl;
+    std::cerr << "  -O<n>         optimization level (default -O2)" << std::endl;
+    std::cerr << "  --vm          run in the bytecode interpreter instead of the JIT" << std::endl;
+    std::cerr << "  -j<n>         threads for code generation and compilation" << std::endl;
+    std::cerr << "                (default: one per core)" << std::endl;
+    std::cerr << "  --opt-report  print time spent in the optimization pipelines" << std::endl;
+    std::cerr << "  --dump-ir     print generated LLVM IR to stderr" << std::endl;
+    std::cerr << "  --cache       keep compiled definitions in an on-disk cache" << std::endl;
+    std::cerr << "                (" << CompileCache::default_directory() << ")" << std::endl;
+    std::cerr << "  --cache-dir=<dir>      use <dir> as the cache (implies --cache)" << std::endl;
+    std::cerr << "  --cache-size=<MiB>     cache size limit (default "
+        << (CompileCache::DEFAULT_MAX_BYTES >> 20) << ")" << std::endl;
+    std::cerr << "  --cache-stats          print cache hits and misses to stderr" << std::endl;
+    std::cerr << "  --memoize[=<entries>]  memoize functions that call no externs, with a"
+        << std::endl;
+    std::cerr << "                         table of <entries> (a power of two, default "
+        << UnitGeneratorContext::DEFAULT_MEMO_TABLE_SIZE << ") each" << std::endl;
+    std::cerr << "  --memo-stats           print memo table hits and misses to stderr" << std::endl;
+    std::cerr << "  --tiered               compile functions at -O0 first, and hot ones again"
+        << std::endl;
+    std::cerr << "                         in the background at the -O level (default -O3)"
+        << std::endl;
+    std::cerr << "  --tier-threshold=<n>   calls that make a function hot (default "
+        << GuppyJIT::DEFAULT_TIER_UP_THRESHOLD << ")" << std::endl;
+    std::cerr << "  --fp=<mode>            floating point semantics: strict (default), fast, or"
+        << std::endl;
+    std::cerr << "                         a list of contract,reassoc,nnan,ninf,nsz,arcp,afn"
+        << std::endl;
+    std::cerr << "  --perf[=map|jitdump]   make JIT'd code visible to perf: /tmp/perf-<pid>.map,"
+        << std::endl;
+    std::cerr << "                         a jitdump file with line numbers, or both (default)"
+        << std::endl;
+#else
+    std::cerr << "usage: guppy [-O0|-O1|-O2|-O3] [--opt-report] file.gup" << std::endl;
+    std::cerr << "  built without LLVM: programs run in the bytecode interpreter" << std::endl;
+    std::cerr << "  -O<n>         AST optimizations from -O1 (default -O2)" << std::endl;
+    std::cerr << "  --opt-report  print what the AST optimizer did" << std::endl;
+#endif
+    std::cerr << "  --time-report          print time, memory and counts per compiler phase"
+        << std::endl;
+    std::cerr << "  --stats[=<file>]       the same as JSON, to stderr or to <file>" << std::endl;
+}
 
-    FunctionGen fgen(&ugc);
+#ifdef GUPPY_HAVE_LLVM
+/* foo.gup -> foo<extension> */
+static std::string
+default_output_path(const std::string &input, const char *extension)
+{
+    std::string base = input;
+    size_t dot = base.rfind('.');
+    size_t slash = base.rfind('/');
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+        base.erase(dot);
+
+    return base + extension;
+}
+#endif
+
+int main(int argc, char **argv) {
+    enum class Mode { RUN, OBJECT, SHARED_LIBRARY } mode = Mode::RUN;
+    const char *filename = nullptr;
+    bool opt_report = false;
+    unsigned opt_level = 2;
+    bool use_vm = false;
+    bool time_report = false;
+    bool json_stats = false;
+    const char *stats_path = nullptr;
+#ifdef GUPPY_HAVE_LLVM
+    const char *output_path = nullptr;
+    bool dump_ir = false;
+    unsigned threads = std::thread::hardware_concurrency();
+    bool use_cache = false;
+    bool cache_stats = false;
+    std::string cache_dir = CompileCache::default_directory();
+    uint64_t cache_size = CompileCache::DEFAULT_MAX_BYTES;
+    bool memoize = false;
+    bool memo_stats = false;
+    size_t memo_table_size = UnitGeneratorContext::DEFAULT_MEMO_TABLE_SIZE;
+    bool tiered = false;
+    bool opt_level_given = false;
+    uint64_t tier_threshold = GuppyJIT::DEFAULT_TIER_UP_THRESHOLD;
+    llvm::FastMathFlags fp_flags;
+    unsigned profiling = 0;
+#else
+    use_vm = true;
+#endif
+
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--opt-report") == 0) {
+            opt_report = true;
+        } else if (std::strcmp(argv[i], "--vm") == 0) {
+            use_vm = true;
+        } else if (std::strcmp(argv[i], "--time-report") == 0) {
+            time_report = true;
+        } else if (std::strcmp(argv[i], "--stats") == 0) {
+            json_stats = true;
+        } else if (std::strncmp(argv[i], "--stats=", 8) == 0 && argv[i][8] != '\0') {
+            json_stats = true;
+            stats_path = argv[i] + 8;
+        } else if (argv[i][0] == '-' && argv[i][1] == 'O'
+                && argv[i][2] >= '0' && argv[i][2] <= '3' && argv[i][3] == '\0') {
+            opt_level = argv[i][2] - '0';
+#ifdef GUPPY_HAVE_LLVM
+            opt_level_given = true;
+        } else if (std::strcmp(argv[i], "--dump-ir") == 0) {
+            dump_ir = true;
+        } else if (std::strcmp(argv[i], "--cache") == 0) {
+            use_cache = true;
+        } else if (std::strncmp(argv[i], "--cache-dir=", 12) == 0 && argv[i][12] != '\0') {
+            use_cache = true;
+            cache_dir = argv[i] + 12;
+        } else if (std::strncmp(argv[i], "--cache-size=", 13) == 0) {
+            char *end;
+            cache_size = std::strtoull(argv[i] + 13, &end, 10) << 20;
+            if (*end != '\0' || cache_size == 0) {
+                print_usage();
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--cache-stats") == 0) {
+            cache_stats = true;
+        } else if (std::strcmp(argv[i], "--memoize") == 0) {
+            memoize = true;
+        } else if (std::strncmp(argv[i], "--memoize=", 10) == 0) {
+            char *end;
+            memoize = true;
+            memo_table_size = std::strtoull(argv[i] + 10, &end, 10);
+            if (*end != '\0' || memo_table_size == 0
+                    || (memo_table_size & (memo_table_size - 1)) != 0) {
+                print_usage();
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--memo-stats") == 0) {
+            memo_stats = true;
+        } else if (std::strcmp(argv[i], "--tiered") == 0) {
+            tiered = true;
+        } else if (std::strncmp(argv[i], "--tier-threshold=", 17) == 0) {
+            char *end;
+            tier_threshold = std::strtoull(argv[i] + 17, &end, 10);
+            if (*end != '\0' || tier_threshold == 0) {
+                print_usage();
+                return 1;
+            }
+        } else if (std::strncmp(argv[i], "--fp=", 5) == 0) {
+            try {
+                fp_flags = parse_fp_mode(argv[i] + 5);
+            } catch (const CodegenError &err) {
+                std::cerr << "guppy: " << err.what() << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--perf") == 0) {
+            profiling = GuppyJIT::PERF_MAP | GuppyJIT::JITDUMP;
+        } else if (std::strncmp(argv[i], "--perf=", 7) == 0) {
+            try {
+                profiling = GuppyJIT::parse_profiling(argv[i] + 7);
+            } catch (const JITError &err) {
+                std::cerr << "guppy: " << err.what() << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "-c") == 0) {
+            mode = Mode::OBJECT;
+        } else if (std::strcmp(argv[i], "--shared") == 0) {
+            mode = Mode::SHARED_LIBRARY;
+        } else if (std::strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (argv[i][0] == '-' && argv[i][1] == 'j' && argv[i][2] != '\0') {
+            char *end;
+            threads = std::strtoul(argv[i] + 2, &end, 10);
+            if (*end != '\0' || threads == 0) {
+                print_usage();
+                return 1;
+            }
+#endif
+        } else if (argv[i][0] == '-') {
+            print_usage();
+            return 1;
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    /* the interpreter only runs files, and only files get statistics */
+    if (filename == nullptr && (mode != Mode::RUN || use_vm || time_report || json_stats)) {
+        print_usage();
+        return 1;
+    }
+
+#ifdef GUPPY_HAVE_LLVM
+    if ((use_vm || profiling != 0) && mode != Mode::RUN) {
+        print_usage();
+        return 1;
+    }
+
+    /* the level hot functions are compiled at */
+    if (tiered && !opt_level_given) opt_level = 3;
+
+    std::unique_ptr<CompileCache> cache;
+    try {
+        if (use_cache && mode == Mode::RUN && !use_vm)
+            cache = std::make_unique<CompileCache>(cache_dir, cache_size);
+    } catch (const std::runtime_error &err) {
+        std::cerr << "guppy: " << err.what() << ", continuing without it" << std::endl;
+    }
 
+    auto finish_cache = [&cache, cache_stats]() {
+        if (!cache) return;
+        cache->trim();
+        if (cache_stats) cache->report(std::cerr);
+    };
 
-    for (auto &node : ast)
+    if (filename == nullptr) {
+        repl(opt_level, cache.get(), tiered, fp_flags, profiling);
+        finish_cache();
+        return 0;
+    }
+#endif
+
+    std::unique_ptr<CompileStats> stats;
+    if (time_report || json_stats) {
+        stats = std::make_unique<CompileStats>();
+        stats->source_name = filename;
+    }
+
+    /* printed as they are computed, so that an error in a later
+     * expression does not swallow the values of the earlier ones */
+    auto print_result = [](double value) { std::cout << value << std::endl; };
+
+    /* the exit status, which is an error if the statistics cannot be written */
+    auto finish_stats = [&stats, time_report, json_stats, stats_path]() {
+        if (!stats) return 0;
+        if (time_report) stats->report(std::cerr);
+        if (!json_stats) return 0;
+
+        if (stats_path == nullptr) {
+            stats->write_json(std::cerr);
+            return 0;
+        }
+        std::ofstream out(stats_path);
+        stats->write_json(out);
+        if (!out.flush()) {
+            std::cerr << "guppy: cannot write statistics to '" << stats_path << "'" << std::endl;
+            return 1;
+        }
+        return 0;
+    };
+
+    try {
+        AST ast;
+        {
+            /* the AST does not refer back into the source, so the file
+             * can be unmapped as soon as it has been parsed */
+            std::unique_ptr<SourceBuffer> source;
+            {
+                CompileStats::Scope scope(stats.get(), CompileStats::Phase::READ);
+                source = std::make_unique<SourceBuffer>(filename);
+            }
+            Parser p = Parser();
+            p.stats = stats.get();
+            ast = p.parse_text(source->contents());
+        }
+        if (stats) stats->count_nodes(ast);
+
+        ASTOptimizer ast_optimizer(ast.get_arena());
+        if (opt_level >= 1) {
+            CompileStats::Scope scope(stats.get(), CompileStats::Phase::AST_OPT);
+            ast_optimizer.run(ast);
+        }
+
+        if (use_vm) {
+            VM vm;
+            vm.stats = stats.get();
+            vm.execute(ast, print_result);
+
+            if (opt_report) ast_optimizer.report(std::cerr);
+            return finish_stats();
+        }
+
+#ifdef GUPPY_HAVE_LLVM
+        if (mode != Mode::RUN) {
+            std::string output = output_path != nullptr ? output_path
+                : default_output_path(filename, mode == Mode::OBJECT ? ".o" : ".so");
+
+            if (size_t dropped = count_top_level_expressions(ast))
+                std::cerr << "guppy: warning: " << dropped << " top level expression(s) in '"
+                    << filename << "' are not compiled into '" << output << "'" << std::endl;
+
+            if (mode == Mode::OBJECT) {
+                compile_to_object(ast, opt_level, output, fp_flags, stats.get());
+            } else {
+                compile_to_shared_library(ast, opt_level, output, fp_flags, stats.get());
+            }
+            return finish_stats();
+        }
+
+        Optimizer optimizer(opt_level);
+        UnitGeneratorContext ugc;
+        ugc.set_optimizer(&optimizer);
+        ugc.memoize = memoize;
+        ugc.memo_table_size = memo_table_size;
+        ugc.set_fp_flags(fp_flags);
+        ugc.stats = stats.get();
+        if (profiling & GuppyJIT::JITDUMP)
+            ugc.set_debug_info(std::filesystem::absolute(filename).string());
+
+        GuppyJIT jit;
+        jit.enable_profiling(profiling);
+        jit.dump_ir = dump_ir;
+        jit.codegen_threads = threads;
+        jit.cache = cache.get();
+        jit.incremental = tiered;
+        jit.tiered = tiered;
+        jit.tier_up_threshold = tier_threshold;
+        jit.tier_up_level = opt_level;
+
+        jit.execute(ast, ugc, print_result);
+
+        if (opt_report) {
+            ast_optimizer.report(std::cerr);
+            optimizer.report(std::cerr);
+            std::cerr << "floating point mode: " << fp_mode_name(fp_flags) << std::endl;
+            if (tiered) jit.report_tiering(std::cerr);
+        }
+        if (memoize && memo_stats) jit.report_memo_stats(ugc, std::cerr);
+        finish_cache();
+#endif
+        return finish_stats();
+    }
+
+    catch (ParseIncomplete)
+    {
+        std::cerr << "guppy: unexpected end of file in '" << filename << "'" << std::endl;
+        return 1;
+    }
+
+    catch (const std::runtime_error &err)
     {
-        node->inject(fgen);
-        fgen.extract()->dump();
+        std::cerr << "guppy: " << err.what() << std::endl;
+        return 1;
     }
 
     return 0;
 }
-
-
@@ -0,0 +1,165 @@
+#include "optimizer.h"
+#include "codegen.h"
+
+#include <iomanip>
+#include <stdexcept>
+
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/SmallVectorMemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/EarlyCSE.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+
+static llvm::OptimizationLevel
+to_llvm_level(unsigned level)
+{
+    switch (level) {
+        case 0: return llvm::OptimizationLevel::O0;
+        case 1: return llvm::OptimizationLevel::O1;
+        case 2: return llvm::OptimizationLevel::O2;
+        default: return llvm::OptimizationLevel::O3;
+    }
+}
+
+static std::unique_ptr<llvm::TargetMachine>
+create_host_target_machine(unsigned level, bool position_independent)
+{
+    initialize_native_target();
+
+    auto jtmb = llvm::orc::JITTargetMachineBuilder::detectHost();
+    if (!jtmb) throw std::runtime_error(llvm::toString(jtmb.takeError()));
+
+    jtmb->setCodeGenOptLevel(level == 0 ? llvm::CodeGenOpt::None
+            : level == 1 ? llvm::CodeGenOpt::Less
+            : level == 2 ? llvm::CodeGenOpt::Default
+            : llvm::CodeGenOpt::Aggressive);
+
+    if (position_independent)
+        jtmb->setRelocationModel(llvm::Reloc::PIC_);
+
+    auto tm = jtmb->createTargetMachine();
+    if (!tm) throw std::runtime_error(llvm::toString(tm.takeError()));
+
+    return std::move(*tm);
+}
+
+Optimizer::Optimizer(unsigned level, bool position_independent)
+    : level(level > MAX_LEVEL ? MAX_LEVEL : level),
+    target_machine(create_host_target_machine(this->level, position_independent)),
+    pass_builder(target_machine.get())
+{
+    pass_builder.registerModuleAnalyses(module_analyses);
+    pass_builder.registerCGSCCAnalyses(cgscc_analyses);
+    pass_builder.registerFunctionAnalyses(function_analyses);
+    pass_builder.registerLoopAnalyses(loop_analyses);
+    pass_builder.crossRegisterProxies(loop_analyses, function_analyses,
+            cgscc_analyses, module_analyses);
+
+    /* guppy bodies are single expressions without memory traffic, so the
+     * per-function work is mostly peephole simplification of the
+     * addtmp/multmp chains ValueGen emits and removal of redundancy */
+    if (this->level >= 1) {
+        function_passes.addPass(llvm::InstCombinePass());
+        function_passes.addPass(llvm::ReassociatePass());
+        function_passes.addPass(llvm::SimplifyCFGPass());
+    }
+    if (this->level >= 2) {
+        function_passes.addPass(llvm::EarlyCSEPass());
+        function_passes.addPass(llvm::GVNPass());
+        function_passes.addPass(llvm::InstCombinePass());
+    }
+    if (this->level >= 3) {
+        function_passes.addPass(llvm::ReassociatePass());
+        function_passes.addPass(llvm::GVNPass());
+        function_passes.addPass(llvm::SimplifyCFGPass());
+    }
+
+    if (this->level == 0) {
+        module_passes = pass_builder.buildO0DefaultPipeline(llvm::OptimizationLevel::O0);
+    } else {
+        module_passes = pass_builder.buildPerModuleDefaultPipeline(to_llvm_level(this->level));
+    }
+}
+
+void
+Optimizer::clear_analyses()
+{
+    /* cached results are keyed on IR addresses, which are reused once a
+     * module is handed off and destroyed */
+    loop_analyses.clear();
+    function_analyses.clear();
+    cgscc_analyses.clear();
+    module_analyses.clear();
+}
+
+void
+Optimizer::run_on_function(llvm::Function &function)
+{
+    if (function_passes.isEmpty()) return;
+
+    auto start = std::chrono::steady_clock::now();
+
+    function_passes.run(function, function_analyses);
+    clear_analyses();
+
+    function_stats.elapsed += std::chrono::steady_clock::now() - start;
+    function_stats.runs++;
+}
+
+void
+Optimizer::run_on_module(llvm::Module &module)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    module_passes.run(module, module_analyses);
+    clear_analyses();
+
+    module_stats.elapsed += std::chrono::steady_clock::now() - start;
+    module_stats.runs++;
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+Optimizer::emit_object(llvm::Module &module)
+{
+    llvm::SmallVector<char, 0> object;
+    llvm::raw_svector_ostream stream(object);
+
+    /* the backend is still only reachable through the legacy pass manager */
+    llvm::legacy::PassManager codegen_passes;
+    if (target_machine->addPassesToEmitFile(codegen_passes, stream, nullptr, llvm::CGFT_ObjectFile))
+        throw std::runtime_error("target machine cannot emit object files");
+
+    codegen_passes.run(module);
+
+    return std::make_unique<llvm::SmallVectorMemoryBuffer>(std::move(object),
+            module.getModuleIdentifier() + ".o", false);
+}
+
+void
+Optimizer::merge_stats(const Optimizer &other)
+{
+    function_stats += other.function_stats;
+    module_stats += other.module_stats;
+}
+
+void
+Optimizer::report(std::ostream &out) const
+{
+    auto print_stats = [&out](const char *name, const PipelineStats &stats) {
+        double ms = std::chrono::duration<double, std::milli>(stats.elapsed).count();
+        out << "  " << std::left << std::setw(18) << name
+            << std::right << std::setw(8) << stats.runs << " runs "
+            << std::fixed << std::setprecision(3) << std::setw(12) << ms << " ms";
+        if (stats.runs > 0)
+            out << "  (" << (ms * 1000.0 / stats.runs) << " us/run)";
+        out << std::defaultfloat << '\n';
+    };
+
+    out << "optimization pipelines at -O" << level << ":\n";
+    print_stats("function pipeline", function_stats);
+    print_stats("module pipeline", module_stats);
+}
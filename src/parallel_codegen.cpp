@@ -0,0 +1,187 @@
+#include "parallel_codegen.h"
+#include "optimizer.h"
+
+#include <exception>
+#include <thread>
+#include <unordered_set>
+
+/* below this many definitions per worker, creating the worker's context
+ * and optimizer costs more than it saves */
+static const size_t MIN_DEFNS_PER_WORKER = 32;
+
+static bool
+is_worker_defn(const ASTNode *node)
+{
+    if (node->kind != ASTNode::Kind::DEFN) return false;
+
+    const PrototypeAST *proto = static_cast<const DefnASTNode*>(node)->prototype;
+    return proto->name != sym::ANON && !proto->is_operator();
+}
+
+unsigned
+codegen_worker_count(const AST &ast, unsigned max_threads)
+{
+    size_t defns = 0;
+    for (auto const &node : ast) {
+        if (is_worker_defn(node)) defns++;
+    }
+
+    size_t workers = defns / MIN_DEFNS_PER_WORKER;
+    return static_cast<unsigned>(workers < max_threads ? workers : max_threads);
+}
+
+namespace {
+
+/* throws the CodegenError ValueGen would for a call or operator that is
+ * not (yet) known to the context */
+class ReferenceCheck : public ExprVisitor<ReferenceCheck> {
+    const UnitGeneratorContext &context;
+
+    /* the AST optimizer shares subtrees, visit each only once */
+    std::unordered_set<const ASTExpr*> visited;
+
+public:
+    void apply_to(const VariableASTExpr&) {}
+    void apply_to(const LiteralDoubleASTExpr&) {}
+
+    void apply_to(const BinOpASTExpr &bin_op_expr) {
+        if (!visited.insert(&bin_op_expr).second) return;
+
+        visit(bin_op_expr.LHS);
+        visit(bin_op_expr.RHS);
+
+        if (!is_builtin_operator(bin_op_expr.binop) && !context.operators.count(bin_op_expr.binop))
+            throw CodegenError("unsupported binary operator '"
+                    + std::string(symbol_name(bin_op_expr.binop)) + "'");
+    }
+
+    void apply_to(const CallASTExpr &call_expr) {
+        for (auto const &a : call_expr.args) visit(a);
+
+        auto it = context.prototypes.find(call_expr.callee);
+        if (it == context.prototypes.end())
+            throw CodegenError("call to unknown function '"
+                    + std::string(symbol_name(call_expr.callee)) + "'");
+
+        if (it->second != call_expr.args.size())
+            throw CodegenError("wrong number of arguments in call to '"
+                    + std::string(symbol_name(call_expr.callee)) + "'");
+    }
+
+    explicit ReferenceCheck(const UnitGeneratorContext &context) : context(context) {}
+};
+
+struct Worker {
+    std::vector<const ASTNode*> nodes;
+    std::unique_ptr<Optimizer> optimizer;
+    std::unique_ptr<CompileStats> stats;
+    GeneratedUnit unit;
+    std::exception_ptr error;
+
+    void run(const UnitGeneratorContext &shared, int opt_level, bool emit_objects) {
+        try {
+            UnitGeneratorContext context;
+
+            /* phases are only timed on the caller's thread, the worker
+             * just counts what it generates */
+            if (shared.stats != nullptr) {
+                stats = std::make_unique<CompileStats>();
+                context.stats = stats.get();
+            }
+            context.prototypes = shared.prototypes;
+            context.operators = shared.operators;
+            context.pure_functions = shared.pure_functions;
+            context.math_intrinsics = shared.math_intrinsics;
+            context.externs = shared.externs;
+            context.memoize = shared.memoize;
+            context.memo_table_size = shared.memo_table_size;
+            context.set_fp_flags(shared.fp_flags);
+            if (shared.debug_info) context.set_debug_info(shared.source_name);
+
+            if (opt_level >= 0) {
+                optimizer = std::make_unique<Optimizer>(opt_level);
+                context.set_optimizer(optimizer.get());
+            }
+
+            FunctionGen fgen(&context);
+            for (const ASTNode *node : nodes) {
+                fgen.visit(node);
+            }
+
+            if (optimizer) optimizer->run_on_module(*context.llvm_module);
+            if (stats) stats->optimized_instructions += context.llvm_module->getInstructionCount();
+            if (optimizer && emit_objects)
+                unit.object = optimizer->emit_object(*context.llvm_module);
+
+            unit.module = llvm::orc::ThreadSafeModule(std::move(context.llvm_module),
+                    std::move(context.llvm_context));
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+};
+
+}
+
+std::vector<GeneratedUnit>
+generate_in_parallel(const AST &ast, UnitGeneratorContext &context, unsigned workers,
+        bool emit_objects)
+{
+    /* externs and operators first, on this thread: they are cheap, and
+     * the workers need the complete set of prototypes and operators */
+    std::vector<const ASTNode*> defns;
+    FunctionGen fgen(&context);
+
+    for (auto const &node : ast) {
+        if (is_worker_defn(node)) {
+            auto defn = static_cast<const DefnASTNode*>(node);
+            const PrototypeAST *proto = defn->prototype;
+            context.prototypes[proto->name] = proto->args.size();
+            context.math_intrinsics.erase(proto->name);
+            context.externs.erase(proto->name);
+            ReferenceCheck(context).visit(defn->body);
+            context.record_purity(*defn);
+            defns.push_back(node);
+        } else if (node->kind == ASTNode::Kind::EXTERN
+                || static_cast<const DefnASTNode*>(node)->prototype->is_operator()) {
+            fgen.visit(node);
+        } else {
+            ReferenceCheck(context).visit(static_cast<const DefnASTNode*>(node)->body);
+        }
+    }
+
+    if (workers < 1) workers = 1;
+    if (workers > defns.size()) workers = defns.size() > 0 ? defns.size() : 1;
+
+    std::vector<Worker> pool(workers);
+    for (size_t w = 0; w < workers; w++) {
+        size_t first = defns.size() * w / workers;
+        size_t last = defns.size() * (w + 1) / workers;
+        pool[w].nodes.assign(defns.begin() + first, defns.begin() + last);
+    }
+
+    int opt_level = context.optimizer ? static_cast<int>(context.optimizer->get_level()) : -1;
+
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    for (size_t w = 1; w < workers; w++)
+        threads.emplace_back(&Worker::run, &pool[w], std::cref(context), opt_level, emit_objects);
+
+    /* the calling thread is a worker too */
+    pool[0].run(context, opt_level, emit_objects);
+
+    for (auto &t : threads) t.join();
+
+    std::vector<GeneratedUnit> units;
+    for (auto &worker : pool) {
+        if (worker.error) std::rethrow_exception(worker.error);
+
+        if (context.optimizer && worker.optimizer)
+            context.optimizer->merge_stats(*worker.optimizer);
+        if (context.stats && worker.stats)
+            context.stats->merge_counts(*worker.stats);
+        units.push_back(std::move(worker.unit));
+    }
+
+    return units;
+}
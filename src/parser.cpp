@@ -1,145 +1,80 @@
 #include "parser.h"
 
-void Parser::consumption_handler(bool condition,
-        std::function<void(void)> success_action,
-        std::function<void(void)> failure_action)
-{
-    bool ran_out_of_tokens = token_iter == tokens.end()
-        || token_iter->type == Token::Type::END_OF_FILE;
-
-    if (ran_out_of_tokens) {
-        throw ParseIncomplete();
-    } else if (condition) {
-        success_action();
-        token_iter++;
-    } else {
-        failure_action();
-    }
-}
-
-bool
-Parser::accept(const Token &acceptable_token)
-{
-    bool result;
-
-    std::function<void()> s = [&result]() { result = true; };
-    std::function<void()> f = [&result]() { result = false; };
-
-    consumption_handler(*token_iter == acceptable_token, s, f);
-
-    return result;
-}
-
-bool
-Parser::accept(const Token::Type acceptable_type)
-{
-    bool result;
-
-    std::function<void()> s = [&result]() { result = true; };
-    std::function<void()> f = [&result]() { result = false; };
-
-    consumption_handler(token_iter->type == acceptable_type, s, f);
-
-    return result;
-}
-
-bool
-Parser::accept_and_store(const Token::Type acceptable_type,
-        std::string &container)
-{
-    bool result;
-
-    std::function<void()> s = [&container, &result, this]() {
-        container = this->token_iter->contents;
-        result = true;
-    };
-
-    std::function<void()> f = [&result]() { result = false; };
-
-    consumption_handler(token_iter->type == acceptable_type, s, f);
-
-    return result;
-}
+#include <charconv>
 
 void
-Parser::expect(const Token &expected_token)
+Parser::unexpected_token() const
 {
-
-    std::function<void()> s = []() { return; };
-    std::function<void()> f = [this]() {
-        throw ParseError(*this->token_iter, "unexpected token encountered.");
-    };
-
-    consumption_handler(*token_iter == expected_token, s, f);
+    throw ParseError(*token_iter, "unexpected token encountered.");
 }
 
-void
-Parser::expect(const Token::Type expected_type)
+const PrototypeAST*
+Parser::parse_prototype()
 {
+    SourceLocation location(token_iter->linum, token_iter->colnum);
+    Symbol func_name;
+    expect_and_store(Token::Type::IDENTIFIER, func_name);
 
-    std::function<void()> s = []() { return; };
-    std::function<void()> f = [this]() {
-        throw ParseError(*this->token_iter, "unexpected token encountered.");
-    };
+    expect(Token::Type::RESERVED_SYMBOL, sym::OPEN_PAREN);
 
-    consumption_handler(token_iter->type == expected_type, s, f);
-}
+    size_t base = symbol_stack.size();
+    Symbol arg;
+    while (accept_and_store(Token::Type::IDENTIFIER, arg)) {
+        symbol_stack.push_back(arg);
+        accept(Token::Type::RESERVED_SYMBOL, sym::COMMA);
+    }
 
-void
-Parser::expect_and_store(const Token::Type expected_type, std::string &container)
-{
+    expect(Token::Type::RESERVED_SYMBOL, sym::CLOSE_PAREN);
 
-    std::function<void()> s = [&container, this]() {
-        container = this->token_iter->contents;
-    };
-    std::function<void()> f = [this]() {
-        throw ParseError(*this->token_iter, "unexpected token encountered.");
-    };
+    size_t count = symbol_stack.size() - base;
+    ArenaArray<Symbol> args(arena->copy_array(symbol_stack.data() + base, count), count);
+    symbol_stack.resize(base);
 
-    consumption_handler(token_iter->type == expected_type, s, f);
+    return arena->create<PrototypeAST>(func_name, args, location);
 }
 
-int
-Parser::get_prec(const std::string &s) const
+const PrototypeAST*
+Parser::parse_operator_prototype()
 {
-    for (auto const &b : settings.binops) {
-        if (b.symbol == s) return b.prec;
-    }
+    expect(Token::Type::IDENTIFIER, sym::BINARY);
 
-    throw ParseError(*token_iter, "unrecognized operator encountered");
-}
+    Token op_token = *token_iter;
+    Symbol op;
+    expect_and_store(Token::Type::OPERATOR, op);
 
-BinOp::Associativity
-Parser::get_assoc(const std::string &s) const
-{
-    for (auto const &b : settings.binops) {
-        if (b.symbol == s) return b.assoc;
+    for (const BinOp &b : DEFAULT_BIN_OPS) {
+        if (b.symbol == op)
+            throw ParseError(op_token, "cannot redefine built-in operator.");
     }
 
-    throw ParseError(*token_iter, "unrecognized operator encountered");
-}
+    Token prec_token = *token_iter;
+    std::string_view prec_str;
+    expect_and_store(Token::Type::NUMERIC_LITERAL, prec_str);
 
-std::unique_ptr<PrototypeAST>
-Parser::parse_prototype()
-{
-    std::string func_name;
-    expect_and_store(Token::Type::IDENTIFIER, func_name);
+    int prec = 0;
+    auto conversion = std::from_chars(prec_str.data(), prec_str.data() + prec_str.size(), prec);
+    if (conversion.ec != std::errc() || conversion.ptr != prec_str.data() + prec_str.size()
+            || prec < 1 || prec > MAX_PRECEDENCE)
+        throw ParseError(prec_token, "operator precedence must be an integer from 1 to "
+                + std::to_string(MAX_PRECEDENCE) + ".");
 
-    expect(Token(Token::Type::RESERVED_SYMBOL, "("));
+    expect(Token::Type::RESERVED_SYMBOL, sym::OPEN_PAREN);
 
-    std::vector<std::string> arg_names;
-    std::string arg;
-    while (accept_and_store(Token::Type::IDENTIFIER, arg)) {
-        arg_names.push_back(arg);
-        accept(Token(Token::Type::RESERVED_SYMBOL, ","));
-    }
+    Symbol args[2];
+    expect_and_store(Token::Type::IDENTIFIER, args[0]);
+    expect(Token::Type::RESERVED_SYMBOL, sym::COMMA);
+    expect_and_store(Token::Type::IDENTIFIER, args[1]);
 
-    expect(Token(Token::Type::RESERVED_SYMBOL, ")"));
+    expect(Token::Type::RESERVED_SYMBOL, sym::CLOSE_PAREN);
 
-    return std::make_unique<PrototypeAST>(func_name, std::move(arg_names));
+    /* the rest of the unit may already use the new operator */
+    settings.add_binop(BinOp(op, prec, BinOp::Associativity::LEFT));
+
+    return arena->create<PrototypeAST>(op, ArenaArray<Symbol>(arena->copy_array(args, 2), 2), prec,
+            SourceLocation(op_token.linum, op_token.colnum));
 }
 
-std::unique_ptr<ASTNode>
+const ASTNode*
 Parser::parse_statement()
 {
     if (accept(Token::Type::DEFN)) {
@@ -151,74 +86,75 @@ Parser::parse_statement()
     }
 }
 
-std::unique_ptr<ASTNode>
+const ASTNode*
 Parser::parse_defn()
 {
-    auto prototype = parse_prototype();
-    expect(Token(Token::Type::RESERVED_SYMBOL, "{"));
+    /* 'binary' only introduces an operator when an operator follows it,
+     * so it remains usable as an ordinary function name */
+    bool is_operator = at(Token::Type::IDENTIFIER, sym::BINARY)
+        && (token_iter + 1)->type == Token::Type::OPERATOR;
+
+    auto prototype = is_operator ? parse_operator_prototype() : parse_prototype();
+    expect(Token::Type::RESERVED_SYMBOL, sym::OPEN_CURL);
     auto expr = parse_expr();
-    expect(Token(Token::Type::RESERVED_SYMBOL, "}"));
+    expect(Token::Type::RESERVED_SYMBOL, sym::CLOSE_CURL);
 
-    return std::make_unique<DefnASTNode>(std::move(prototype), std::move(expr));
+    return arena->create<DefnASTNode>(prototype, expr);
 }
 
-std::unique_ptr<ASTNode>
+const ASTNode*
 Parser::parse_extern()
 {
     auto prototype = parse_prototype();
 
-    return std::make_unique<ExternASTNode>(std::move(prototype));
+    return arena->create<ExternASTNode>(prototype);
 }
 
-std::unique_ptr<ASTNode>
+const ASTNode*
 Parser::parse_top_level_expression()
 {
     /* treat top level function as anonymous function with no arguments */
+    SourceLocation location(token_iter->linum, token_iter->colnum);
     auto expr = parse_expr();
-    auto prototype = std::make_unique<PrototypeAST>("__ANON__", std::vector<std::string>());
+    auto prototype = arena->create<PrototypeAST>(sym::ANON, ArenaArray<Symbol>(), location);
 
-    return std::make_unique<DefnASTNode>(std::move(prototype), std::move(expr));
+    return arena->create<DefnASTNode>(prototype, expr);
 }
 
-std::unique_ptr<ASTExpr>
+const ASTExpr*
 Parser::parse_expr()
 {
     return parse_expr(0);
 }
 
-std::unique_ptr<ASTExpr>
+const ASTExpr*
 Parser::parse_expr(int p)
 {
-    std::unique_ptr<ASTExpr> LHS = parse_primary_expr();
+    const ASTExpr* LHS = parse_primary_expr();
 
-    while (token_iter->type == Token::Type::OPERATOR
-            && get_prec(token_iter->contents) >= p)
+    while (token_iter->type == Token::Type::OPERATOR)
     {
-        std::string binop_str = token_iter->contents;
+        const BinOp *binop = settings.find_binop(token_iter->symbol);
+        if (binop == nullptr)
+            throw ParseError(*token_iter, "unrecognized operator encountered");
+
+        if (binop->prec < p) break;
+        SourceLocation location(token_iter->linum, token_iter->colnum);
         token_iter++;
 
-        int q;
-        switch (get_assoc(binop_str))
-        {
-            case BinOp::Associativity::LEFT:
-                q = get_prec(binop_str) + 1;
-                break;
-            case BinOp::Associativity::RIGHT:
-                q = get_prec(binop_str);
-                break;
-        }
+        int q = binop->assoc == BinOp::Associativity::LEFT
+            ? binop->prec + 1
+            : binop->prec;
 
         auto RHS = parse_expr(q);
 
-        // TODO: use shared_ptr or something to have single instance of binops?
-        // for a big file, all these strings will add up
-        LHS = std::make_unique<BinOpASTExpr>(binop_str, std::move(LHS), std::move(RHS));
+        LHS = arena->create<BinOpASTExpr>(binop->symbol, LHS, RHS, location);
     }
 
     return LHS;
 }
 
-std::unique_ptr<ASTExpr>
+const ASTExpr*
 Parser::parse_primary_expr()
 {
     if (token_iter->type == Token::Type::IDENTIFIER) {
@@ -226,7 +162,7 @@ Parser::parse_primary_expr()
     } else if (token_iter->type == Token::Type::NUMERIC_LITERAL) {
         return parse_numeric_literal_expr();
     } else if (token_iter->type == Token::Type::RESERVED_SYMBOL) {
-        if (token_iter->contents == "(") {
+        if (token_iter->symbol == sym::OPEN_PAREN) {
             return parse_paren_expr();
         } else {
             throw ParseError(*token_iter, "unexpected token encountered when attempting to parse primary expression.");
@@ -238,61 +174,181 @@ Parser::parse_primary_expr()
     }
 }
 
-std::unique_ptr<ASTExpr>
+const ASTExpr*
 Parser::parse_identifier_expr()
 {
-    std::string identifier_name;
+    SourceLocation location(token_iter->linum, token_iter->colnum);
+    Symbol identifier_name;
     expect_and_store(Token::Type::IDENTIFIER, identifier_name);
 
-    if (accept(Token(Token::Type::RESERVED_SYMBOL, "("))) {
+    if (accept(Token::Type::RESERVED_SYMBOL, sym::OPEN_PAREN)) {
         /* found open parenthesis so identifier is function call */
 
-        std::vector<std::unique_ptr<ASTExpr>> args;
-        if (*token_iter != Token(Token::Type::RESERVED_SYMBOL, ")")) {
-            do
-                args.push_back(parse_expr());
-            while (accept(Token(Token::Type::RESERVED_SYMBOL, ",")));
+        /* arguments of nested calls are pushed above this one's */
+        size_t base = expr_stack.size();
+        if (!at(Token::Type::RESERVED_SYMBOL, sym::CLOSE_PAREN)) {
+            do {
+                auto arg = parse_expr();
+                expr_stack.push_back(arg);
+            } while (accept(Token::Type::RESERVED_SYMBOL, sym::COMMA));
         }
 
-        expect(Token(Token::Type::RESERVED_SYMBOL, ")"));
+        expect(Token::Type::RESERVED_SYMBOL, sym::CLOSE_PAREN);
+
+        size_t count = expr_stack.size() - base;
+        ArenaArray<const ASTExpr*> arena_args(
+                arena->copy_array(expr_stack.data() + base, count), count);
+        expr_stack.resize(base);
 
-        return std::make_unique<CallASTExpr>(identifier_name, std::move(args));
+        return arena->create<CallASTExpr>(identifier_name, arena_args, location);
 
     } else { /* otherwise it is just a variable */
-        return std::make_unique<VariableASTExpr>(identifier_name);
+        return arena->create<VariableASTExpr>(identifier_name);
     }
 }
 
-std::unique_ptr<ASTExpr>
+const ASTExpr*
 Parser::parse_numeric_literal_expr()
 {
-    std::string double_str;
+    Token literal_token = *token_iter;
+    std::string_view double_str;
     expect_and_store(Token::Type::NUMERIC_LITERAL, double_str);
 
-    return std::make_unique<LiteralDoubleASTExpr>(std::stod(double_str));
+    double value = 0.0;
+    auto conversion = std::from_chars(double_str.data(), double_str.data() + double_str.size(), value);
+    if (conversion.ec != std::errc() || conversion.ptr != double_str.data() + double_str.size())
+        throw ParseError(literal_token, "malformed numeric literal encountered.");
+
+    return arena->create<LiteralDoubleASTExpr>(value);
 }
 
-std::unique_ptr<ASTExpr>
+const ASTExpr*
 Parser::parse_paren_expr()
 {
-    expect(Token(Token::Type::RESERVED_SYMBOL, "("));
+    expect(Token::Type::RESERVED_SYMBOL, sym::OPEN_PAREN);
     auto enclosed_expr = parse_expr();
-    expect(Token(Token::Type::RESERVED_SYMBOL, ")"));
+    expect(Token::Type::RESERVED_SYMBOL, sym::CLOSE_PAREN);
 
     return enclosed_expr;
 }
 
 AST
-Parser::parse_text(const std::string &text)
+Parser::parse_text(std::string_view text)
 {
     AST ast;
-    tokens = tokenize(text);
+    arena = &ast.get_arena();
+    discard_pending();
+
+    /* lex into the parser's own token vector so that its capacity is
+     * reused from one unit to the next */
+    {
+        CompileStats::Scope lex_scope(stats, CompileStats::Phase::LEX);
+        tokens.reserve(text.size() / 4 + 1);
+        tokenize(text, tokens, 1);
+        if (tokens.empty() || tokens.back().type != Token::Type::END_OF_FILE)
+            tokens.push_back(Token(Token::Type::END_OF_FILE, "", Symbol { 0 }, 0, 0));
+    }
     token_iter = tokens.begin();
+    if (stats != nullptr) {
+        stats->source_bytes += text.size();
+        stats->tokens += tokens.size();
+    }
 
-    while (token_iter->type != Token::Type::END_OF_FILE) {
-        ast.push_back(parse_statement());
+    CompileStats::Scope parse_scope(stats, CompileStats::Phase::PARSE);
+    try {
+        while (token_iter->type != Token::Type::END_OF_FILE) {
+            ast.push_back(parse_statement());
+        }
+    } catch (...) {
+        arena = nullptr;
+        discard_pending();
+        throw;
     }
 
+    arena = nullptr;
+    tokens.clear();
+    return ast;
+}
+
+void
+Parser::discard_pending()
+{
     tokens.clear();
-    return std::move(ast);
+    expr_stack.clear();
+    symbol_stack.clear();
+    pending_lines.clear();
+    pending_depth = 0;
+}
+
+AST
+Parser::parse_line(std::string_view line)
+{
+    /* drop the END_OF_FILE that terminated the previous attempt */
+    if (!tokens.empty() && tokens.back().type == Token::Type::END_OF_FILE)
+        tokens.pop_back();
+
+    /* tokens view into the stored line, which the deque never moves */
+    pending_lines.emplace_back(line);
+    size_t first_new_token = tokens.size();
+
+    try {
+        tokenize(pending_lines.back(), tokens, next_linum++);
+    } catch (...) {
+        discard_pending();
+        throw;
+    }
+
+    for (size_t i = first_new_token; i < tokens.size(); i++) {
+        if (tokens[i].type != Token::Type::RESERVED_SYMBOL) continue;
+
+        Symbol s = tokens[i].symbol;
+        if (s == sym::OPEN_PAREN || s == sym::OPEN_CURL) {
+            pending_depth++;
+        } else if (s == sym::CLOSE_PAREN || s == sym::CLOSE_CURL) {
+            pending_depth--;
+        }
+    }
+
+    bool may_be_complete = !tokens.empty() && pending_depth <= 0;
+    if (may_be_complete) {
+        const Token &last = tokens.back();
+        may_be_complete = last.type != Token::Type::OPERATOR
+            && last.type != Token::Type::DEFN
+            && last.type != Token::Type::EXTERN
+            && !(last.type == Token::Type::RESERVED_SYMBOL && last.symbol == sym::COMMA);
+    }
+
+    tokens.push_back(Token(Token::Type::END_OF_FILE, "", Symbol { 0 }, 0, 0));
+
+    if (tokens.size() == 1) {
+        /* nothing but whitespace and comments so far */
+        discard_pending();
+        return AST();
+    }
+
+    if (!may_be_complete) throw ParseIncomplete();
+
+    AST ast;
+    arena = &ast.get_arena();
+    token_iter = tokens.begin();
+
+    try {
+        while (token_iter->type != Token::Type::END_OF_FILE) {
+            ast.push_back(parse_statement());
+        }
+    } catch (const ParseIncomplete&) {
+        /* keep the buffered tokens, the next line continues them */
+        arena = nullptr;
+        expr_stack.clear();
+        symbol_stack.clear();
+        throw;
+    } catch (...) {
+        arena = nullptr;
+        discard_pending();
+        throw;
+    }
+
+    arena = nullptr;
+    discard_pending();
+    return ast;
 }
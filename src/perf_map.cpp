@@ -0,0 +1,59 @@
+#include "perf_map.h"
+#include "jit.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "llvm/Object/SymbolSize.h"
+
+PerfMapListener::PerfMapListener()
+    : path("/tmp/perf-" + std::to_string(getpid()) + ".map")
+{
+    file = std::fopen(path.c_str(), "a");
+    if (file == nullptr)
+        throw JITError("cannot open '" + path + "': " + std::strerror(errno));
+}
+
+PerfMapListener::~PerfMapListener()
+{
+    std::fclose(file);
+}
+
+void
+PerfMapListener::notifyObjectLoaded(ObjectKey, const llvm::object::ObjectFile &object,
+        const llvm::RuntimeDyld::LoadedObjectInfo &info)
+{
+    /* the copy made for debuggers has its sections at their load
+     * addresses, so its symbol addresses are the ones to report */
+    llvm::object::OwningBinary<llvm::object::ObjectFile> loaded = info.getObjectForDebug(object);
+    if (loaded.getBinary() == nullptr) return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto const &symbol_size : llvm::object::computeSymbolSizes(*loaded.getBinary())) {
+        const llvm::object::SymbolRef &symbol = symbol_size.first;
+
+        auto type = symbol.getType();
+        if (!type) {
+            llvm::consumeError(type.takeError());
+            continue;
+        }
+        if (*type != llvm::object::SymbolRef::ST_Function || symbol_size.second == 0) continue;
+
+        auto name = symbol.getName();
+        auto address = symbol.getAddress();
+        if (!name || !address) {
+            llvm::consumeError(name.takeError());
+            llvm::consumeError(address.takeError());
+            continue;
+        }
+
+        std::fprintf(file, "%" PRIx64 " %" PRIx64 " %.*s\n", *address, symbol_size.second,
+                static_cast<int>(name->size()), name->data());
+    }
+
+    std::fflush(file);
+}
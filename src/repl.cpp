@@ -1,30 +1,50 @@
 #include "repl.h"
 
 void
-repl()
+repl(unsigned opt_level, CompileCache *cache, bool tiered, llvm::FastMathFlags fp_flags,
+        unsigned profiling)
 {
-    std::string user_input;
     Parser parser = Parser();
     AST ast;
 
-    auto process_line = [&parser, &user_input, &ast](std::string new_user_input_line) -> void {
+    auto optimizer = std::make_unique<Optimizer>(opt_level);
+    UnitGeneratorContext context;
+    context.set_optimizer(optimizer.get());
+    context.set_fp_flags(fp_flags);
+    GuppyJIT jit;
+    jit.cache = cache;
+    jit.incremental = true;
+    jit.tiered = tiered;
+    jit.tier_up_level = opt_level;
+    bool print_ast = false;
+
+    try {
+        jit.enable_profiling(profiling);
+        if (profiling & GuppyJIT::JITDUMP) context.set_debug_info("<stdin>");
+    } catch (const JITError &err) {
+        std::cout << "error: " << err.what() << ", continuing without profiling" << std::endl;
+    }
+
+    auto process_line = [&parser, &ast](const std::string &new_user_input_line) -> void {
         try
         {
-            user_input += new_user_input_line;
-            ast = parser.parse_text(user_input);
-            user_input.clear();
+            ast = parser.parse_line(new_user_input_line);
         }
 
         catch (ParseIncomplete inc_exc)
         {
-            std::cout << "INCOMPLETE INPUT ENCOUNTERED..." << std::endl;
-            user_input += " ";
             return;
         }
 
-        catch (ParseError perr)
+        catch (const ParseError &perr)
+        {
+            std::cout << "parse error: " << perr.what() << std::endl;
+            return;
+        }
+
+        catch (const std::runtime_error &err)
         {
-            //std::cout << perr.what();
+            std::cout << "error: " << err.what() << std::endl;
             return;
         }
     };
@@ -34,26 +54,70 @@ repl()
 
     while (true)
     {
-        if (user_input.empty()) {
+        if (!parser.has_pending_input()) {
             std::cout << "guppy> " << std::flush;
         } else {
             std::cout << '\t' << std::flush;
         }
-        std::getline(std::cin, user_line);
+
+        if (!std::getline(std::cin, user_line)) break;
 
         if (user_line == ":q") {
             break;
+        } else if (user_line == ":ast") {
+            print_ast = !print_ast;
+            continue;
+        } else if (user_line == ":opt-report") {
+            optimizer->report(std::cout);
+            std::cout << "floating point mode: " << fp_mode_name(context.fp_flags) << std::endl;
+            if (tiered) jit.report_tiering(std::cout);
+            continue;
+        } else if (user_line.compare(0, 4, ":fp ") == 0) {
+            /* like :O<n>, only for code generated from here on */
+            try {
+                llvm::FastMathFlags flags = parse_fp_mode(user_line.substr(4));
+                jit.add_unit(context);
+                context.set_fp_flags(flags);
+                std::cout << "floating point mode set to " << fp_mode_name(flags) << std::endl;
+            } catch (const std::runtime_error &err) {
+                std::cout << "error: " << err.what() << std::endl;
+            }
+            continue;
+        } else if (user_line.size() == 3 && user_line[0] == ':' && user_line[1] == 'O'
+                && user_line[2] >= '0' && user_line[2] <= '3') {
+            /* applies to everything generated from here on, code that has
+             * already been handed to the JIT keeps its optimization level */
+            jit.add_unit(context);
+            optimizer = std::make_unique<Optimizer>(user_line[2] - '0');
+            context.set_optimizer(optimizer.get());
+            jit.tier_up_level = optimizer->get_level();
+            std::cout << "optimization level set to -O" << optimizer->get_level() << std::endl;
+            continue;
         } else {
             process_line(user_line);
         }
 
-        for (auto const &a : ast)
+        if (print_ast) {
+            for (auto const &a : ast)
+            {
+                printer.visit(a);
+            }
+        }
+
+        if (optimizer->get_level() >= 1) optimize_ast(ast);
+
+        try
         {
-            a->inject(printer);
+            jit.execute(ast, context, [](double value) {
+                std::cout << "=> " << value << std::endl;
+            });
         }
-        ast.clear();
 
+        catch (const std::runtime_error &err)
+        {
+            std::cout << "error: " << err.what() << std::endl;
+        }
+
+        ast.clear();
     }
 }
-
-
@@ -0,0 +1,47 @@
+#include "source.h"
+
+#include <cerrno>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+SourceBuffer::SourceBuffer(const std::string &filename)
+    : data(nullptr), size(0), name(filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), filename);
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::generic_category(), filename);
+    }
+
+    size = static_cast<size_t>(st.st_size);
+
+    /* mmap refuses zero length mappings, an empty file is just empty */
+    if (size > 0) {
+        void *mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            int err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(), filename);
+        }
+
+        ::madvise(mapping, size, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(mapping);
+    }
+
+    /* the mapping stays valid after the descriptor is closed */
+    ::close(fd);
+}
+
+SourceBuffer::~SourceBuffer()
+{
+    if (data != nullptr)
+        ::munmap(const_cast<char*>(data), size);
+}
@@ -0,0 +1,167 @@
+#include "symbol.h"
+
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+SymbolTable::SymbolTable()
+    : slots(nullptr), storage_cursor(nullptr), storage_remaining(0),
+      name_chunks(new std::unique_ptr<std::string_view[]>[MAX_NAME_CHUNKS]), count(0)
+{
+    slot_tables.push_back(std::make_unique<SlotTable>(1024));
+    slots.store(slot_tables.back().get(), std::memory_order_release);
+
+    static const char* const PREDEFINED[] = {
+        "__ANON__", "<", "+", "-", "*", "^",
+        ",", ";", ":", "(", ")", "{", "}",
+        "defn", "extern", "binary"
+    };
+
+    for (const char *name : PREDEFINED)
+        intern(name);
+
+    assert(name(sym::ANON) == "__ANON__");
+    assert(name(sym::BINARY) == "binary");
+}
+
+SymbolTable&
+SymbolTable::global()
+{
+    static SymbolTable table;
+    return table;
+}
+
+uint32_t
+SymbolTable::hash(std::string_view name)
+{
+    /* word at a time multiply/xorshift mixing, names are short and this
+     * runs once per identifier token. The tail is read with fixed size
+     * (possibly overlapping) loads rather than a variable length memcpy;
+     * this can make different strings share a word, which only costs a
+     * collision. */
+    const char *p = name.data();
+    size_t n = name.size();
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ n;
+
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        std::memcpy(&w, p, 8);
+        h = (h ^ w) * 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 31;
+    }
+
+    uint64_t w = 0;
+    if (n >= 4) {
+        uint32_t lo, hi;
+        std::memcpy(&lo, p, 4);
+        std::memcpy(&hi, p + n - 4, 4);
+        w = lo | (uint64_t) hi << 32;
+    } else if (n > 0) {
+        w = (uint8_t) p[0] | (uint32_t) (uint8_t) p[n / 2] << 8 | (uint32_t) (uint8_t) p[n - 1] << 16;
+    }
+    h = (h ^ w) * 0x94D049BB133111EBull;
+    h ^= h >> 29;
+
+    return static_cast<uint32_t>(h);
+}
+
+std::string_view
+SymbolTable::store(std::string_view name)
+{
+    if (name.size() > storage_remaining) {
+        size_t block_size = name.size() > STORAGE_BLOCK_SIZE ? name.size() : STORAGE_BLOCK_SIZE;
+        storage.emplace_back(new char[block_size]);
+        storage_cursor = storage.back().get();
+        storage_remaining = block_size;
+    }
+
+    std::memcpy(storage_cursor, name.data(), name.size());
+    std::string_view stored(storage_cursor, name.size());
+    storage_cursor += name.size();
+    storage_remaining -= name.size();
+
+    return stored;
+}
+
+void
+SymbolTable::grow()
+{
+    const SlotTable &old = *slots.load(std::memory_order_relaxed);
+    auto table = std::make_unique<SlotTable>((old.mask + 1) * 2);
+
+    for (size_t k = 0; k <= old.mask; k++) {
+        uint64_t slot = old.slots[k].load(std::memory_order_relaxed);
+        if (static_cast<uint32_t>(slot) == 0) continue;
+
+        size_t i = (slot >> 32) & table->mask;
+        while (table->slots[i].load(std::memory_order_relaxed) != 0) i = (i + 1) & table->mask;
+        table->slots[i].store(slot, std::memory_order_relaxed);
+    }
+
+    slots.store(table.get(), std::memory_order_release);
+    slot_tables.push_back(std::move(table));
+}
+
+bool
+SymbolTable::probe(const SlotTable &table, std::string_view name, uint32_t h,
+        Symbol &s, size_t &end) const
+{
+    for (size_t i = h & table.mask; ; i = (i + 1) & table.mask) {
+        uint64_t slot = table.slots[i].load(std::memory_order_acquire);
+        uint32_t id_plus_one = static_cast<uint32_t>(slot);
+        if (id_plus_one == 0) {
+            end = i;
+            return false;
+        }
+
+        if (static_cast<uint32_t>(slot >> 32) == h && name_slot(id_plus_one - 1) == name) {
+            s = Symbol { id_plus_one - 1 };
+            return true;
+        }
+    }
+}
+
+size_t
+SymbolTable::size()
+{
+    return count.load(std::memory_order_relaxed);
+}
+
+bool
+SymbolTable::find(std::string_view name, Symbol &s)
+{
+    size_t end;
+    return probe(*slots.load(std::memory_order_acquire), name, hash(name), s, end);
+}
+
+Symbol
+SymbolTable::intern(std::string_view name)
+{
+    uint32_t h = hash(name);
+    Symbol s;
+    size_t i;
+
+    /* nearly every token names a symbol that exists already */
+    if (probe(*slots.load(std::memory_order_acquire), name, h, s, i))
+        return s;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    SlotTable &table = *slots.load(std::memory_order_relaxed);
+    if (probe(table, name, h, s, i))
+        return s;
+
+    size_t id = count.load(std::memory_order_relaxed);
+    if (id == NAMES_PER_CHUNK * MAX_NAME_CHUNKS)
+        throw std::length_error("too many distinct symbols");
+
+    s = Symbol { static_cast<uint32_t>(id) };
+    auto &chunk = name_chunks[id / NAMES_PER_CHUNK];
+    if (!chunk) chunk.reset(new std::string_view[NAMES_PER_CHUNK]);
+    chunk[id % NAMES_PER_CHUNK] = store(name);
+    count.store(id + 1, std::memory_order_relaxed);
+    table.slots[i].store(static_cast<uint64_t>(h) << 32 | (s.id + 1), std::memory_order_release);
+
+    if ((id + 1) * 2 > table.mask + 1) grow();
+
+    return s;
+}
@@ -0,0 +1,215 @@
+#include "vm.h"
+
+#include <algorithm>
+#include <cmath>
+
+/* dispatch through a table of label addresses where the compiler supports
+ * it: every instruction ends in its own indirect jump, which predicts far
+ * better than the single jump of a switch */
+#if defined(__GNUC__)
+#define GUPPY_COMPUTED_GOTO 1
+#endif
+
+static double
+call_extern(void *address, size_t argc, const double *a)
+{
+    typedef double (*F0)();
+    typedef double (*F1)(double);
+    typedef double (*F2)(double, double);
+    typedef double (*F3)(double, double, double);
+    typedef double (*F4)(double, double, double, double);
+    typedef double (*F5)(double, double, double, double, double);
+    typedef double (*F6)(double, double, double, double, double, double);
+    typedef double (*F7)(double, double, double, double, double, double, double);
+    typedef double (*F8)(double, double, double, double, double, double, double, double);
+
+    switch (argc) {
+    case 0: return reinterpret_cast<F0>(address)();
+    case 1: return reinterpret_cast<F1>(address)(a[0]);
+    case 2: return reinterpret_cast<F2>(address)(a[0], a[1]);
+    case 3: return reinterpret_cast<F3>(address)(a[0], a[1], a[2]);
+    case 4: return reinterpret_cast<F4>(address)(a[0], a[1], a[2], a[3]);
+    case 5: return reinterpret_cast<F5>(address)(a[0], a[1], a[2], a[3], a[4]);
+    case 6: return reinterpret_cast<F6>(address)(a[0], a[1], a[2], a[3], a[4], a[5]);
+    case 7: return reinterpret_cast<F7>(address)(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+    default: return reinterpret_cast<F8>(address)(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+    }
+}
+
+VM::VM()
+    : stack(new double[STACK_REGISTERS]), frames(new Frame[MAX_CALL_DEPTH]), stats(nullptr) {}
+
+#ifdef GUPPY_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+double
+VM::call(uint16_t index, const double *args)
+{
+    const BytecodeFunction *const functions = program.functions.data();
+    const ExternFunction *const externs = program.externs.data();
+
+    const BytecodeFunction *function = &functions[index];
+    double *registers = stack.get();
+    double *const stack_end = registers + STACK_REGISTERS;
+    if (function->registers > STACK_REGISTERS)
+        throw VMError("stack overflow in '" + function->name + "'");
+
+    std::copy(args, args + function->arity, registers);
+
+    /* the next free frame; frames below it belong to the callers */
+    Frame *frame = frames.get();
+    Frame *const frames_end = frame + MAX_CALL_DEPTH;
+
+    const Instruction *pc = function->code.data();
+    const double *constants = function->constants.data();
+
+#ifdef GUPPY_COMPUTED_GOTO
+    /* in Opcode order */
+    static const void *const dispatch_table[] = {
+        &&op_LOAD_CONST, &&op_MOVE, &&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV, &&op_POW, &&op_LESS,
+        &&op_CALL, &&op_CALL_EXTERN, &&op_RET
+    };
+#define TARGET(op) op_##op:
+#define DISPATCH() goto *dispatch_table[static_cast<uint8_t>(pc->op)]
+    DISPATCH();
+#else
+#define TARGET(op) case Opcode::op:
+#define DISPATCH() continue
+    for (;;) switch (pc->op) {
+#endif
+
+    TARGET(LOAD_CONST) {
+        registers[pc->a] = constants[pc->b];
+        pc++;
+        DISPATCH();
+    }
+
+    TARGET(MOVE) {
+        registers[pc->a] = registers[pc->b];
+        pc++;
+        DISPATCH();
+    }
+
+    TARGET(ADD) {
+        registers[pc->a] = registers[pc->b] + registers[pc->c];
+        pc++;
+        DISPATCH();
+    }
+
+    TARGET(SUB) {
+        registers[pc->a] = registers[pc->b] - registers[pc->c];
+        pc++;
+        DISPATCH();
+    }
+
+    TARGET(MUL) {
+        registers[pc->a] = registers[pc->b] * registers[pc->c];
+        pc++;
+        DISPATCH();
+    }
+
+    TARGET(DIV) {
+        registers[pc->a] = registers[pc->b] / registers[pc->c];
+        pc++;
+        DISPATCH();
+    }
+
+    TARGET(POW) {
+        registers[pc->a] = std::pow(registers[pc->b], registers[pc->c]);
+        pc++;
+        DISPATCH();
+    }
+
+    TARGET(LESS) {
+        /* unordered less than, like the generated code's 'fcmp ult' */
+        registers[pc->a] = !(registers[pc->b] >= registers[pc->c]) ? 1.0 : 0.0;
+        pc++;
+        DISPATCH();
+    }
+
+    TARGET(CALL) {
+        const BytecodeFunction *callee = &functions[pc->c];
+        double *callee_registers = registers + function->registers;
+        if (frame == frames_end || callee->registers > stack_end - callee_registers)
+            throw VMError("stack overflow in '" + callee->name + "'");
+
+        for (size_t i = 0; i < pc->argc; i++)
+            callee_registers[i] = registers[pc->b + i];
+
+        *frame++ = Frame { pc + 1, registers, function, pc->a };
+        function = callee;
+        registers = callee_registers;
+        constants = callee->constants.data();
+        pc = callee->code.data();
+        DISPATCH();
+    }
+
+    TARGET(CALL_EXTERN) {
+        registers[pc->a] = call_extern(externs[pc->c].address, pc->argc, registers + pc->b);
+        pc++;
+        DISPATCH();
+    }
+
+    TARGET(RET) {
+        double value = registers[pc->a];
+        if (frame == frames.get()) return value;
+
+        --frame;
+        function = frame->function;
+        registers = frame->registers;
+        constants = function->constants.data();
+        registers[frame->destination] = value;
+        pc = frame->return_pc;
+        DISPATCH();
+    }
+
+#ifndef GUPPY_COMPUTED_GOTO
+    }
+#endif
+#undef TARGET
+#undef DISPATCH
+}
+
+#ifdef GUPPY_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+std::vector<double>
+VM::execute(const AST &ast, const std::function<void(double)> &on_result)
+{
+    std::vector<double> results;
+    BytecodeCompiler compiler(program);
+
+    for (auto const &node : ast) {
+        bool is_top_level_expr = node->kind == ASTNode::Kind::DEFN
+            && static_cast<const DefnASTNode*>(node)->prototype->name == sym::ANON;
+
+        uint16_t slot;
+        {
+            CompileStats::Scope codegen_scope(stats, CompileStats::Phase::CODEGEN);
+            slot = compiler.visit(node);
+        }
+        if (!is_top_level_expr) continue;
+
+        /* top level expressions are run once and thrown away */
+        struct Discard {
+            BytecodeProgram &program;
+            ~Discard() { program.functions.pop_back(); }
+        } discard = { program };
+        {
+            CompileStats::Scope run_scope(stats, CompileStats::Phase::RUN);
+            results.push_back(call(slot, nullptr));
+        }
+        if (on_result) on_result(results.back());
+    }
+
+    return results;
+}
+
+void
+VM::register_extern(const std::string &name, void *address, size_t arity)
+{
+    program.declare_extern(intern(name), arity, address);
+}